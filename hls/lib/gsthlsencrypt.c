@@ -0,0 +1,210 @@
+/* GStreamer
+ *
+ * gsthlsencrypt.c:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* METHOD=AES-128 segment encryption of cushlssink2, the counterpart of
+ * the decryption in gsthlsdemux.c. Segments are encrypted whole as they
+ * are closed, through EVP so that AES-NI is used where available.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gsthls.h"
+#include "gsthlsencrypt.h"
+
+#if defined(HAVE_OPENSSL)
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#endif
+
+#define GST_CAT_DEFAULT hls_debug
+
+/* chunk of a segment file encrypted per read/write */
+#define ENCRYPT_CHUNK_SIZE (1024 * 1024)
+
+#if defined(HAVE_OPENSSL)
+/* Without IV attribute the IV is the media sequence number as a 128 bit
+ * big-endian integer */
+static void
+hls_encrypt_iv (guint64 sequence, guint8 iv[GST_HLS_KEY_SIZE])
+{
+  memset (iv, 0, GST_HLS_KEY_SIZE);
+  GST_WRITE_UINT64_BE (iv + 8, sequence);
+}
+
+static EVP_CIPHER_CTX *
+hls_encrypt_start (const guint8 key[GST_HLS_KEY_SIZE], guint64 sequence)
+{
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new ();
+  guint8 iv[GST_HLS_KEY_SIZE];
+
+  hls_encrypt_iv (sequence, iv);
+  if (ctx && !EVP_EncryptInit_ex (ctx, EVP_aes_128_cbc (), NULL, key, iv)) {
+    EVP_CIPHER_CTX_free (ctx);
+    ctx = NULL;
+  }
+  return ctx;
+}
+
+gboolean
+gst_hls_encrypt_new_key (guint8 key[GST_HLS_KEY_SIZE])
+{
+  return RAND_bytes (key, GST_HLS_KEY_SIZE) == 1;
+}
+
+GstMemory *
+gst_hls_encrypt_memory (GstMemory * media, const guint8 key[GST_HLS_KEY_SIZE],
+    guint64 sequence)
+{
+  EVP_CIPHER_CTX *ctx;
+  GstMapInfo map;
+  guint8 *out = NULL;
+  gsize out_size;
+  int len, flen;
+
+  g_return_val_if_fail (media != NULL, NULL);
+
+  if (!gst_memory_map (media, &map, GST_MAP_READ)) {
+    gst_memory_unref (media);
+    return NULL;
+  }
+
+  ctx = hls_encrypt_start (key, sequence);
+  if (ctx == NULL || map.size > G_MAXINT - GST_HLS_KEY_SIZE)
+    goto error;
+
+  /* PKCS7 always adds 1 to 16 bytes of padding */
+  out_size = (map.size / GST_HLS_KEY_SIZE + 1) * GST_HLS_KEY_SIZE;
+  out = g_malloc (out_size);
+
+  if (!EVP_EncryptUpdate (ctx, out, &len, map.data, (int) map.size) ||
+      !EVP_EncryptFinal_ex (ctx, out + len, &flen))
+    goto error;
+  g_assert ((gsize) (len + flen) == out_size);
+
+  EVP_CIPHER_CTX_free (ctx);
+  gst_memory_unmap (media, &map);
+  gst_memory_unref (media);
+
+  return gst_memory_new_wrapped (0, out, out_size, 0, out_size, out, g_free);
+
+error:
+  GST_WARNING ("could not encrypt segment %" G_GUINT64_FORMAT, sequence);
+  if (ctx)
+    EVP_CIPHER_CTX_free (ctx);
+  g_free (out);
+  gst_memory_unmap (media, &map);
+  gst_memory_unref (media);
+  return NULL;
+}
+
+gboolean
+gst_hls_encrypt_file (const gchar * location,
+    const guint8 key[GST_HLS_KEY_SIZE], guint64 sequence)
+{
+  EVP_CIPHER_CTX *ctx;
+  guint8 *in, *out;
+  gint64 read_pos = 0, write_pos = 0;
+  gboolean ret = FALSE;
+  FILE *file;
+  int len;
+
+  g_return_val_if_fail (location != NULL, FALSE);
+
+  file = g_fopen (location, "r+b");
+  if (file == NULL) {
+    GST_WARNING ("could not open segment %s", location);
+    return FALSE;
+  }
+
+  ctx = hls_encrypt_start (key, sequence);
+  in = g_malloc (ENCRYPT_CHUNK_SIZE);
+  out = g_malloc (ENCRYPT_CHUNK_SIZE + GST_HLS_KEY_SIZE);
+
+  /* CBC output never gets ahead of its input, so every chunk is written
+   * back over data already read */
+  while (ctx) {
+    gsize n_read;
+
+    if (fseek (file, read_pos, SEEK_SET) != 0)
+      break;
+    n_read = fread (in, 1, ENCRYPT_CHUNK_SIZE, file);
+    read_pos += n_read;
+
+    if (n_read > 0) {
+      if (!EVP_EncryptUpdate (ctx, out, &len, in, (int) n_read))
+        break;
+    } else {
+      if (ferror (file) || !EVP_EncryptFinal_ex (ctx, out, &len))
+        break;
+    }
+
+    if (len > 0 && (fseek (file, write_pos, SEEK_SET) != 0 ||
+            fwrite (out, 1, len, file) != (gsize) len))
+      break;
+    write_pos += len;
+
+    if (n_read == 0) {
+      ret = TRUE;
+      break;
+    }
+  }
+
+  if (fclose (file) != 0)
+    ret = FALSE;
+  if (ctx)
+    EVP_CIPHER_CTX_free (ctx);
+  g_free (in);
+  g_free (out);
+
+  if (!ret)
+    GST_WARNING ("could not encrypt segment %s", location);
+
+  return ret;
+}
+
+#else
+gboolean
+gst_hls_encrypt_new_key (guint8 key[GST_HLS_KEY_SIZE])
+{
+  GST_WARNING ("built without OpenSSL, segment encryption unavailable");
+  return FALSE;
+}
+
+GstMemory *
+gst_hls_encrypt_memory (GstMemory * media, const guint8 key[GST_HLS_KEY_SIZE],
+    guint64 sequence)
+{
+  gst_memory_unref (media);
+  return NULL;
+}
+
+gboolean
+gst_hls_encrypt_file (const gchar * location,
+    const guint8 key[GST_HLS_KEY_SIZE], guint64 sequence)
+{
+  return FALSE;
+}
+#endif
@@ -0,0 +1,48 @@
+/* GStreamer
+ *
+ * gsthlsencrypt.h:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_HLS_ENCRYPT_H__
+#define __GST_HLS_ENCRYPT_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_HLS_KEY_SIZE 16
+
+/* Fill @key with a new random AES-128 key */
+gboolean  gst_hls_encrypt_new_key (guint8 key[GST_HLS_KEY_SIZE]);
+
+/* Encrypt a whole segment with AES-128 CBC and PKCS7 padding, using the
+ * implicit IV of media sequence @sequence. Returns the new encrypted
+ * segment, @media is unreffed */
+GstMemory * gst_hls_encrypt_memory (GstMemory * media,
+                                    const guint8 key[GST_HLS_KEY_SIZE],
+                                    guint64 sequence);
+
+/* Same as gst_hls_encrypt_memory, in place on the segment file at
+ * @location, which grows by the padding */
+gboolean  gst_hls_encrypt_file (const gchar * location,
+                                const guint8 key[GST_HLS_KEY_SIZE],
+                                guint64 sequence);
+
+G_END_DECLS
+
+#endif /* __GST_HLS_ENCRYPT_H__ */
@@ -0,0 +1,490 @@
+/* GStreamer
+ *
+ * gsthlsfmp4.c:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Minimal ISO BMFF walking for cushlssink2 CMAF output.
+ *
+ * splitmuxsink restarts the muxer on every fragment, so every segment file
+ * starts with its own ftyp+moov and its decode times start from zero.
+ * The helpers here split off the init section and move the tfdt
+ * baseMediaDecodeTime of every traf to the fragment's running time, so
+ * that the segments form one continuous timeline behind a single
+ * #EXT-X-MAP.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "gsthls.h"
+#include "gsthlsfmp4.h"
+
+#define GST_CAT_DEFAULT hls_debug
+
+#define FOURCC_moov GST_MAKE_FOURCC('m','o','o','v')
+#define FOURCC_mvhd GST_MAKE_FOURCC('m','v','h','d')
+#define FOURCC_mvex GST_MAKE_FOURCC('m','v','e','x')
+#define FOURCC_mehd GST_MAKE_FOURCC('m','e','h','d')
+#define FOURCC_trak GST_MAKE_FOURCC('t','r','a','k')
+#define FOURCC_tkhd GST_MAKE_FOURCC('t','k','h','d')
+#define FOURCC_mdia GST_MAKE_FOURCC('m','d','i','a')
+#define FOURCC_mdhd GST_MAKE_FOURCC('m','d','h','d')
+#define FOURCC_moof GST_MAKE_FOURCC('m','o','o','f')
+#define FOURCC_styp GST_MAKE_FOURCC('s','t','y','p')
+#define FOURCC_traf GST_MAKE_FOURCC('t','r','a','f')
+#define FOURCC_tfhd GST_MAKE_FOURCC('t','f','h','d')
+#define FOURCC_tfdt GST_MAKE_FOURCC('t','f','d','t')
+
+#define FMP4_MAX_HEADER_SIZE 16
+/* Limit of the init section and of a moof read into memory, the sizes
+ * come from the file and a corrupt one must not make us allocate it */
+#define FMP4_MAX_READ_SIZE (4 * 1024 * 1024)
+
+/* Parse the box header at @data. Returns the header length, or 0 if
+ * there is no complete header. @box_size may exceed @size */
+static guint
+fmp4_box_header (const guint8 * data, gsize size, guint32 * fourcc,
+    guint64 * box_size)
+{
+  guint64 len;
+
+  if (size < 8)
+    return 0;
+
+  len = GST_READ_UINT32_BE (data);
+  *fourcc = GST_READ_UINT32_LE (data + 4);
+
+  if (len == 1) {
+    if (size < 16)
+      return 0;
+    len = GST_READ_UINT64_BE (data + 8);
+    if (len < 16)
+      return 0;
+    *box_size = len;
+    return 16;
+  }
+
+  /* box extends to the end of the enclosing data */
+  if (len == 0)
+    len = size;
+  if (len < 8)
+    return 0;
+
+  *box_size = len;
+  return 8;
+}
+
+/* Find the first child box @fourcc in a container payload */
+static guint8 *
+fmp4_find_child (const guint8 * data, gsize size, guint32 fourcc,
+    gsize * child_size)
+{
+  gsize offset = 0;
+
+  while (offset < size) {
+    guint32 type;
+    guint64 box_size;
+    guint header;
+
+    header = fmp4_box_header (data + offset, size - offset, &type, &box_size);
+    if (header == 0 || box_size > size - offset)
+      return NULL;
+
+    if (type == fourcc) {
+      *child_size = box_size - header;
+      return (guint8 *) data + offset + header;
+    }
+    offset += box_size;
+  }
+
+  return NULL;
+}
+
+gsize
+gst_hls_fmp4_init_size (const guint8 * data, gsize size)
+{
+  gsize offset = 0;
+
+  while (offset < size) {
+    guint32 type;
+    guint64 box_size;
+    guint header;
+
+    header = fmp4_box_header (data + offset, size - offset, &type, &box_size);
+    if (header == 0 || box_size > size - offset)
+      break;
+
+    if (type == FOURCC_moof || type == FOURCC_styp)
+      return offset;
+    offset += box_size;
+  }
+
+  return 0;
+}
+
+gboolean
+gst_hls_fmp4_parse_tracks (const guint8 * init, gsize size,
+    GstHlsFmp4Tracks * tracks)
+{
+  const guint8 *moov;
+  gsize moov_size, offset = 0;
+
+  tracks->n_tracks = 0;
+
+  moov = fmp4_find_child (init, size, FOURCC_moov, &moov_size);
+  if (moov == NULL)
+    return FALSE;
+
+  while (offset < moov_size && tracks->n_tracks < GST_HLS_FMP4_MAX_TRACKS) {
+    const guint8 *tkhd, *mdia, *mdhd;
+    gsize tkhd_size, mdia_size, mdhd_size;
+    guint32 type;
+    guint64 box_size;
+    guint header;
+    guint field;
+
+    header = fmp4_box_header (moov + offset, moov_size - offset, &type,
+        &box_size);
+    if (header == 0 || box_size > moov_size - offset)
+      break;
+
+    if (type == FOURCC_trak) {
+      const guint8 *trak = moov + offset + header;
+      gsize trak_size = box_size - header;
+
+      tkhd = fmp4_find_child (trak, trak_size, FOURCC_tkhd, &tkhd_size);
+      mdia = fmp4_find_child (trak, trak_size, FOURCC_mdia, &mdia_size);
+      mdhd = mdia ? fmp4_find_child (mdia, mdia_size, FOURCC_mdhd,
+          &mdhd_size) : NULL;
+
+      /* tkhd.track_ID and mdhd.timescale follow the creation/modification
+       * times, which are 64 bit in version 1 boxes */
+      if (tkhd && mdhd && tkhd_size >= 24 && mdhd_size >= 24) {
+        field = tkhd[0] == 1 ? 20 : 12;
+        tracks->track_id[tracks->n_tracks] = GST_READ_UINT32_BE (tkhd + field);
+        field = mdhd[0] == 1 ? 20 : 12;
+        tracks->timescale[tracks->n_tracks] = GST_READ_UINT32_BE (mdhd + field);
+        tracks->n_tracks++;
+      }
+    }
+    offset += box_size;
+  }
+
+  return tracks->n_tracks > 0;
+}
+
+/* Zero the creation and modification time and the duration in the
+ * payload of a mvhd, tkhd or mdhd box. The duration follows the
+ * timescale, in tkhd the track_ID and a reserved field */
+static void
+fmp4_clear_times (guint32 fourcc, guint8 * box, gsize size)
+{
+  guint time_size, duration;
+
+  if (size < 4)
+    return;
+
+  time_size = box[0] == 1 ? 8 : 4;
+  duration = 4 + 2 * time_size + (fourcc == FOURCC_tkhd ? 8 : 4);
+  if (size < duration + time_size)
+    return;
+
+  memset (box + 4, 0, 2 * time_size);
+  memset (box + duration, 0, time_size);
+}
+
+/* Clear what a restarted muxer writes differently into the same moov:
+ * the wall clock creation and modification times and the durations */
+static void
+fmp4_normalize_moov (guint8 * moov, gsize size)
+{
+  gsize offset = 0;
+
+  while (offset < size) {
+    guint8 *payload, *child, *mdia;
+    gsize payload_size, child_size, mdia_size;
+    guint32 type;
+    guint64 box_size;
+    guint header;
+
+    header = fmp4_box_header (moov + offset, size - offset, &type, &box_size);
+    if (header == 0 || box_size > size - offset)
+      return;
+
+    payload = moov + offset + header;
+    payload_size = box_size - header;
+
+    switch (type) {
+      case FOURCC_mvhd:
+        fmp4_clear_times (type, payload, payload_size);
+        break;
+      case FOURCC_trak:
+        child = fmp4_find_child (payload, payload_size, FOURCC_tkhd,
+            &child_size);
+        if (child)
+          fmp4_clear_times (FOURCC_tkhd, child, child_size);
+        mdia = fmp4_find_child (payload, payload_size, FOURCC_mdia,
+            &mdia_size);
+        child = mdia ? fmp4_find_child (mdia, mdia_size, FOURCC_mdhd,
+            &child_size) : NULL;
+        if (child)
+          fmp4_clear_times (FOURCC_mdhd, child, child_size);
+        break;
+      case FOURCC_mvex:
+        child = fmp4_find_child (payload, payload_size, FOURCC_mehd,
+            &child_size);
+        if (child && child_size >= 4 &&
+            child_size >= 4 + (child[0] == 1 ? 8 : 4))
+          memset (child + 4, 0, child[0] == 1 ? 8 : 4);
+        break;
+      default:
+        break;
+    }
+    offset += box_size;
+  }
+}
+
+static guint8 *
+fmp4_normalized_copy (GBytes * init, gsize * size)
+{
+  const guint8 *data = g_bytes_get_data (init, size);
+  guint8 *copy = g_malloc (*size), *moov;
+  gsize moov_size;
+
+  memcpy (copy, data, *size);
+  moov = fmp4_find_child (copy, *size, FOURCC_moov, &moov_size);
+  if (moov)
+    fmp4_normalize_moov (moov, moov_size);
+
+  return copy;
+}
+
+gboolean
+gst_hls_fmp4_init_equal (GBytes * a, GBytes * b)
+{
+  guint8 *copy_a, *copy_b;
+  gsize size_a, size_b;
+  gboolean ret;
+
+  if (g_bytes_get_size (a) != g_bytes_get_size (b))
+    return FALSE;
+  if (g_bytes_equal (a, b))
+    return TRUE;
+
+  copy_a = fmp4_normalized_copy (a, &size_a);
+  copy_b = fmp4_normalized_copy (b, &size_b);
+  ret = memcmp (copy_a, copy_b, size_a) == 0;
+  g_free (copy_a);
+  g_free (copy_b);
+
+  return ret;
+}
+
+static guint32
+fmp4_track_timescale (const GstHlsFmp4Tracks * tracks, guint32 track_id)
+{
+  guint i;
+
+  for (i = 0; i < tracks->n_tracks; i++) {
+    if (tracks->track_id[i] == track_id)
+      return tracks->timescale[i];
+  }
+  return 0;
+}
+
+gboolean
+gst_hls_fmp4_shift_moof (guint8 * moof, gsize size,
+    const GstHlsFmp4Tracks * tracks, GstClockTime offset)
+{
+  gsize pos = 0;
+  gboolean ret = TRUE;
+
+  while (pos < size) {
+    guint32 type;
+    guint64 box_size;
+    guint header;
+
+    header = fmp4_box_header (moof + pos, size - pos, &type, &box_size);
+    if (header == 0 || box_size > size - pos)
+      return FALSE;
+
+    if (type == FOURCC_traf) {
+      guint8 *traf = moof + pos + header;
+      gsize traf_size = box_size - header;
+      guint8 *tfhd, *tfdt;
+      gsize tfhd_size, tfdt_size;
+      guint32 timescale;
+      guint64 base_time;
+
+      tfhd = fmp4_find_child (traf, traf_size, FOURCC_tfhd, &tfhd_size);
+      tfdt = fmp4_find_child (traf, traf_size, FOURCC_tfdt, &tfdt_size);
+      if (tfhd == NULL || tfdt == NULL || tfhd_size < 8 || tfdt_size < 8)
+        return FALSE;
+
+      timescale = fmp4_track_timescale (tracks, GST_READ_UINT32_BE (tfhd + 4));
+      if (timescale == 0)
+        return FALSE;
+
+      if (tfdt[0] == 1 && tfdt_size >= 12) {
+        base_time = GST_READ_UINT64_BE (tfdt + 4);
+        base_time += gst_util_uint64_scale (offset, timescale, GST_SECOND);
+        GST_WRITE_UINT64_BE (tfdt + 4, base_time);
+      } else {
+        base_time = GST_READ_UINT32_BE (tfdt + 4);
+        base_time += gst_util_uint64_scale (offset, timescale, GST_SECOND);
+        if (base_time > G_MAXUINT32) {
+          GST_WARNING ("tfdt version 0 can't hold decode time %"
+              G_GUINT64_FORMAT, base_time);
+          ret = FALSE;
+        } else {
+          GST_WRITE_UINT32_BE (tfdt + 4, (guint32) base_time);
+        }
+      }
+    }
+    pos += box_size;
+  }
+
+  return ret;
+}
+
+gboolean
+gst_hls_fmp4_shift_segment (guint8 * data, gsize size,
+    const GstHlsFmp4Tracks * tracks, GstClockTime offset)
+{
+  gsize pos = 0;
+
+  while (pos < size) {
+    guint32 type;
+    guint64 box_size;
+    guint header;
+
+    header = fmp4_box_header (data + pos, size - pos, &type, &box_size);
+    if (header == 0 || box_size > size - pos)
+      return FALSE;
+
+    if (type == FOURCC_moof && !gst_hls_fmp4_shift_moof (data + pos + header,
+            box_size - header, tracks, offset))
+      return FALSE;
+    pos += box_size;
+  }
+
+  return TRUE;
+}
+
+/* Split the init section off the fragment file at @location and move its
+ * decode times by @offset in place. Only the (small) header boxes and moof
+ * boxes are read, mdat payload is skipped */
+gboolean
+gst_hls_fmp4_process_file (const gchar * location, GstClockTime offset,
+    GBytes ** init)
+{
+  GstHlsFmp4Tracks tracks;
+  GByteArray *header_boxes;
+  guint8 *moof = NULL;
+  guint8 hdr[FMP4_MAX_HEADER_SIZE];
+  gboolean have_tracks = FALSE;
+  gboolean ret = FALSE;
+  gint64 pos = 0;
+  FILE *file;
+
+  g_return_val_if_fail (location != NULL, FALSE);
+  g_return_val_if_fail (init != NULL, FALSE);
+
+  file = g_fopen (location, "r+b");
+  if (file == NULL) {
+    GST_WARNING ("could not open fragment %s", location);
+    return FALSE;
+  }
+
+  header_boxes = g_byte_array_new ();
+
+  while (TRUE) {
+    gsize n_read;
+    guint32 type;
+    guint64 box_size;
+    guint header;
+
+    if (fseek (file, pos, SEEK_SET) != 0)
+      break;
+    n_read = fread (hdr, 1, sizeof (hdr), file);
+    if (n_read == 0) {
+      ret = have_tracks;
+      break;
+    }
+    header = fmp4_box_header (hdr, n_read, &type, &box_size);
+    if (header == 0 || GST_READ_UINT32_BE (hdr) == 0)
+      break;
+
+    if (type == FOURCC_moof || type == FOURCC_styp) {
+      if (!have_tracks) {
+        have_tracks = gst_hls_fmp4_parse_tracks (header_boxes->data,
+            header_boxes->len, &tracks);
+        if (!have_tracks)
+          break;
+      }
+    } else if (!have_tracks) {
+      /* still in the init section, keep the whole box */
+      guint len = header_boxes->len;
+
+      if (box_size > FMP4_MAX_READ_SIZE - len) {
+        GST_WARNING ("init section of %s exceeds %u bytes", location,
+            FMP4_MAX_READ_SIZE);
+        break;
+      }
+      g_byte_array_set_size (header_boxes, len + box_size);
+      if (fseek (file, pos, SEEK_SET) != 0 ||
+          fread (header_boxes->data + len, 1, box_size, file) != box_size)
+        break;
+    }
+
+    if (type == FOURCC_moof) {
+      if (box_size > FMP4_MAX_READ_SIZE) {
+        GST_WARNING ("moof of %" G_GUINT64_FORMAT " bytes in %s is too large",
+            box_size, location);
+        break;
+      }
+      moof = g_realloc (moof, box_size);
+      if (fseek (file, pos, SEEK_SET) != 0 ||
+          fread (moof, 1, box_size, file) != box_size)
+        break;
+      if (!gst_hls_fmp4_shift_moof (moof + header, box_size - header,
+              &tracks, offset))
+        break;
+      if (fseek (file, pos, SEEK_SET) != 0 ||
+          fwrite (moof, 1, box_size, file) != box_size)
+        break;
+    }
+    pos += box_size;
+  }
+
+  fclose (file);
+  g_free (moof);
+
+  if (ret) {
+    *init = g_byte_array_free_to_bytes (header_boxes);
+  } else {
+    GST_WARNING ("could not process fmp4 fragment %s", location);
+    g_byte_array_unref (header_boxes);
+  }
+
+  return ret;
+}
@@ -0,0 +1,64 @@
+/* GStreamer
+ *
+ * gsthlsfmp4.h:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_HLS_FMP4_H__
+#define __GST_HLS_FMP4_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_HLS_FMP4_MAX_TRACKS 8
+
+/* track_ID -> mdhd timescale of the tracks found in a moov */
+typedef struct _GstHlsFmp4Tracks
+{
+  guint n_tracks;
+  guint32 track_id[GST_HLS_FMP4_MAX_TRACKS];
+  guint32 timescale[GST_HLS_FMP4_MAX_TRACKS];
+} GstHlsFmp4Tracks;
+
+/* A fragmented mp4 file written by a (re)started muxer looks like
+ * ftyp moov [moof mdat]*. The leading boxes are the media initialization
+ * section (#EXT-X-MAP), the rest is the media segment. */
+gsize     gst_hls_fmp4_init_size (const guint8 * data, gsize size);
+
+/* TRUE if the init sections differ at most in the times and durations a
+ * restarted muxer writes anew */
+gboolean  gst_hls_fmp4_init_equal (GBytes * a, GBytes * b);
+
+gboolean  gst_hls_fmp4_parse_tracks (const guint8 * init, gsize size,
+                                     GstHlsFmp4Tracks * tracks);
+
+gboolean  gst_hls_fmp4_shift_moof (guint8 * moof, gsize size,
+                                   const GstHlsFmp4Tracks * tracks,
+                                   GstClockTime offset);
+
+gboolean  gst_hls_fmp4_shift_segment (guint8 * data, gsize size,
+                                      const GstHlsFmp4Tracks * tracks,
+                                      GstClockTime offset);
+
+gboolean  gst_hls_fmp4_process_file (const gchar * location,
+                                     GstClockTime offset,
+                                     GBytes ** init);
+
+G_END_DECLS
+
+#endif /* __GST_HLS_FMP4_H__ */
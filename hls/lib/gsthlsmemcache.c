@@ -0,0 +1,355 @@
+/* GStreamer
+ *
+ * gsthlsmemcache.c:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Two-tier segment cache of cushlssink2 MODE_MEMORY.
+ *
+ * All entries of all sinks in the process share one memory budget. The
+ * resident entries are kept in recency order, every get moves an entry to
+ * the hot end. When the resident bytes exceed the budget, the coldest
+ * entries are handed to a spill thread, which writes them to a file and
+ * only then drops their memory. Getting a spilled entry reads it back and
+ * makes it resident (and hot) again, so tier placement follows access.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <string.h>
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#endif
+
+#include "gsthls.h"
+#include "gsthlsmemcache.h"
+
+#define GST_CAT_DEFAULT hls_debug
+
+typedef enum
+{
+  ENTRY_RESIDENT,   //data in memory, in the recency list
+  ENTRY_SPILLING,   //data in memory, queued for the spill thread
+  ENTRY_SPILLED,    //data in spill_path only
+} GstHlsCacheTier;
+
+struct _GstHlsCacheEntry
+{
+  gint refcount;
+  GstHlsCacheTier tier;
+  gboolean freed;           //dropped by its sink, spill thread skips it
+  gsize size;
+  GstMemory *media;         //NULL when ENTRY_SPILLED
+  gchar *spill_path;        //file holding the data when ENTRY_SPILLED
+  GList link;               //in resident when ENTRY_RESIDENT, data is entry
+};
+
+/* all fields below are protected by cache_lock */
+static GMutex cache_lock;
+static GCond spill_cond;
+static GQueue resident = G_QUEUE_INIT;   //ENTRY_RESIDENT entries, cold at head
+static guint64 resident_bytes;
+static guint64 budget;                   //0 for unlimited
+static gchar *spill_dir;                 //NULL for g_get_tmp_dir ()
+static GQueue spill_q = G_QUEUE_INIT;    //referenced ENTRY_SPILLING entries
+static GThread *spill_thread;
+
+static gpointer hls_mem_cache_spill_loop (gpointer data);
+
+/* Hand cold entries to the spill thread until the budget holds, called
+ * with cache_lock */
+static void
+hls_mem_cache_balance (void)
+{
+  while (budget > 0 && resident_bytes > budget && resident.head != NULL) {
+    GstHlsCacheEntry *entry = resident.head->data;
+
+    g_queue_unlink (&resident, &entry->link);
+    resident_bytes -= entry->size;
+    entry->tier = ENTRY_SPILLING;
+
+    if (spill_thread == NULL)
+      spill_thread = g_thread_new ("hlscache-spill", hls_mem_cache_spill_loop,
+          NULL);
+    g_queue_push_tail (&spill_q, gst_hls_cache_entry_ref (entry));
+    g_cond_signal (&spill_cond);
+  }
+}
+
+static void
+hls_mem_cache_make_resident (GstHlsCacheEntry * entry)
+{
+  entry->tier = ENTRY_RESIDENT;
+  g_queue_push_tail_link (&resident, &entry->link);
+  resident_bytes += entry->size;
+}
+
+/* Write the data of @media to a new file in the spill directory */
+static gchar *
+hls_mem_cache_write_spill (GstMemory * media)
+{
+  GstMapInfo map;
+  gchar *path;
+  gboolean ok = FALSE;
+  gint fd;
+
+  g_mutex_lock (&cache_lock);
+  path = g_build_filename (spill_dir ? spill_dir : g_get_tmp_dir (),
+      "hlscache-XXXXXX", NULL);
+  g_mutex_unlock (&cache_lock);
+
+  fd = g_mkstemp (path);
+  if (fd < 0) {
+    GST_WARNING ("could not create spill file %s: %s", path,
+        g_strerror (errno));
+    g_free (path);
+    return NULL;
+  }
+
+  if (gst_memory_map (media, &map, GST_MAP_READ)) {
+    const guint8 *data = map.data;
+    gsize left = map.size;
+
+    while (left > 0) {
+      gssize written = write (fd, data, left);
+
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        break;
+      data += written;
+      left -= written;
+    }
+    ok = left == 0;
+    gst_memory_unmap (media, &map);
+  }
+  close (fd);
+
+  if (!ok) {
+    GST_WARNING ("could not write spill file %s", path);
+    g_unlink (path);
+    g_free (path);
+    return NULL;
+  }
+
+  return path;
+}
+
+static gpointer
+hls_mem_cache_spill_loop (gpointer data)
+{
+  while (TRUE) {
+    GstHlsCacheEntry *entry;
+    GstMemory *media;
+    gchar *path;
+
+    g_mutex_lock (&cache_lock);
+    while (g_queue_is_empty (&spill_q))
+      g_cond_wait (&spill_cond, &cache_lock);
+    entry = g_queue_pop_head (&spill_q);
+    media = entry->tier == ENTRY_SPILLING && !entry->freed ?
+        gst_memory_ref (entry->media) : NULL;
+    g_mutex_unlock (&cache_lock);
+
+    path = media ? hls_mem_cache_write_spill (media) : NULL;
+
+    g_mutex_lock (&cache_lock);
+    if (path && entry->tier == ENTRY_SPILLING && !entry->freed) {
+      GST_LOG ("spilled %" G_GSIZE_FORMAT " bytes to %s", entry->size, path);
+      entry->spill_path = path;
+      entry->tier = ENTRY_SPILLED;
+      gst_memory_unref (entry->media);
+      entry->media = NULL;
+    } else {
+      /* read again, freed or write failed while spilling */
+      if (path)
+        g_unlink (path);
+      g_free (path);
+      if (entry->tier == ENTRY_SPILLING && !entry->freed)
+        hls_mem_cache_make_resident (entry);
+    }
+    g_mutex_unlock (&cache_lock);
+
+    if (media)
+      gst_memory_unref (media);
+    gst_hls_cache_entry_unref (entry);
+  }
+
+  return NULL;
+}
+
+GstHlsCacheEntry *
+gst_hls_cache_entry_new (GstMemory * media)
+{
+  GstHlsCacheEntry *entry;
+
+  g_return_val_if_fail (media != NULL, NULL);
+
+  entry = g_slice_new0 (GstHlsCacheEntry);
+  entry->refcount = 1;
+  entry->media = media;
+  entry->size = gst_memory_get_sizes (media, NULL, NULL);
+  entry->link.data = entry;
+
+  g_mutex_lock (&cache_lock);
+  hls_mem_cache_make_resident (entry);
+  hls_mem_cache_balance ();
+  g_mutex_unlock (&cache_lock);
+
+  return entry;
+}
+
+GstHlsCacheEntry *
+gst_hls_cache_entry_ref (GstHlsCacheEntry * entry)
+{
+  g_atomic_int_inc (&entry->refcount);
+  return entry;
+}
+
+void
+gst_hls_cache_entry_unref (GstHlsCacheEntry * entry)
+{
+  if (!g_atomic_int_dec_and_test (&entry->refcount))
+    return;
+
+  if (entry->media)
+    gst_memory_unref (entry->media);
+  g_free (entry->spill_path);
+  g_slice_free (GstHlsCacheEntry, entry);
+}
+
+void
+gst_hls_cache_entry_free (GstHlsCacheEntry * entry)
+{
+  g_return_if_fail (entry != NULL);
+
+  g_mutex_lock (&cache_lock);
+  entry->freed = TRUE;
+  if (entry->tier == ENTRY_RESIDENT) {
+    g_queue_unlink (&resident, &entry->link);
+    resident_bytes -= entry->size;
+  } else if (entry->tier == ENTRY_SPILLED) {
+    g_unlink (entry->spill_path);
+  }
+  g_mutex_unlock (&cache_lock);
+
+  gst_hls_cache_entry_unref (entry);
+}
+
+GstMemory *
+gst_hls_cache_entry_get (GstHlsCacheEntry * entry)
+{
+  GstMemory *media = NULL;
+  gchar *path, *contents;
+  gsize size;
+
+  g_return_val_if_fail (entry != NULL, NULL);
+
+  g_mutex_lock (&cache_lock);
+  if (entry->tier == ENTRY_SPILLED) {
+    path = g_strdup (entry->spill_path);
+  } else {
+    /* a spill in progress is abandoned, the entry is hot again */
+    if (entry->freed) {
+      /* only the caller's reference keeps it */
+    } else if (entry->tier == ENTRY_SPILLING) {
+      hls_mem_cache_make_resident (entry);
+    } else {
+      g_queue_unlink (&resident, &entry->link);
+      g_queue_push_tail_link (&resident, &entry->link);
+    }
+    media = gst_memory_ref (entry->media);
+    g_mutex_unlock (&cache_lock);
+    return media;
+  }
+  g_mutex_unlock (&cache_lock);
+
+  if (!g_file_get_contents (path, &contents, &size, NULL)) {
+    GST_WARNING ("could not read spill file %s", path);
+    g_free (path);
+    return NULL;
+  }
+  g_free (path);
+
+  g_mutex_lock (&cache_lock);
+  if (entry->tier == ENTRY_SPILLED && !entry->freed) {
+    entry->media = gst_memory_new_wrapped (0, contents, size, 0, size,
+        contents, g_free);
+    g_unlink (entry->spill_path);
+    g_free (entry->spill_path);
+    entry->spill_path = NULL;
+    hls_mem_cache_make_resident (entry);
+    hls_mem_cache_balance ();
+    media = gst_memory_ref (entry->media);
+  } else if (entry->media) {
+    /* promoted by a concurrent get */
+    media = gst_memory_ref (entry->media);
+    g_free (contents);
+  } else {
+    media = gst_memory_new_wrapped (0, contents, size, 0, size, contents,
+        g_free);
+  }
+  g_mutex_unlock (&cache_lock);
+
+  return media;
+}
+
+void
+gst_hls_mem_cache_set_budget (guint64 bytes)
+{
+  g_mutex_lock (&cache_lock);
+  budget = bytes;
+  hls_mem_cache_balance ();
+  g_mutex_unlock (&cache_lock);
+}
+
+guint64
+gst_hls_mem_cache_get_budget (void)
+{
+  guint64 ret;
+
+  g_mutex_lock (&cache_lock);
+  ret = budget;
+  g_mutex_unlock (&cache_lock);
+
+  return ret;
+}
+
+void
+gst_hls_mem_cache_set_spill_dir (const gchar * dir)
+{
+  g_mutex_lock (&cache_lock);
+  g_free (spill_dir);
+  spill_dir = g_strdup (dir);
+  g_mutex_unlock (&cache_lock);
+}
+
+gchar *
+gst_hls_mem_cache_get_spill_dir (void)
+{
+  gchar *ret;
+
+  g_mutex_lock (&cache_lock);
+  ret = g_strdup (spill_dir);
+  g_mutex_unlock (&cache_lock);
+
+  return ret;
+}
@@ -0,0 +1,57 @@
+/* GStreamer
+ *
+ * gsthlsmemcache.h:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_HLS_MEM_CACHE_H__
+#define __GST_HLS_MEM_CACHE_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* Segment data of cushlssink2 MODE_MEMORY, kept in RAM or spilled to a
+ * file depending on the process-wide memory budget */
+typedef struct _GstHlsCacheEntry GstHlsCacheEntry;
+
+/* Takes ownership of @media */
+GstHlsCacheEntry * gst_hls_cache_entry_new (GstMemory * media);
+
+GstHlsCacheEntry * gst_hls_cache_entry_ref (GstHlsCacheEntry * entry);
+
+void      gst_hls_cache_entry_unref (GstHlsCacheEntry * entry);
+
+/* Drop the data of @entry from both tiers and unref it */
+void      gst_hls_cache_entry_free (GstHlsCacheEntry * entry);
+
+/* Returns a new reference to the data of @entry, reloading it into memory
+ * if it was spilled. NULL if the spill file can't be read */
+GstMemory * gst_hls_cache_entry_get (GstHlsCacheEntry * entry);
+
+/* Bytes of segment data all sinks of the process keep in memory,
+ * 0 for unlimited */
+void      gst_hls_mem_cache_set_budget (guint64 budget);
+guint64   gst_hls_mem_cache_get_budget (void);
+
+/* Directory of spill files, NULL for the system temp directory */
+void      gst_hls_mem_cache_set_spill_dir (const gchar * dir);
+gchar *   gst_hls_mem_cache_get_spill_dir (void);
+
+G_END_DECLS
+
+#endif /* __GST_HLS_MEM_CACHE_H__ */
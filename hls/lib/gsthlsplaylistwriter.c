@@ -0,0 +1,275 @@
+/* GStreamer
+ *
+ * gsthlsplaylistwriter.c:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Playlist file writing for cushlssink2 disk mode.
+ *
+ * A playlist is rewritten for every fragment, and g_file_set_contents()
+ * fsyncs the temp file each time. Players only need the update to be
+ * atomic, not durable: after a crash the playlist is rewritten with the
+ * next fragment anyway. So by default the temp file is renamed over the
+ * playlist without fsync, or the playlist is overwritten in place.
+ *
+ * Many sinks in one process may share a single writer thread, which
+ * coalesces updates of the same playlist queued while it was busy.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#endif
+
+#include "gsthls.h"
+#include "gsthlsplaylistwriter.h"
+
+#define GST_CAT_DEFAULT hls_debug
+
+typedef struct _HlsPlaylistJob
+{
+  GstElement *owner;        //sink to post write errors on
+  gchar *location;
+  gchar *content;
+  GstHlsPlaylistSync sync;
+} HlsPlaylistJob;
+
+/* process-wide writer, started by the first push and never stopped */
+static GMutex writer_lock;
+static GCond writer_cond;
+static GThread *writer_thread;
+static GQueue writer_q = G_QUEUE_INIT;       //HlsPlaylistJob queue, in from tail
+static GHashTable *writer_pending;           //location -> queued HlsPlaylistJob
+
+GType
+gst_hls_playlist_sync_get_type (void)
+{
+  static GType gtype = 0;
+
+  if (gtype == 0) {
+    static const GEnumValue values[] = {
+      { SYNC_FSYNC, "write temp file, fsync and rename", "fsync"},
+      { SYNC_RENAME, "write temp file and rename without fsync (default)", "rename"},
+      { SYNC_OVERWRITE, "overwrite the open playlist in place, not atomic", "overwrite"},
+      { 0, NULL, NULL}
+    };
+
+    gtype = g_enum_register_static ("GstHlsPlaylistSync", values);
+  }
+  return gtype;
+}
+
+#ifdef G_OS_UNIX
+static gboolean
+hls_playlist_write_all (gint fd, const gchar * content, gsize len,
+    off_t offset)
+{
+  while (len > 0) {
+    gssize written = pwrite (fd, content, len, offset);
+
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return FALSE;
+    }
+    content += written;
+    offset += written;
+    len -= written;
+  }
+  return TRUE;
+}
+
+static gboolean
+hls_playlist_write_rename (const gchar * location, const gchar * content,
+    gsize len, GError ** error)
+{
+  gchar *tmp_location = g_strconcat (location, ".tmp", NULL);
+  gboolean ret = FALSE;
+  gint saved_errno;
+  gint fd;
+
+  fd = g_open (tmp_location, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    saved_errno = errno;
+    goto error;
+  }
+
+  if (!hls_playlist_write_all (fd, content, len, 0)) {
+    saved_errno = errno;
+    close (fd);
+    g_unlink (tmp_location);
+    goto error;
+  }
+  close (fd);
+
+  /* rename is atomic for readers of @location, but not durable without
+   * fsync: after a crash the new name may point to an empty file */
+  if (g_rename (tmp_location, location) != 0) {
+    saved_errno = errno;
+    g_unlink (tmp_location);
+    goto error;
+  }
+  ret = TRUE;
+
+done:
+  g_free (tmp_location);
+  return ret;
+
+error:
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+      "%s: %s", location, g_strerror (saved_errno));
+  goto done;
+}
+
+static gboolean
+hls_playlist_write_overwrite (const gchar * location, const gchar * content,
+    gsize len, gint * fd, GError ** error)
+{
+  gint local_fd = -1;
+  gboolean ret;
+
+  if (fd == NULL)
+    fd = &local_fd;
+
+  if (*fd < 0)
+    *fd = g_open (location, O_WRONLY | O_CREAT, 0666);
+
+  /* readers may see a partial playlist between pwrite and ftruncate */
+  ret = *fd >= 0 && hls_playlist_write_all (*fd, content, len, 0)
+      && ftruncate (*fd, len) == 0;
+  if (!ret) {
+    gint saved_errno = errno;
+
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+        "%s: %s", location, g_strerror (saved_errno));
+  }
+
+  if (local_fd >= 0)
+    close (local_fd);
+
+  return ret;
+}
+#endif
+
+gboolean
+gst_hls_playlist_write (const gchar * location, const gchar * content,
+    gsize len, GstHlsPlaylistSync sync, gint * fd, GError ** error)
+{
+  g_return_val_if_fail (location != NULL, FALSE);
+  g_return_val_if_fail (content != NULL, FALSE);
+
+#ifdef G_OS_UNIX
+  switch (sync) {
+    case SYNC_RENAME:
+      return hls_playlist_write_rename (location, content, len, error);
+    case SYNC_OVERWRITE:
+      return hls_playlist_write_overwrite (location, content, len, fd, error);
+    default:
+      break;
+  }
+#endif
+
+  return g_file_set_contents (location, content, len, error);
+}
+
+static void
+hls_playlist_job_free (HlsPlaylistJob * job)
+{
+  gst_object_unref (job->owner);
+  g_free (job->location);
+  g_free (job->content);
+  g_slice_free (HlsPlaylistJob, job);
+}
+
+/* Write all queued playlists, then wait for more */
+static gpointer
+hls_playlist_writer_loop (gpointer data)
+{
+  GQueue batch = G_QUEUE_INIT;
+
+  while (TRUE) {
+    HlsPlaylistJob *job;
+
+    g_mutex_lock (&writer_lock);
+    while (g_queue_is_empty (&writer_q))
+      g_cond_wait (&writer_cond, &writer_lock);
+    /* jobs leave the pending table, later pushes queue new updates */
+    while ((job = g_queue_pop_head (&writer_q)) != NULL) {
+      g_hash_table_remove (writer_pending, job->location);
+      g_queue_push_tail (&batch, job);
+    }
+    g_mutex_unlock (&writer_lock);
+
+    GST_LOG ("writing batch of %u playlists", batch.length);
+
+    while ((job = g_queue_pop_head (&batch)) != NULL) {
+      GError *error = NULL;
+
+      if (!gst_hls_playlist_write (job->location, job->content,
+              strlen (job->content), job->sync, NULL, &error)) {
+        GST_ELEMENT_ERROR (job->owner, RESOURCE, OPEN_WRITE,
+            (("Failed to write playlist '%s'."), error->message), (NULL));
+        g_error_free (error);
+      }
+      hls_playlist_job_free (job);
+    }
+  }
+
+  return NULL;
+}
+
+void
+gst_hls_playlist_writer_push (GstElement * owner, const gchar * location,
+    gchar * content, GstHlsPlaylistSync sync)
+{
+  HlsPlaylistJob *job;
+
+  g_return_if_fail (GST_IS_ELEMENT (owner));
+  g_return_if_fail (location != NULL);
+
+  g_mutex_lock (&writer_lock);
+  if (writer_thread == NULL) {
+    writer_pending = g_hash_table_new (g_str_hash, g_str_equal);
+    writer_thread = g_thread_new ("hlsplaylist-writer",
+        hls_playlist_writer_loop, NULL);
+  }
+
+  job = g_hash_table_lookup (writer_pending, location);
+  if (job) {
+    /* not written yet, only the latest playlist matters */
+    g_free (job->content);
+    job->content = content;
+    job->sync = sync;
+  } else {
+    job = g_slice_new0 (HlsPlaylistJob);
+    job->owner = gst_object_ref (owner);
+    job->location = g_strdup (location);
+    job->content = content;
+    job->sync = sync;
+    g_hash_table_insert (writer_pending, job->location, job);
+    g_queue_push_tail (&writer_q, job);
+    g_cond_signal (&writer_cond);
+  }
+  g_mutex_unlock (&writer_lock);
+}
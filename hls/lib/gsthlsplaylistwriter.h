@@ -0,0 +1,55 @@
+/* GStreamer
+ *
+ * gsthlsplaylistwriter.h:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_HLS_PLAYLIST_WRITER_H__
+#define __GST_HLS_PLAYLIST_WRITER_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  SYNC_FSYNC = 0,     //temp file, fsync and rename (g_file_set_contents)
+  SYNC_RENAME = 1,    //temp file and rename, no fsync, default
+  SYNC_OVERWRITE = 2, //pwrite and truncate the pre-opened playlist in place
+} GstHlsPlaylistSync;
+
+GType     gst_hls_playlist_sync_get_type (void);
+#define GST_TYPE_HLS_PLAYLIST_SYNC (gst_hls_playlist_sync_get_type ())
+
+/* Write @content to @location. @fd holds the file kept open between calls
+ * with SYNC_OVERWRITE (-1 when not open yet), NULL to open it every time */
+gboolean  gst_hls_playlist_write (const gchar * location,
+                                  const gchar * content, gsize len,
+                                  GstHlsPlaylistSync sync, gint * fd,
+                                  GError ** error);
+
+/* Queue @content (taken) for the process-wide writer thread. Updates of the
+ * same @location not written yet are replaced. Write errors are posted on
+ * @owner */
+void      gst_hls_playlist_writer_push (GstElement * owner,
+                                        const gchar * location,
+                                        gchar * content,
+                                        GstHlsPlaylistSync sync);
+
+G_END_DECLS
+
+#endif /* __GST_HLS_PLAYLIST_WRITER_H__ */
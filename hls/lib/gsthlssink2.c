@@ -35,38 +35,63 @@
 #endif
 
 #include "gsthlssink2.h"
+#include "gsthlsfmp4.h"
+#include "gsthlsplaylistwriter.h"
+#include "gsthlsmemcache.h"
+#include "gsthlsencrypt.h"
 #include <gst/pbutils/pbutils.h>
 #include <gst/video/video.h>
 #include <glib/gstdio.h>
 #include <memory.h>
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#endif
 
 
 GST_DEBUG_CATEGORY_STATIC (gst_hls_sink2_debug);
 #define GST_CAT_DEFAULT gst_hls_sink2_debug
 
 #define DEFAULT_LOCATION "segment%05d.ts"
+#define DEFAULT_CMAF_LOCATION "segment%05d.m4s"
+#define DEFAULT_INIT_LOCATION "init%05d.mp4"
 #define DEFAULT_PLAYLIST_LOCATION "playlist.m3u8"
 #define DEFAULT_PLAYLIST_ROOT NULL
 #define DEFAULT_MAX_FILES 10
+#define DEFAULT_MAX_BYTES 0
+#define DEFAULT_MAX_AGE 0
 #define DEFAULT_TARGET_DURATION 15
 #define DEFAULT_PLAYLIST_LENGTH 5
 #define DEFAULT_CACHE_MODE MODE_DISK
+#define DEFAULT_SEGMENT_FORMAT FORMAT_MPEGTS
+#define DEFAULT_PLAYLIST_SYNC SYNC_RENAME
+#define DEFAULT_SHARED_WRITER FALSE
+#define DEFAULT_MEMORY_BUDGET 0
+#define DEFAULT_SPILL_LOCATION NULL
+#define DEFAULT_ENCRYPTION ENCRYPTION_NONE
+#define DEFAULT_KEY_LOCATION "key%05d.key"
+#define DEFAULT_KEY_ROTATION 0
+#define DEFAULT_PROGRAM_DATE_TIME FALSE
 #define DEFAULT_SPLITMUX_SINK "cussplitmuxsink"//splitmuxsink
 
 #define GST_M3U8_PLAYLIST_VERSION 3
+/* EXT-X-MAP without EXT-X-I-FRAMES-ONLY requires version 6, fMP4 7 */
+#define GST_M3U8_PLAYLIST_CMAF_VERSION 7
+
+/* Commands the bus handler may queue before it waits for the publisher */
+#define MAX_PENDING_PUBLISH 16
 
-#define FIXME_ENABLE_SIGNAL 0
+/* A blocking reload may ask for at most this many segments beyond the
+ * last published one, see HLS spec "Blocking Playlist Reload" */
+#define BLOCKING_RELOAD_MAX_AHEAD 2
 
-#if FIXME_ENABLE_SIGNAL
 enum
 {
-  SIGNAL_0,
-  ON_M3U8_PLAYLIST_SIGNAL,
+  SIGNAL_GET_PLAYLIST,
+  SIGNAL_GET_FRAGMENT,
   LAST_SIGNAL,
 };
 
 static guint gst_hls_sink2_signals[LAST_SIGNAL] = { 0 };
-#endif
 
 enum
 {
@@ -75,9 +100,21 @@ enum
   PROP_PLAYLIST_LOCATION,
   PROP_PLAYLIST_ROOT,
   PROP_MAX_FILES,
+  PROP_MAX_BYTES,
+  PROP_MAX_AGE,
   PROP_TARGET_DURATION,
   PROP_PLAYLIST_LENGTH,
-  PROP_CACHE_MODE
+  PROP_CACHE_MODE,
+  PROP_SEGMENT_FORMAT,
+  PROP_INIT_LOCATION,
+  PROP_PLAYLIST_SYNC,
+  PROP_SHARED_WRITER,
+  PROP_MEMORY_BUDGET,
+  PROP_SPILL_LOCATION,
+  PROP_ENCRYPTION,
+  PROP_KEY_LOCATION,
+  PROP_KEY_ROTATION,
+  PROP_PROGRAM_DATE_TIME
 };
 
 static GstStaticPadTemplate video_template = GST_STATIC_PAD_TEMPLATE ("video",
@@ -93,6 +130,8 @@ static GstStaticPadTemplate audio_template = GST_STATIC_PAD_TEMPLATE ("audio",
 G_DEFINE_TYPE (GstHlsSink2, gst_hls_sink2, GST_TYPE_BIN);
 
 #define GST_HLS_SINK2_CACHE_MODE (gst_hls_sink2_cache_mode_get_type ())
+#define GST_HLS_SINK2_SEGMENT_FORMAT (gst_hls_sink2_segment_format_get_type ())
+#define GST_HLS_SINK2_ENCRYPTION (gst_hls_sink2_encryption_get_type ())
 
 
 static void gst_hls_sink2_set_property (GObject * object, guint prop_id,
@@ -106,6 +145,10 @@ gst_hls_sink2_change_state (GstElement * element, GstStateChange trans);
 static GstPad *gst_hls_sink2_request_new_pad (GstElement * element,
     GstPadTemplate * templ, const gchar * name, const GstCaps * caps);
 static void gst_hls_sink2_release_pad (GstElement * element, GstPad * pad);
+static GstMemory *gst_hls_sink2_get_fragment (GstHlsSink2 * sink,
+    const gchar * location);
+static gchar *gst_hls_sink2_get_playlist (GstHlsSink2 * sink, gint msn,
+    gint part, GstClockTime timeout);
 
 
 static GType
@@ -125,18 +168,95 @@ gst_hls_sink2_cache_mode_get_type (void)
   return gtype;
 }
 
+static GType
+gst_hls_sink2_segment_format_get_type (void)
+{
+  static GType gtype = 0;
+
+  if (gtype == 0) {
+    static const GEnumValue values[] = {
+      { FORMAT_MPEGTS, "MPEG-TS segments (default)", "mpegts"},
+      { FORMAT_CMAF, "fragmented MP4 (CMAF) segments with a shared init segment", "cmaf"},
+      { 0, NULL, NULL}
+    };
+
+    gtype = g_enum_register_static ("GstHlsSink2SegmentFormat", values);
+  }
+  return gtype;
+}
+
+static GType
+gst_hls_sink2_encryption_get_type (void)
+{
+  static GType gtype = 0;
+
+  if (gtype == 0) {
+    static const GEnumValue values[] = {
+      { ENCRYPTION_NONE, "segments in the clear (default)", "none"},
+      { ENCRYPTION_AES_128, "AES-128 CBC encryption of whole MPEG-TS segments", "aes-128"},
+      { 0, NULL, NULL}
+    };
+
+    gtype = g_enum_register_static ("GstHlsSink2Encryption", values);
+  }
+  return gtype;
+}
+
+typedef enum
+{
+  HLS_PUBLISH_FRAGMENT,   //add a closed fragment to the playlist
+  HLS_PUBLISH_END_LIST,   //close the playlist with #EXT-X-ENDLIST
+  HLS_PUBLISH_CONFIGURE,  //apply playlist-length and segment-format changes
+  HLS_PUBLISH_STOP        //leave the publisher thread
+} HlsPublishType;
+
+/* Work item of the publisher thread, see gst_hls_sink2_publisher_loop */
+typedef struct _HlsPublishCmd
+{
+  HlsPublishType type;
+  gchar *location;                  //fragment filename
+  GstClockTime running_time_start;  //running time of first fragment buffer
+  GstClockTime running_time_end;    //running time when fragment closed
+  gint64 program_date_time;         //wall-clock time in us of running_time_start
+  gboolean discont;                 //fragment doesn't continue the previous one
+  GstMemory *media;                 //fragment moved out of memorysink when MODE_MEMORY
+  gint window_size;                 //HLS_PUBLISH_CONFIGURE playlist window
+  guint version;                    //HLS_PUBLISH_CONFIGURE playlist version
+} HlsPublishCmd;
+
+static HlsPublishCmd *
+hls_publish_cmd_new (HlsPublishType type)
+{
+  HlsPublishCmd *cmd = g_slice_new0 (HlsPublishCmd);
+
+  cmd->type = type;
+  return cmd;
+}
+
+static void
+hls_publish_cmd_free (HlsPublishCmd * cmd)
+{
+  g_free (cmd->location);
+  if (cmd->media)
+    gst_memory_unref (cmd->media);
+  g_slice_free (HlsPublishCmd, cmd);
+}
+
 static HlsFragmentBuf*
 hls_fragment_buf_new(gchar* location, GstMemory * media)
 {
   HlsFragmentBuf* buf;
 
   g_return_val_if_fail(location != NULL, NULL);
-  g_return_val_if_fail(media != NULL, NULL);
 
   buf = g_slice_new0(HlsFragmentBuf);
 
   buf->location = g_strdup(location);
-  buf->media = media;
+  if (media) {
+    buf->size = gst_memory_get_sizes (media, NULL, NULL);
+    buf->entry = gst_hls_cache_entry_new (media);
+  }
+  buf->closed_time = g_get_monotonic_time ();
 
   return buf;
 }
@@ -147,7 +267,8 @@ hls_fragment_buf_free (HlsFragmentBuf * buf)
   g_return_if_fail (buf != NULL);
 
   g_free(buf->location);
-  gst_memory_unref(buf->media);
+  if (buf->entry)
+    gst_hls_cache_entry_free (buf->entry);
 
   g_slice_free (HlsFragmentBuf, buf);
 }
@@ -179,17 +300,31 @@ gst_hls_sink2_finalize (GObject * object)
   g_free (sink->location);
   g_free (sink->playlist_location);
   g_free (sink->playlist_root);
+  g_free (sink->init_location);
+  g_free (sink->key_location);
   if (sink->playlist)
     gst_m3u8_playlist_free (sink->playlist);
 
-  g_queue_foreach (&sink->old_locations, (GFunc) g_free, NULL);
-  g_queue_clear (&sink->old_locations);
-
   hls_playlist_replace(&sink->playlist_cache, NULL);
 
   g_queue_foreach (&sink->fragment_cache, (GFunc) hls_fragment_buf_free, NULL);
   g_queue_clear (&sink->fragment_cache);
 
+  if (sink->init_data)
+    g_bytes_unref (sink->init_data);
+  g_queue_foreach (&sink->init_cache, (GFunc) hls_fragment_buf_free, NULL);
+  g_queue_clear (&sink->init_cache);
+  g_queue_foreach (&sink->key_cache, (GFunc) hls_fragment_buf_free, NULL);
+  g_queue_clear (&sink->key_cache);
+
+  g_cond_clear (&sink->cache_cond);
+  g_mutex_clear (&sink->cache_lock);
+
+  g_queue_foreach (&sink->publish_q, (GFunc) hls_publish_cmd_free, NULL);
+  g_queue_clear (&sink->publish_q);
+  g_cond_clear (&sink->publish_cond);
+  g_mutex_clear (&sink->publish_lock);
+
   G_OBJECT_CLASS (parent_class)->finalize ((GObject *) sink);
 }
 
@@ -238,10 +373,23 @@ gst_hls_sink2_class_init (GstHlsSink2Class * klass)
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
   g_object_class_install_property (gobject_class, PROP_MAX_FILES,
       g_param_spec_uint ("max-files", "Max files",
-          "Maximum number of files to keep on disk. Once the maximum is reached,"
-          "old files start to be deleted to make room for new ones.",
+          "Maximum number of files to keep on disk or in memory. Once the "
+          "maximum is reached, old files start to be deleted to make room for "
+          "new ones. Files in the playlist are always kept (0 = unlimited)",
           0, G_MAXUINT, DEFAULT_MAX_FILES,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MAX_BYTES,
+      g_param_spec_uint64 ("max-bytes", "Max bytes",
+          "Maximum total size of files to keep on disk or in memory. "
+          "Files in the playlist are always kept (0 = unlimited)",
+          0, G_MAXUINT64, DEFAULT_MAX_BYTES,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MAX_AGE,
+      g_param_spec_uint ("max-age", "Max age",
+          "Maximum age in seconds of files to keep on disk or in memory. "
+          "Files in the playlist are always kept (0 = unlimited)",
+          0, G_MAXUINT, DEFAULT_MAX_AGE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
   g_object_class_install_property (gobject_class, PROP_TARGET_DURATION,
       g_param_spec_uint ("target-duration", "Target duration",
           "The target duration in seconds of a segment/file. "
@@ -261,46 +409,168 @@ gst_hls_sink2_class_init (GstHlsSink2Class * klass)
           "Cache mode of m3u8 playlist content and segments,on disk or memory",
           GST_HLS_SINK2_CACHE_MODE, DEFAULT_CACHE_MODE, 
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_SEGMENT_FORMAT,
+      g_param_spec_enum ("segment-format", "Segment Format",
+          "Container of segments, MPEG-TS or fragmented MP4 (CMAF) announced "
+          "by #EXT-X-MAP. Must be set before requesting pads",
+          GST_HLS_SINK2_SEGMENT_FORMAT, DEFAULT_SEGMENT_FORMAT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_INIT_LOCATION,
+      g_param_spec_string ("init-location", "Init Segment Location",
+          "Location of the init segment to write when segment-format is cmaf",
+          DEFAULT_INIT_LOCATION, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_PLAYLIST_SYNC,
+      g_param_spec_enum ("playlist-sync", "Playlist Sync",
+          "How the playlist is written in disk mode. Updates are atomic "
+          "without fsync by default, as every fragment rewrites the playlist",
+          GST_TYPE_HLS_PLAYLIST_SYNC, DEFAULT_PLAYLIST_SYNC,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_SHARED_WRITER,
+      g_param_spec_boolean ("shared-writer", "Shared Writer",
+          "Hand playlists to one writer thread shared by all sinks of the "
+          "process, which batches pending updates, in disk mode",
+          DEFAULT_SHARED_WRITER, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MEMORY_BUDGET,
+      g_param_spec_uint64 ("memory-budget", "Memory Budget",
+          "Process-wide: bytes of segments all sinks of the process keep in "
+          "memory in memory mode, setting it on one sink changes it for all. "
+          "Least recently used segments beyond it are spilled to "
+          "spill-location (0 = unlimited)",
+          0, G_MAXUINT64, DEFAULT_MEMORY_BUDGET,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_SPILL_LOCATION,
+      g_param_spec_string ("spill-location", "Spill Location",
+          "Process-wide: directory of segments spilled from memory by all "
+          "sinks of the process, setting it on one sink changes it for all "
+          "(NULL = system temp directory)",
+          DEFAULT_SPILL_LOCATION, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ENCRYPTION,
+      g_param_spec_enum ("encryption", "Encryption",
+          "Encryption of segments as they are closed, announced by "
+          "#EXT-X-KEY. Only MPEG-TS segments are encrypted",
+          GST_HLS_SINK2_ENCRYPTION, DEFAULT_ENCRYPTION,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_KEY_LOCATION,
+      g_param_spec_string ("key-location", "Key Location",
+          "Location of the key files to write when encrypting",
+          DEFAULT_KEY_LOCATION, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_KEY_ROTATION,
+      g_param_spec_uint ("key-rotation", "Key Rotation",
+          "Number of segments encrypted with the same key before a new one "
+          "is generated (0 = one key per stream)",
+          0, G_MAXUINT, DEFAULT_KEY_ROTATION,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_PROGRAM_DATE_TIME,
+      g_param_spec_boolean ("program-date-time", "Program Date Time",
+          "Map every segment to wall-clock time with "
+          "#EXT-X-PROGRAM-DATE-TIME",
+          DEFAULT_PROGRAM_DATE_TIME,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstHlsSink2::get-playlist:
+   * @hlssink2: the #GstHlsSink2
+   * @msn: media sequence number requested by _HLS_msn, -1 for no blocking
+   * @part: part index requested by _HLS_part, -1 if not given
+   * @timeout: maximum time in ns to block, GST_CLOCK_TIME_NONE to wait forever
+   *
+   * When called by the user, this action signal returns the m3u8 playlist
+   * cached in MODE_MEMORY. If @msn is given, it blocks until the playlist
+   * containing media sequence @msn is published (or the stream ends) and
+   * returns it immediately afterwards. Segments are published whole, so
+   * any @part of @msn is satisfied by the same playlist.
+   *
+   * Returns: newly allocated playlist content, or NULL if @msn is too far
+   * ahead, the wait timed out or the sink is shutting down
+   */
+  gst_hls_sink2_signals[SIGNAL_GET_PLAYLIST] =
+      g_signal_new ("get-playlist", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, G_STRUCT_OFFSET (GstHlsSink2Class,
+          get_playlist), NULL, NULL, NULL, G_TYPE_STRING, 3, G_TYPE_INT,
+      G_TYPE_INT, G_TYPE_UINT64);
+  klass->get_playlist = gst_hls_sink2_get_playlist;
 
-  #if FIXME_ENABLE_SIGNAL
   /**
-   * GstHlsSink2::on-m3u8-playlist:
+   * GstHlsSink2::get-fragment:
    * @hlssink2: the #GstHlsSink2
+   * @location: segment or init segment name, as in the playlist or as
+   * written by splitmuxsink
    *
-   * When called by the user, this action signal returns m3u8 playlist immediately.
-   * Maybe ts cache buffer together
+   * When called by the user, this action signal returns the data of a
+   * segment retained in MODE_MEMORY, whether it is held in memory or was
+   * spilled to spill-location.
    *
-   * !!!
+   * Returns: (transfer full): the segment data, or NULL if it is not retained
    */
-  gst_hls_sink2_signals[ON_M3U8_PLAYLIST_SIGNAL] =
-      g_signal_new_class_handler("get-playlist", G_TYPE_FROM_CLASS(klass),
-      G_SIGNAL_RUN_LAST, NULL, NULL, NULL, NULL, G_TYPE_STRING, 0);
-  #endif
+  gst_hls_sink2_signals[SIGNAL_GET_FRAGMENT] =
+      g_signal_new ("get-fragment", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, G_STRUCT_OFFSET (GstHlsSink2Class,
+          get_fragment), NULL, NULL, NULL, GST_TYPE_MEMORY, 1, G_TYPE_STRING);
+  klass->get_fragment = gst_hls_sink2_get_fragment;
 }
 
+/* (Re)create the muxer of splitmuxsink for the segment format */
 static void
-gst_hls_sink2_init (GstHlsSink2 * sink)
+gst_hls_sink2_set_muxer (GstHlsSink2 * sink)
 {
   GstElement *mux;
 
+  if (sink->segment_format == FORMAT_CMAF) {
+    /* one moof per segment, no mfra at the end of every fragment */
+    mux = gst_element_factory_make ("mp4mux", NULL);
+    if (mux)
+      g_object_set (mux, "fragment-duration", sink->target_duration * 1000,
+          "streamable", TRUE, NULL);
+  } else {
+    mux = gst_element_factory_make ("mpegtsmux", NULL);
+  }
+
+  if (mux == NULL) {
+    GST_ERROR_OBJECT (sink, "could not create muxer for segment format %d",
+        sink->segment_format);
+    return;
+  }
+  g_object_set (sink->splitmuxsink, "muxer", mux, NULL);
+}
+
+static void
+gst_hls_sink2_init (GstHlsSink2 * sink)
+{
   sink->location = g_strdup (DEFAULT_LOCATION);
   sink->playlist_location = g_strdup (DEFAULT_PLAYLIST_LOCATION);
   sink->playlist_root = g_strdup (DEFAULT_PLAYLIST_ROOT);
   sink->playlist_length = DEFAULT_PLAYLIST_LENGTH;
   sink->max_files = DEFAULT_MAX_FILES;
+  sink->max_bytes = DEFAULT_MAX_BYTES;
+  sink->max_age = DEFAULT_MAX_AGE;
   sink->target_duration = DEFAULT_TARGET_DURATION;
   sink->cache_mode = DEFAULT_CACHE_MODE;
-  g_queue_init (&sink->old_locations);
+  sink->segment_format = DEFAULT_SEGMENT_FORMAT;
+  sink->init_location = g_strdup (DEFAULT_INIT_LOCATION);
+  sink->playlist_sync = DEFAULT_PLAYLIST_SYNC;
+  sink->shared_writer = DEFAULT_SHARED_WRITER;
+  sink->playlist_fd = -1;
+  sink->encryption = DEFAULT_ENCRYPTION;
+  sink->key_location = g_strdup (DEFAULT_KEY_LOCATION);
+  sink->key_rotation = DEFAULT_KEY_ROTATION;
+  sink->program_date_time = DEFAULT_PROGRAM_DATE_TIME;
   sink->playlist_cache = NULL;
   g_queue_init (&sink->fragment_cache);
+  g_queue_init (&sink->init_cache);
+  g_queue_init (&sink->key_cache);
+  g_mutex_init (&sink->cache_lock);
+  g_cond_init (&sink->cache_cond);
+  g_mutex_init (&sink->publish_lock);
+  g_cond_init (&sink->publish_cond);
+  g_queue_init (&sink->publish_q);
 
   sink->splitmuxsink = gst_element_factory_make (DEFAULT_SPLITMUX_SINK, NULL);
   gst_bin_add (GST_BIN (sink), sink->splitmuxsink);
 
-  mux = gst_element_factory_make ("mpegtsmux", NULL);
   g_object_set (sink->splitmuxsink, "location", sink->location, "max-size-time",
       ((GstClockTime) sink->target_duration * GST_SECOND),
-      "send-keyframe-requests", TRUE, "muxer", mux, NULL);
+      "send-keyframe-requests", TRUE, NULL);
+  gst_hls_sink2_set_muxer (sink);
 
   GST_OBJECT_FLAG_SET (sink, GST_ELEMENT_FLAG_SINK);
 
@@ -315,16 +585,471 @@ gst_hls_sink2_reset (GstHlsSink2 * sink)
   if (sink->playlist)
     gst_m3u8_playlist_free (sink->playlist);
   sink->playlist =
-      gst_m3u8_playlist_new (GST_M3U8_PLAYLIST_VERSION, sink->playlist_length,
-      FALSE);
-
-  g_queue_foreach (&sink->old_locations, (GFunc) g_free, NULL);
-  g_queue_clear (&sink->old_locations);
-
+      gst_m3u8_playlist_new (sink->segment_format == FORMAT_CMAF ?
+      GST_M3U8_PLAYLIST_CMAF_VERSION : GST_M3U8_PLAYLIST_VERSION,
+      sink->playlist_length, FALSE);
+
+  if (sink->init_data)
+    g_bytes_unref (sink->init_data);
+  sink->init_data = NULL;
+  sink->init_index = 0;
+  sink->key_index = 0;
+  sink->key_segments = 0;
+  sink->have_wallclock = FALSE;
+
+  g_mutex_lock (&sink->cache_lock);
   hls_playlist_replace(&sink->playlist_cache, NULL);
-  
+  sink->published_sequence = 0;
+  sink->published_end = FALSE;
+  /* blocked readers return, they would never see the old sequence again */
+  sink->cache_flushing = TRUE;
+  g_cond_broadcast (&sink->cache_cond);
+
+  g_queue_foreach (&sink->init_cache, (GFunc) hls_fragment_buf_free, NULL);
+  g_queue_clear (&sink->init_cache);
   g_queue_foreach (&sink->fragment_cache, (GFunc) hls_fragment_buf_free, NULL);
   g_queue_clear (&sink->fragment_cache);
+  g_queue_foreach (&sink->key_cache, (GFunc) hls_fragment_buf_free, NULL);
+  g_queue_clear (&sink->key_cache);
+  g_mutex_unlock (&sink->cache_lock);
+  sink->retained_bytes = 0;
+
+#ifdef G_OS_UNIX
+  if (sink->playlist_fd >= 0)
+    close (sink->playlist_fd);
+#endif
+  sink->playlist_fd = -1;
+}
+
+/* Publish playlist content of MODE_MEMORY and wake all blocked readers
+ * at once, takes ownership of @playlist_content */
+static void
+gst_hls_sink2_publish_playlist (GstHlsSink2 * sink, gchar * playlist_content)
+{
+  g_mutex_lock (&sink->cache_lock);
+  hls_playlist_replace(&sink->playlist_cache, playlist_content);
+  sink->published_sequence = sink->playlist->sequence_number;
+  sink->published_end = sink->playlist->end_list;
+  g_cond_broadcast (&sink->cache_cond);
+  g_mutex_unlock (&sink->cache_lock);
+
+  GST_LOG_OBJECT (sink, "published playlist up to media sequence %d",
+      (gint) sink->published_sequence - 1);
+}
+
+static gchar *
+gst_hls_sink2_get_playlist (GstHlsSink2 * sink, gint msn, gint part,
+    GstClockTime timeout)
+{
+  gchar *playlist_content = NULL;
+  gint64 end_time = 0;
+
+  if (GST_CLOCK_TIME_IS_VALID (timeout))
+    end_time = g_get_monotonic_time () + timeout / GST_USECOND;
+
+  g_mutex_lock (&sink->cache_lock);
+
+  if (msn >= 0) {
+    if (msn >= (gint64) sink->published_sequence + BLOCKING_RELOAD_MAX_AHEAD
+        && !sink->published_end) {
+      GST_DEBUG_OBJECT (sink, "requested media sequence %d (part %d) too far "
+          "ahead of %d", msn, part, (gint) sink->published_sequence - 1);
+      goto done;
+    }
+
+    /* whole segments are published, so the part of msn is ready along with
+     * msn itself */
+    while (msn >= (gint64) sink->published_sequence && !sink->published_end
+        && !sink->cache_flushing) {
+      GST_TRACE_OBJECT (sink, "waiting for media sequence %d part %d",
+          msn, part);
+      if (end_time == 0) {
+        g_cond_wait (&sink->cache_cond, &sink->cache_lock);
+      } else if (!g_cond_wait_until (&sink->cache_cond, &sink->cache_lock,
+              end_time)) {
+        GST_DEBUG_OBJECT (sink, "timeout waiting for media sequence %d", msn);
+        goto done;
+      }
+    }
+    if (msn >= (gint64) sink->published_sequence && !sink->published_end)
+      goto done;
+  }
+
+  playlist_content = g_strdup (sink->playlist_cache);
+
+done:
+  g_mutex_unlock (&sink->cache_lock);
+  return playlist_content;
+}
+
+static HlsFragmentBuf *
+hls_fragment_cache_find (GQueue * cache, const gchar * location)
+{
+  const gchar *wanted = strrchr (location, '/');
+  GList *l;
+
+  //entry locations carry playlist_root, match by file name
+  wanted = wanted ? wanted + 1 : location;
+  for (l = cache->tail; l != NULL; l = l->prev) {
+    HlsFragmentBuf *buf = l->data;
+    const gchar *name = strrchr (buf->location, '/');
+
+    name = name ? name + 1 : buf->location;
+    if (strcmp (name, wanted) == 0)
+      return buf;
+  }
+  return NULL;
+}
+
+static GstMemory *
+gst_hls_sink2_get_fragment (GstHlsSink2 * sink, const gchar * location)
+{
+  GstHlsCacheEntry *entry = NULL;
+  HlsFragmentBuf *buf;
+  GstMemory *media;
+
+  g_return_val_if_fail (location != NULL, NULL);
+
+  g_mutex_lock (&sink->cache_lock);
+  buf = hls_fragment_cache_find (&sink->fragment_cache, location);
+  if (buf == NULL)
+    buf = hls_fragment_cache_find (&sink->init_cache, location);
+  if (buf == NULL)
+    buf = hls_fragment_cache_find (&sink->key_cache, location);
+  if (buf && buf->entry)
+    entry = gst_hls_cache_entry_ref (buf->entry);
+  g_mutex_unlock (&sink->cache_lock);
+
+  if (entry == NULL) {
+    GST_DEBUG_OBJECT (sink, "fragment %s is not retained", location);
+    return NULL;
+  }
+
+  //may read a spilled segment back, don't block the publisher meanwhile
+  media = gst_hls_cache_entry_get (entry);
+  gst_hls_cache_entry_unref (entry);
+
+  return media;
+}
+
+//build m3u8 entry-location of a fragment or init segment
+static gchar *
+gst_hls_sink2_entry_location (GstHlsSink2 * sink, const gchar * location)
+{
+  gchar *entry_location;
+
+  if (sink->playlist_root == NULL) {
+    entry_location = g_path_get_basename (location);
+  } else {
+    gchar *name = g_path_get_basename (location);
+    entry_location = g_build_filename (sink->playlist_root, name, NULL);
+    g_free (name);
+  }
+  return entry_location;
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#endif
+/* Announce @init by #EXT-X-MAP for the following entries, a new init
+ * segment is only written when the moov changed. Takes ownership of @init */
+static void
+gst_hls_sink2_update_init (GstHlsSink2 * sink, GBytes * init)
+{
+  gchar *location, *entry_location;
+  gsize size;
+  const guint8 *data;
+  GError *error = NULL;
+  HlsFragmentBuf *buf;
+
+  if (sink->init_data && gst_hls_fmp4_init_equal (sink->init_data, init)) {
+    g_bytes_unref (init);
+    return;
+  }
+
+  data = g_bytes_get_data (init, &size);
+  location = g_strdup_printf (sink->init_location, sink->init_index++);
+
+  if (sink->cache_mode == MODE_DISK) {
+    if (!g_file_set_contents (location, (const gchar *) data, size, &error)) {
+      GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_WRITE,
+          (("Failed to write init segment '%s'."), error->message), (NULL));
+      g_error_free (error);
+    }
+    buf = hls_fragment_buf_new (location, NULL);
+  } else {
+    GstMemory *media = gst_memory_new_wrapped (GST_MEMORY_FLAG_READONLY,
+        (gpointer) data, size, 0, size, g_bytes_ref (init),
+        (GDestroyNotify) g_bytes_unref);
+
+    buf = hls_fragment_buf_new (location, media);
+  }
+  //kept as long as retained fragments refer to it, see enforce_retention
+  buf->sequence = sink->index;
+  g_mutex_lock (&sink->cache_lock);
+  g_queue_push_tail (&sink->init_cache, buf);
+  g_mutex_unlock (&sink->cache_lock);
+
+  GST_INFO_OBJECT (sink, "new init segment %s of %" G_GSIZE_FORMAT " bytes",
+      location, size);
+
+  entry_location = gst_hls_sink2_entry_location (sink, location);
+  gst_m3u8_playlist_set_map (sink->playlist, entry_location);
+  g_free (entry_location);
+  g_free (location);
+
+  if (sink->init_data)
+    g_bytes_unref (sink->init_data);
+  sink->init_data = init;
+}
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+/* Split off the init section of a fragmented mp4 held in @media and move
+ * its decode times to the fragment's running time */
+static GstMemory *
+gst_hls_sink2_process_cmaf_memory (GstHlsSink2 * sink, HlsPublishCmd * cmd,
+    GstMemory * media)
+{
+  GstHlsFmp4Tracks tracks;
+  GstMapInfo map;
+  GstMemory *segment;
+  gsize init_size;
+
+  if (!gst_memory_map (media, &map, GST_MAP_READWRITE)) {
+    GST_WARNING_OBJECT (sink, "could not map fragment %s", cmd->location);
+    return media;
+  }
+
+  init_size = gst_hls_fmp4_init_size (map.data, map.size);
+  if (init_size == 0
+      || !gst_hls_fmp4_parse_tracks (map.data, init_size, &tracks)
+      || !gst_hls_fmp4_shift_segment (map.data + init_size,
+          map.size - init_size, &tracks, cmd->running_time_start)) {
+    GST_WARNING_OBJECT (sink, "fragment %s is not fragmented mp4",
+        cmd->location);
+    gst_memory_unmap (media, &map);
+    return media;
+  }
+
+  gst_hls_sink2_update_init (sink, g_bytes_new (map.data, init_size));
+  gst_memory_unmap (media, &map);
+
+  segment = gst_memory_share (media, init_size, -1);
+  gst_memory_unref (media);
+
+  return segment;
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#endif
+/* Start a new key every key_rotation segments and announce it by
+ * #EXT-X-KEY for the following entries. Returns FALSE if segments can't be
+ * encrypted */
+static gboolean
+gst_hls_sink2_rotate_key (GstHlsSink2 * sink)
+{
+  gchar *location, *entry_location;
+  HlsFragmentBuf *buf;
+  GError *error = NULL;
+
+  if (sink->key_segments > 0 && (sink->key_rotation == 0 ||
+          sink->key_segments < sink->key_rotation)) {
+    sink->key_segments++;
+    return TRUE;
+  }
+
+  if (!gst_hls_encrypt_new_key (sink->key)) {
+    GST_ELEMENT_ERROR (sink, LIBRARY, INIT,
+        ("Failed to generate encryption key."), (NULL));
+    return FALSE;
+  }
+
+  location = g_strdup_printf (sink->key_location, sink->key_index++);
+
+  if (sink->cache_mode == MODE_DISK) {
+    if (!g_file_set_contents (location, (const gchar *) sink->key,
+            GST_HLS_KEY_SIZE, &error)) {
+      GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_WRITE,
+          (("Failed to write key '%s'."), error->message), (NULL));
+      g_error_free (error);
+      g_free (location);
+      return FALSE;
+    }
+    buf = hls_fragment_buf_new (location, NULL);
+  } else {
+    GBytes *key = g_bytes_new (sink->key, GST_HLS_KEY_SIZE);
+
+    buf = hls_fragment_buf_new (location,
+        gst_memory_new_wrapped (GST_MEMORY_FLAG_READONLY,
+            (gpointer) g_bytes_get_data (key, NULL), GST_HLS_KEY_SIZE, 0,
+            GST_HLS_KEY_SIZE, key, (GDestroyNotify) g_bytes_unref));
+  }
+  buf->sequence = sink->index;
+  g_mutex_lock (&sink->cache_lock);
+  g_queue_push_tail (&sink->key_cache, buf);
+  g_mutex_unlock (&sink->cache_lock);
+
+  GST_INFO_OBJECT (sink, "new key %s from media sequence %u", location,
+      sink->index);
+
+  entry_location = gst_hls_sink2_entry_location (sink, location);
+  gst_m3u8_playlist_set_key (sink->playlist, "AES-128", entry_location, NULL);
+  g_free (entry_location);
+  g_free (location);
+
+  sink->key_segments = 1;
+  return TRUE;
+}
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+/* Take over the closed fragment: cache it when MODE_MEMORY and split off
+ * the init segment when FORMAT_CMAF. Sets @init_size to the size of the
+ * init section still heading the fragment file, to be skipped by
+ * #EXT-X-BYTERANGE. Returns FALSE if the fragment can't be served, it
+ * must not be published then */
+static gboolean
+gst_hls_sink2_take_fragment (GstHlsSink2 * sink, HlsPublishCmd * cmd,
+    gboolean encrypt, gsize * init_size)
+{
+  HlsFragmentBuf* buf = NULL;
+
+  *init_size = 0;
+
+  if (sink->cache_mode == MODE_DISK) {
+    GBytes *init = NULL;
+    GStatBuf st;
+
+    if (sink->segment_format == FORMAT_CMAF &&
+        gst_hls_fmp4_process_file (cmd->location, cmd->running_time_start,
+            &init)) {
+      *init_size = g_bytes_get_size (init);
+      gst_hls_sink2_update_init (sink, init);
+    }
+
+    if (encrypt && !gst_hls_encrypt_file (cmd->location, sink->key,
+            sink->index)) {
+      //partly encrypted, no player can use it
+      GST_ELEMENT_ERROR (sink, RESOURCE, WRITE,
+          ("Failed to encrypt segment '%s'.", cmd->location), (NULL));
+      g_unlink (cmd->location);
+      return FALSE;
+    }
+
+    buf = hls_fragment_buf_new(cmd->location, NULL);
+    if (g_stat (cmd->location, &st) == 0)
+      buf->size = st.st_size;
+  } else if (sink->cache_mode == MODE_MEMORY) {
+    GstMemory *media = cmd->media;
+
+    cmd->media = NULL;
+    if(media==NULL) {
+      GST_WARNING("move NULL media");
+      return FALSE;
+    }
+    if (sink->segment_format == FORMAT_CMAF)
+      media = gst_hls_sink2_process_cmaf_memory (sink, cmd, media);
+    if (encrypt) {
+      media = gst_hls_encrypt_memory (media, sink->key, sink->index);
+      if (media == NULL) {
+        GST_ELEMENT_ERROR (sink, RESOURCE, WRITE,
+            ("Failed to encrypt segment '%s'.", cmd->location), (NULL));
+        return FALSE;
+      }
+    }
+
+    GST_DEBUG_OBJECT(sink, "caching fragment %s with memory %" GST_PTR_FORMAT,
+      cmd->location, media);
+
+    //the cache may spill media as soon as it owns it
+    buf = hls_fragment_buf_new(cmd->location, media);
+  }
+
+  if (buf) {
+    buf->sequence = sink->index;
+    g_mutex_lock (&sink->cache_lock);
+    g_queue_push_tail(&sink->fragment_cache, buf);
+    g_mutex_unlock (&sink->cache_lock);
+    sink->retained_bytes += buf->size;
+  }
+
+  return buf != NULL;
+}
+
+/* Evict the oldest fragments beyond the retention limits. Retention is
+ * a DVR window behind the playlist: fragments still in the playlist are
+ * never evicted, whatever the limits */
+static void
+gst_hls_sink2_enforce_retention (GstHlsSink2 * sink)
+{
+  guint min_files = g_queue_get_length (sink->playlist->entries);
+  gint64 now = g_get_monotonic_time ();
+  HlsFragmentBuf *buf;
+
+  while (g_queue_get_length (&sink->fragment_cache) > min_files) {
+    guint n_files = g_queue_get_length (&sink->fragment_cache);
+
+    buf = g_queue_peek_head (&sink->fragment_cache);
+
+    if (!(sink->max_files > 0 && n_files > sink->max_files) &&
+        !(sink->max_bytes > 0 && sink->retained_bytes > sink->max_bytes) &&
+        !(sink->max_age > 0 &&
+            now - buf->closed_time > (gint64) sink->max_age * G_USEC_PER_SEC))
+      break;
+
+    g_mutex_lock (&sink->cache_lock);
+    g_queue_pop_head (&sink->fragment_cache);
+    g_mutex_unlock (&sink->cache_lock);
+    sink->retained_bytes -= buf->size;
+
+    GST_DEBUG_OBJECT (sink, "evicting fragment %s", buf->location);
+    if (sink->cache_mode == MODE_DISK)//remove fragment file on disk
+      g_remove (buf->location);
+    hls_fragment_buf_free (buf);
+  }
+
+  //a key goes once the next key covers the oldest retained fragment
+  buf = g_queue_peek_head (&sink->fragment_cache);
+  while (buf && g_queue_get_length (&sink->key_cache) > 1) {
+    HlsFragmentBuf *next_key = g_queue_peek_nth (&sink->key_cache, 1);
+    HlsFragmentBuf *key;
+
+    if (next_key->sequence > buf->sequence)
+      break;
+
+    g_mutex_lock (&sink->cache_lock);
+    key = g_queue_pop_head (&sink->key_cache);
+    g_mutex_unlock (&sink->cache_lock);
+
+    GST_DEBUG_OBJECT (sink, "evicting key %s", key->location);
+    if (sink->cache_mode == MODE_DISK)
+      g_remove (key->location);
+    hls_fragment_buf_free (key);
+  }
+
+  //same for an init segment, once the next one covers the oldest fragment
+  while (buf && g_queue_get_length (&sink->init_cache) > 1) {
+    HlsFragmentBuf *next_init = g_queue_peek_nth (&sink->init_cache, 1);
+    HlsFragmentBuf *init;
+
+    if (next_init->sequence > buf->sequence)
+      break;
+
+    g_mutex_lock (&sink->cache_lock);
+    init = g_queue_pop_head (&sink->init_cache);
+    g_mutex_unlock (&sink->cache_lock);
+
+    GST_DEBUG_OBJECT (sink, "evicting init segment %s", init->location);
+    if (sink->cache_mode == MODE_DISK)
+      g_remove (init->location);
+    hls_fragment_buf_free (init);
+  }
 }
 
 static void
@@ -334,10 +1059,16 @@ gst_hls_sink2_write_playlist (GstHlsSink2 * sink)
   GError *error = NULL;
 
   playlist_content = gst_m3u8_playlist_render (sink->playlist);
-  if( sink->cache_mode == MODE_DISK )
+  if( sink->cache_mode == MODE_DISK && sink->shared_writer )
+  {
+    gst_hls_playlist_writer_push (GST_ELEMENT_CAST (sink),
+        sink->playlist_location, playlist_content, sink->playlist_sync);
+  }
+  else if( sink->cache_mode == MODE_DISK )
   {
-    if (!g_file_set_contents (sink->playlist_location,
-      playlist_content, -1, &error)) {
+    if (!gst_hls_playlist_write (sink->playlist_location, playlist_content,
+      strlen (playlist_content), sink->playlist_sync, &sink->playlist_fd,
+      &error)) {
         GST_ERROR ("Failed to write playlist: %s", error->message);
         GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_WRITE,
           (("Failed to write playlist '%s'."), error->message), (NULL));
@@ -348,27 +1079,227 @@ gst_hls_sink2_write_playlist (GstHlsSink2 * sink)
   }
   else if( sink->cache_mode == MODE_MEMORY )
   {
-    GstMemory *media = NULL;
-    HlsFragmentBuf* buf;
+    //segment is in cache (gst_hls_sink2_take_fragment) before its playlist wakes up readers
+    gst_hls_sink2_publish_playlist (sink, playlist_content);
+  }
+  else
+  {
+    g_warn_if_reached();
+  }
+}
 
-    g_signal_emit_by_name (sink->inner_sink, "move", sink->current_location, &media);
-    if(media==NULL) {
-      GST_WARNING("move NULL media");
-      return;
+/* Add a closed fragment to the playlist, called by the publisher thread */
+static void
+gst_hls_sink2_publish_fragment (GstHlsSink2 * sink, HlsPublishCmd * cmd)
+{
+  gchar *entry_location;
+  gboolean encrypt = FALSE;
+  gsize init_size;
+
+  GST_INFO_OBJECT (sink, "COUNT %d", sink->index);
+  //CMAF would need SAMPLE-AES (cbcs), whole-segment AES-128 is for MPEG-TS
+  if (sink->encryption == ENCRYPTION_AES_128 &&
+      sink->segment_format == FORMAT_MPEGTS)
+    encrypt = gst_hls_sink2_rotate_key (sink);
+  if (!encrypt)
+    gst_m3u8_playlist_set_key (sink->playlist, NULL, NULL, NULL);
+
+  if (!gst_hls_sink2_take_fragment (sink, cmd, encrypt, &init_size)) {
+    GST_WARNING_OBJECT (sink, "not publishing fragment %s", cmd->location);
+    return;
+  }
+  entry_location = gst_hls_sink2_entry_location (sink, cmd->location);
+
+  gst_m3u8_playlist_add_entry (sink->playlist, entry_location,
+      NULL, cmd->running_time_end - cmd->running_time_start,
+      sink->index++, cmd->discont);
+  g_free (entry_location);
+
+  if (sink->program_date_time) {
+    GDateTime *epoch = g_date_time_new_from_unix_utc (0);
+    GDateTime *date_time = g_date_time_add (epoch, cmd->program_date_time);
+
+    gst_m3u8_playlist_set_program_date_time (sink->playlist, date_time);
+    g_date_time_unref (date_time);
+    g_date_time_unref (epoch);
+  }
+
+  if (init_size > 0) {
+    HlsFragmentBuf *buf = g_queue_peek_tail (&sink->fragment_cache);
+
+    //segment is the rest of the fragment file behind its own moov
+    if (buf && buf->size > init_size)
+      gst_m3u8_playlist_set_byterange (sink->playlist,
+          buf->size - init_size, init_size);
+  }
+}
+
+/* Publisher thread: renders and writes the playlist, post-processes
+ * fragments and deletes old ones, so that none of that blocks the
+ * streaming thread posting splitmuxsink messages. Commands are handled in
+ * order, all commands pending at wake-up form a batch that publishes the
+ * playlist only once */
+static gpointer
+gst_hls_sink2_publisher_loop (GstHlsSink2 * sink)
+{
+  GQueue batch = G_QUEUE_INIT;
+  gboolean running = TRUE;
+
+  while (running) {
+    HlsPublishCmd *cmd;
+    gboolean publish = FALSE;
+
+    g_mutex_lock (&sink->publish_lock);
+    while (g_queue_is_empty (&sink->publish_q))
+      g_cond_wait (&sink->publish_cond, &sink->publish_lock);
+    while ((cmd = g_queue_pop_head (&sink->publish_q)) != NULL)
+      g_queue_push_tail (&batch, cmd);
+    /* wake up the bus handler if it waits for room */
+    g_cond_broadcast (&sink->publish_cond);
+    g_mutex_unlock (&sink->publish_lock);
+
+    GST_LOG_OBJECT (sink, "publishing batch of %u commands", batch.length);
+
+    while ((cmd = g_queue_pop_head (&batch)) != NULL) {
+      switch (cmd->type) {
+        case HLS_PUBLISH_FRAGMENT:
+          gst_hls_sink2_publish_fragment (sink, cmd);
+          publish = TRUE;
+          break;
+        case HLS_PUBLISH_END_LIST:
+          sink->playlist->end_list = TRUE;
+          publish = TRUE;
+          break;
+        case HLS_PUBLISH_CONFIGURE:
+          sink->playlist->window_size = cmd->window_size;
+          sink->playlist->version = cmd->version;
+          break;
+        case HLS_PUBLISH_STOP:
+          running = FALSE;
+          break;
+      }
+      hls_publish_cmd_free (cmd);
     }
-    buf = hls_fragment_buf_new(sink->current_location, media);
-    
-    GST_DEBUG_OBJECT(sink, "HlsFragmentBuf %" GST_PTR_FORMAT 
-      "for fragment %s with memory %" GST_PTR_FORMAT, buf, sink->current_location, media);
 
-    g_queue_push_tail(&sink->fragment_cache, buf);
+    if (publish) {
+      gst_hls_sink2_write_playlist (sink);
+      //remove out-of-date fragment on disk or on memory-cache
+      gst_hls_sink2_enforce_retention (sink);
+    }
+  }
 
-    hls_playlist_replace(&sink->playlist_cache, playlist_content);
+  return NULL;
+}
+
+/* Queue @cmd for the publisher, waits while MAX_PENDING_PUBLISH commands
+ * are pending so a stalled storage can't grow the queue forever */
+static void
+gst_hls_sink2_push_command (GstHlsSink2 * sink, HlsPublishCmd * cmd)
+{
+  g_mutex_lock (&sink->publish_lock);
+  while (cmd->type != HLS_PUBLISH_STOP && sink->publisher != NULL &&
+      g_queue_get_length (&sink->publish_q) >= MAX_PENDING_PUBLISH) {
+    GST_WARNING_OBJECT (sink, "publisher is falling behind, waiting");
+    g_cond_wait (&sink->publish_cond, &sink->publish_lock);
   }
-  else
-  {
-    g_warn_if_reached();
+  g_queue_push_tail (&sink->publish_q, cmd);
+  g_cond_broadcast (&sink->publish_cond);
+  g_mutex_unlock (&sink->publish_lock);
+}
+
+static void
+gst_hls_sink2_start_publisher (GstHlsSink2 * sink)
+{
+  GThread *publisher;
+
+  if (sink->publisher != NULL)
+    return;
+
+  publisher = g_thread_new ("hlssink2-publish",
+      (GThreadFunc) gst_hls_sink2_publisher_loop, sink);
+
+  g_mutex_lock (&sink->publish_lock);
+  sink->publisher = publisher;
+  g_mutex_unlock (&sink->publish_lock);
+}
+
+/* Drain all pending commands and join the publisher */
+static void
+gst_hls_sink2_stop_publisher (GstHlsSink2 * sink)
+{
+  GThread *publisher = sink->publisher;
+
+  if (publisher == NULL)
+    return;
+
+  gst_hls_sink2_push_command (sink, hls_publish_cmd_new (HLS_PUBLISH_STOP));
+  g_thread_join (publisher);
+
+  g_mutex_lock (&sink->publish_lock);
+  sink->publisher = NULL;
+  g_cond_broadcast (&sink->publish_cond);
+  g_mutex_unlock (&sink->publish_lock);
+}
+
+/* Apply playlist-length and segment-format to sink->playlist. The
+ * publisher thread owns the playlist while it runs, the change is queued
+ * to it then */
+static void
+gst_hls_sink2_configure_playlist (GstHlsSink2 * sink)
+{
+  HlsPublishCmd *cmd;
+  guint version = (sink->segment_format == FORMAT_CMAF) ?
+      GST_M3U8_PLAYLIST_CMAF_VERSION : GST_M3U8_PLAYLIST_VERSION;
+
+  g_mutex_lock (&sink->publish_lock);
+  if (sink->publisher == NULL) {
+    sink->playlist->window_size = sink->playlist_length;
+    sink->playlist->version = version;
+    g_mutex_unlock (&sink->publish_lock);
+    return;
+  }
+  g_mutex_unlock (&sink->publish_lock);
+
+  cmd = hls_publish_cmd_new (HLS_PUBLISH_CONFIGURE);
+  cmd->window_size = sink->playlist_length;
+  cmd->version = version;
+  gst_hls_sink2_push_command (sink, cmd);
+}
+
+/* Wall-clock time in us of the pipeline's running time @running_time,
+ * as it is now */
+static gint64
+gst_hls_sink2_wallclock_now (GstHlsSink2 * sink, GstClockTime running_time)
+{
+  gint64 now = g_get_real_time ();
+  GstClock *clock = gst_element_get_clock (GST_ELEMENT_CAST (sink));
+
+  if (clock) {
+    GstClockTime base_time = gst_element_get_base_time (GST_ELEMENT_CAST (sink));
+    GstClockTimeDiff late = GST_CLOCK_DIFF (base_time + running_time,
+        gst_clock_get_time (clock));
+
+    now -= late / GST_USECOND;
+    gst_object_unref (clock);
+  }
+  return now;
+}
+
+/* Map the start of the closed fragment to wall-clock time. Running time
+ * keeps a fixed offset to the wall clock so that program date times
+ * follow the segment durations, the offset is taken again after a
+ * discontinuity */
+static gint64
+gst_hls_sink2_program_date_time (GstHlsSink2 * sink, gboolean discont)
+{
+  GstClockTime start = sink->current_running_time_start;
+
+  if (!sink->have_wallclock || discont) {
+    sink->wallclock_offset = sink->current_wallclock_start -
+        (gint64) (start / GST_USECOND);
+    sink->have_wallclock = TRUE;
   }
+  return sink->wallclock_offset + (gint64) (start / GST_USECOND);
 }
 
 static void
@@ -387,59 +1318,44 @@ gst_hls_sink2_handle_message (GstBin * bin, GstMessage * message)
               g_strdup (gst_structure_get_string (s, "location"));
           gst_structure_get_clock_time (s, "running-time",
               &sink->current_running_time_start);
+          sink->current_wallclock_start = gst_hls_sink2_wallclock_now (sink,
+              sink->current_running_time_start);
         } else if (gst_structure_has_name (s, "splitmuxsink-fragment-closed")) {
-          GstClockTime running_time;
-          gchar *entry_location;
+          HlsPublishCmd *cmd = hls_publish_cmd_new (HLS_PUBLISH_FRAGMENT);
 
           g_assert (strcmp (sink->current_location, gst_structure_get_string (s,
                       "location")) == 0);
 
-          gst_structure_get_clock_time (s, "running-time", &running_time);
-
-          GST_INFO_OBJECT (sink, "COUNT %d", sink->index);
-          if (sink->playlist_root == NULL) {
-            entry_location = g_path_get_basename (sink->current_location);
-          } else {
-            gchar *name = g_path_get_basename (sink->current_location);
-            entry_location = g_build_filename (sink->playlist_root, name, NULL);
-            g_free (name);
+          cmd->location = g_strdup (sink->current_location);
+          cmd->running_time_start = sink->current_running_time_start;
+          gst_structure_get_clock_time (s, "running-time",
+              &cmd->running_time_end);
+          //upstream restarts show up as DISCONT buffers or new caps
+          gst_structure_get_boolean (s, "discont", &cmd->discont);
+          cmd->program_date_time =
+              gst_hls_sink2_program_date_time (sink, cmd->discont);
+
+          //memorysink reuses its buffer for the next fragment, take it now.
+          //With a standby pair the fragment was written by a clone of
+          //inner_sink, which the message names
+          if (sink->cache_mode == MODE_MEMORY) {
+            GstElement *writer = NULL;
+
+            gst_structure_get (s, "sink", GST_TYPE_ELEMENT, &writer, NULL);
+            g_signal_emit_by_name (writer ? writer : sink->inner_sink, "move",
+                sink->current_location, &cmd->media);
+            if (writer)
+              gst_object_unref (writer);
           }
 
-          gst_m3u8_playlist_add_entry (sink->playlist, entry_location,
-              NULL, running_time - sink->current_running_time_start,
-              sink->index++, FALSE);
-          g_free (entry_location);
-
-          gst_hls_sink2_write_playlist (sink);
-
-          //following codes to remove out-of-date fragment on disk or on memory-cache
-          g_queue_push_tail (&sink->old_locations,
-              g_strdup (sink->current_location));
-
-          while (g_queue_get_length (&sink->old_locations) >
-              g_queue_get_length (sink->playlist->entries)) {
-            gchar *old_location = g_queue_pop_head (&sink->old_locations);
-            
-            if(sink->cache_mode == MODE_DISK) {//remove fragment file on disk
-              g_remove (old_location);
-            }
-            else if(sink->cache_mode == MODE_MEMORY) {
-              HlsFragmentBuf* buf = g_queue_pop_head(&sink->fragment_cache);
-              hls_fragment_buf_free(buf);
-            }
-            else {
-              g_warn_if_reached();
-            }
-            g_free (old_location);
-          }
-          
+          gst_hls_sink2_push_command (sink, cmd);
         }
       }
       break;
     }
     case GST_MESSAGE_EOS:{
-      sink->playlist->end_list = TRUE;
-      gst_hls_sink2_write_playlist (sink);
+      gst_hls_sink2_push_command (sink,
+          hls_publish_cmd_new (HLS_PUBLISH_END_LIST));
       break;
     }
     default:
@@ -524,6 +1440,12 @@ gst_hls_sink2_change_state (GstElement * element, GstStateChange trans)
         return GST_STATE_CHANGE_FAILURE;
       }
       break;
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      g_mutex_lock (&sink->cache_lock);
+      sink->cache_flushing = FALSE;
+      g_mutex_unlock (&sink->cache_lock);
+      gst_hls_sink2_start_publisher (sink);
+      break;
     default:
       break;
   }
@@ -535,6 +1457,7 @@ gst_hls_sink2_change_state (GstElement * element, GstStateChange trans)
       break;
     case GST_STATE_CHANGE_PAUSED_TO_READY:
     case GST_STATE_CHANGE_READY_TO_NULL:
+      gst_hls_sink2_stop_publisher (sink);
       gst_hls_sink2_reset (sink);
       break;
     default:
@@ -568,16 +1491,32 @@ gst_hls_sink2_set_property (GObject * object, guint prop_id,
     case PROP_MAX_FILES:
       sink->max_files = g_value_get_uint (value);
       break;
+    case PROP_MAX_BYTES:
+      sink->max_bytes = g_value_get_uint64 (value);
+      break;
+    case PROP_MAX_AGE:
+      sink->max_age = g_value_get_uint (value);
+      break;
     case PROP_TARGET_DURATION:
       sink->target_duration = g_value_get_uint (value);
       if (sink->splitmuxsink) {
         g_object_set (sink->splitmuxsink, "max-size-time",
             ((GstClockTime) sink->target_duration * GST_SECOND), NULL);
+        if (sink->segment_format == FORMAT_CMAF) {
+          GstElement *mux = NULL;
+
+          g_object_get (sink->splitmuxsink, "muxer", &mux, NULL);
+          if (mux) {
+            g_object_set (mux, "fragment-duration",
+                sink->target_duration * 1000, NULL);
+            gst_object_unref (mux);
+          }
+        }
       }
       break;
     case PROP_PLAYLIST_LENGTH:
       sink->playlist_length = g_value_get_uint (value);
-      sink->playlist->window_size = sink->playlist_length;
+      gst_hls_sink2_configure_playlist (sink);
       break;
     case PROP_CACHE_MODE:
       sink->cache_mode = g_value_get_enum (value);
@@ -587,6 +1526,49 @@ gst_hls_sink2_set_property (GObject * object, guint prop_id,
         g_object_set (sink->splitmuxsink, "sink", sink->inner_sink , NULL);
       }
       break;
+    case PROP_SEGMENT_FORMAT:
+      sink->segment_format = g_value_get_enum (value);
+      gst_hls_sink2_configure_playlist (sink);
+      if (sink->segment_format == FORMAT_CMAF &&
+          g_strcmp0 (sink->location, DEFAULT_LOCATION) == 0) {
+        g_free (sink->location);
+        sink->location = g_strdup (DEFAULT_CMAF_LOCATION);
+      }
+      if (sink->splitmuxsink) {
+        g_object_set (sink->splitmuxsink, "location", sink->location, NULL);
+        gst_hls_sink2_set_muxer (sink);
+      }
+      break;
+    case PROP_INIT_LOCATION:
+      g_free (sink->init_location);
+      sink->init_location = g_value_dup_string (value);
+      break;
+    case PROP_PLAYLIST_SYNC:
+      sink->playlist_sync = g_value_get_enum (value);
+      break;
+    case PROP_SHARED_WRITER:
+      sink->shared_writer = g_value_get_boolean (value);
+      break;
+    case PROP_MEMORY_BUDGET:
+      //process-wide, read back from the cache rather than stored per sink
+      gst_hls_mem_cache_set_budget (g_value_get_uint64 (value));
+      break;
+    case PROP_SPILL_LOCATION:
+      gst_hls_mem_cache_set_spill_dir (g_value_get_string (value));
+      break;
+    case PROP_ENCRYPTION:
+      sink->encryption = g_value_get_enum (value);
+      break;
+    case PROP_KEY_LOCATION:
+      g_free (sink->key_location);
+      sink->key_location = g_value_dup_string (value);
+      break;
+    case PROP_KEY_ROTATION:
+      sink->key_rotation = g_value_get_uint (value);
+      break;
+    case PROP_PROGRAM_DATE_TIME:
+      sink->program_date_time = g_value_get_boolean (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -612,6 +1594,12 @@ gst_hls_sink2_get_property (GObject * object, guint prop_id,
     case PROP_MAX_FILES:
       g_value_set_uint (value, sink->max_files);
       break;
+    case PROP_MAX_BYTES:
+      g_value_set_uint64 (value, sink->max_bytes);
+      break;
+    case PROP_MAX_AGE:
+      g_value_set_uint (value, sink->max_age);
+      break;
     case PROP_TARGET_DURATION:
       g_value_set_uint (value, sink->target_duration);
       break;
@@ -621,6 +1609,36 @@ gst_hls_sink2_get_property (GObject * object, guint prop_id,
     case PROP_CACHE_MODE:
       g_value_set_enum (value, sink->cache_mode);
       break;
+    case PROP_SEGMENT_FORMAT:
+      g_value_set_enum (value, sink->segment_format);
+      break;
+    case PROP_INIT_LOCATION:
+      g_value_set_string (value, sink->init_location);
+      break;
+    case PROP_PLAYLIST_SYNC:
+      g_value_set_enum (value, sink->playlist_sync);
+      break;
+    case PROP_SHARED_WRITER:
+      g_value_set_boolean (value, sink->shared_writer);
+      break;
+    case PROP_MEMORY_BUDGET:
+      g_value_set_uint64 (value, gst_hls_mem_cache_get_budget ());
+      break;
+    case PROP_SPILL_LOCATION:
+      g_value_take_string (value, gst_hls_mem_cache_get_spill_dir ());
+      break;
+    case PROP_ENCRYPTION:
+      g_value_set_enum (value, sink->encryption);
+      break;
+    case PROP_KEY_LOCATION:
+      g_value_set_string (value, sink->key_location);
+      break;
+    case PROP_KEY_ROTATION:
+      g_value_set_uint (value, sink->key_rotation);
+      break;
+    case PROP_PROGRAM_DATE_TIME:
+      g_value_set_boolean (value, sink->program_date_time);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -20,6 +20,9 @@
 #define _GST_HLS_SINK2_H_
 
 #include "gstm3u8playlist.h"
+#include "gsthlsplaylistwriter.h"
+#include "gsthlsmemcache.h"
+#include "gsthlsencrypt.h"
 #include <gst/gst.h>
 
 G_BEGIN_DECLS
@@ -40,10 +43,25 @@ typedef enum
   MODE_MEMORY = 1, //cache media to memory
 } GstHlsSink2CacheMode;
 
+typedef enum
+{
+  FORMAT_MPEGTS = 0,  //default segment format, mpegtsmux
+  FORMAT_CMAF = 1,    //fragmented mp4 segments sharing one init segment
+} GstHlsSink2SegmentFormat;
+
+typedef enum
+{
+  ENCRYPTION_NONE = 0,     //default, segments in the clear
+  ENCRYPTION_AES_128 = 1,  //METHOD=AES-128, whole segments with AES-128 CBC
+} GstHlsSink2Encryption;
+
 typedef struct _HlsFragmentBuf
 {
   gchar *location;    // ts filename
-  GstMemory * media; // ts fragment
+  GstHlsCacheEntry * entry; // ts fragment in memory or spilled, NULL when MODE_DISK
+  guint64 size;      // fragment size in bytes
+  gint64 closed_time; // monotonic time when the fragment was closed
+  guint sequence;     // media sequence of the fragment, first one using a key or init segment
 } HlsFragmentBuf;
 
 //[1] property
@@ -58,26 +76,71 @@ struct _GstHlsSink2
   gchar *playlist_location; //[1] m3u8 location 
   gchar *playlist_root;     //[1] prefix path to build m3u8 entry-location
   guint playlist_length;    //[1] playlist.window_size
-  gint max_files;           //[1] !!!unavailable by now
+  guint max_files;          //[1] retention by fragment count, 0 for unlimited
+  guint64 max_bytes;        //[1] retention by total fragment bytes, 0 for unlimited
+  guint max_age;            //[1] retention by fragment age in seconds, 0 for unlimited
   gint target_duration;     //[1] splitmuxsink.max-size-time
+  GstHlsSink2SegmentFormat segment_format; //[1] muxer of segments
+  gchar *init_location;     //[1] init segment location pattern when FORMAT_CMAF
+  GstHlsPlaylistSync playlist_sync; //[1] durability of playlist writes when MODE_DISK
+  gboolean shared_writer;   //[1] write playlist on the process-wide writer thread
+  gint playlist_fd;         //playlist kept open for SYNC_OVERWRITE, -1 if closed
+  GstHlsSink2Encryption encryption; //[1] segment encryption, MPEG-TS only
+  gchar *key_location;      //[1] key file location pattern when encrypting
+  guint key_rotation;       //[1] segments per key, 0 for one key per stream
+  gboolean program_date_time; //[1] emit #EXT-X-PROGRAM-DATE-TIME
 
   GstM3U8Playlist *playlist;
   guint index;  //realtime index of m3u8 entry, update continuously
 
   gchar *current_location;  //realtime splitmuxsink.location(fragment filename) when new fragment opened
   GstClockTime current_running_time_start;  //realtime running time of first fragment buffer
-  GQueue old_locations;  //splitmuxsink.location cache list, in from tail
+  gint64 current_wallclock_start;   //wall-clock time in us when current fragment opened
+
+  //running time to wall-clock mapping, kept across continuous fragments
+  gboolean have_wallclock;
+  gint64 wallclock_offset;  //wall-clock time in us at running time 0
+
+  //for FORMAT_CMAF
+  GBytes *init_data;        //ftyp+moov of current init segment
+  guint init_index;         //realtime index of init segment, increase when moov changes
+
+  //for encryption
+  guint8 key[GST_HLS_KEY_SIZE]; //current AES-128 key
+  guint key_index;          //realtime index of key file, increase on rotation
+  guint key_segments;       //segments encrypted with the current key, 0 for no key yet
+  GQueue key_cache;         //keys of retained fragments, HlsFragmentBuf queue, in from tail
 
   //for MODE_MEMORY
   GstHlsSink2CacheMode cache_mode; //[1] save in file or memory
   GstElement *inner_sink;   //retrieve media buffer from When MODE_MEMORY
   gchar* playlist_cache;    //cache playlist content when MODE_MEMORY
-  GQueue fragment_cache;    //cache media when MODE_MEMORY, HlsFragmentBuf queue
+  GQueue fragment_cache;    //retained fragments(media cached when MODE_MEMORY), HlsFragmentBuf queue, in from tail
+  guint64 retained_bytes;   //total size of fragments in fragment_cache
+  GQueue init_cache;        //init segments of retained fragments when FORMAT_CMAF(cached when MODE_MEMORY), HlsFragmentBuf queue, in from tail
+
+  //blocking playlist reload (_HLS_msn/_HLS_part) of MODE_MEMORY
+  GMutex cache_lock;        //protect playlist_cache, published state and the caches' queues against readers
+  GCond cache_cond;         //broadcast once per playlist publish
+  guint published_sequence; //playlist.sequence_number of playlist_cache, next media sequence to come
+  gboolean published_end;   //playlist_cache carries #EXT-X-ENDLIST
+  gboolean cache_flushing;  //release blocked readers on reset
+
+  //publisher thread, owns playlist and fragment_cache while running
+  GThread *publisher;
+  GMutex publish_lock;
+  GCond publish_cond;       //signals new commands and free room in publish_q
+  GQueue publish_q;         //HlsPublishCmd queue, in from tail
 };
 
 struct _GstHlsSink2Class
 {
   GstBinClass bin_class;
+
+  /* actions */
+  gchar * (*get_playlist) (GstHlsSink2 * sink, gint msn, gint part,
+      GstClockTime timeout);
+  GstMemory * (*get_fragment) (GstHlsSink2 * sink, const gchar * location);
 };
 
 GType gst_hls_sink2_get_type (void);
@@ -40,6 +40,11 @@ struct _GstM3U8Entry
   gchar *title;
   gchar *url;
   gboolean discontinuous;
+  gchar *map_uri;       //#EXT-X-MAP the entry depends on
+  gchar *key;           //#EXT-X-KEY attributes the entry is encrypted with
+  guint64 length;       //#EXT-X-BYTERANGE length, 0 for the whole resource
+  guint64 offset;       //#EXT-X-BYTERANGE offset
+  GDateTime *program_date_time; //#EXT-X-PROGRAM-DATE-TIME, NULL for none
 };
 
 static GstM3U8Entry *
@@ -65,6 +70,10 @@ gst_m3u8_entry_free (GstM3U8Entry * entry)
 
   g_free (entry->url);
   g_free (entry->title);
+  g_free (entry->map_uri);
+  g_free (entry->key);
+  if (entry->program_date_time)
+    g_date_time_unref (entry->program_date_time);
   g_free (entry);
 }
 
@@ -91,6 +100,8 @@ gst_m3u8_playlist_free (GstM3U8Playlist * playlist)
 
   g_queue_foreach (playlist->entries, (GFunc) gst_m3u8_entry_free, NULL);
   g_queue_free (playlist->entries);
+  g_free (playlist->map_uri);
+  g_free (playlist->key);
   g_free (playlist);
 }
 
@@ -109,6 +120,8 @@ gst_m3u8_playlist_add_entry (GstM3U8Playlist * playlist,
     return FALSE;
 
   entry = gst_m3u8_entry_new (url, title, duration, discontinuous);
+  entry->map_uri = g_strdup (playlist->map_uri);
+  entry->key = g_strdup (playlist->key);
 
   if (playlist->window_size > 0) {
     /* Delete old entries from the playlist */
@@ -116,6 +129,9 @@ gst_m3u8_playlist_add_entry (GstM3U8Playlist * playlist,
       GstM3U8Entry *old_entry;
 
       old_entry = g_queue_pop_head (playlist->entries);
+      /* the window no longer starts behind this discontinuity */
+      if (old_entry->discontinuous)
+        playlist->discontinuity_sequence++;
       gst_m3u8_entry_free (old_entry);
     }
   }
@@ -126,6 +142,76 @@ gst_m3u8_playlist_add_entry (GstM3U8Playlist * playlist,
   return TRUE;
 }
 
+void
+gst_m3u8_playlist_set_map (GstM3U8Playlist * playlist, const gchar * uri)
+{
+  g_return_if_fail (playlist != NULL);
+
+  g_free (playlist->map_uri);
+  playlist->map_uri = g_strdup (uri);
+}
+
+/* Encrypt entries added from now on with @method and the key at @uri,
+ * NULL @method for none. Without @iv the media sequence number is the IV */
+void
+gst_m3u8_playlist_set_key (GstM3U8Playlist * playlist, const gchar * method,
+    const gchar * uri, const gchar * iv)
+{
+  GString *key;
+
+  g_return_if_fail (playlist != NULL);
+
+  g_free (playlist->key);
+  playlist->key = NULL;
+  if (method == NULL)
+    return;
+
+  key = g_string_new (NULL);
+  g_string_append_printf (key, "METHOD=%s", method);
+  if (uri)
+    g_string_append_printf (key, ",URI=\"%s\"", uri);
+  if (iv)
+    g_string_append_printf (key, ",IV=%s", iv);
+  playlist->key = g_string_free (key, FALSE);
+}
+
+/* Limit the last added entry to a sub-range of its resource */
+gboolean
+gst_m3u8_playlist_set_byterange (GstM3U8Playlist * playlist,
+    guint64 length, guint64 offset)
+{
+  GstM3U8Entry *entry;
+
+  g_return_val_if_fail (playlist != NULL, FALSE);
+
+  entry = g_queue_peek_tail (playlist->entries);
+  if (entry == NULL)
+    return FALSE;
+
+  entry->length = length;
+  entry->offset = offset;
+  return TRUE;
+}
+
+/* Map the start of the last added entry to the wall-clock @date_time */
+gboolean
+gst_m3u8_playlist_set_program_date_time (GstM3U8Playlist * playlist,
+    GDateTime * date_time)
+{
+  GstM3U8Entry *entry;
+
+  g_return_val_if_fail (playlist != NULL, FALSE);
+
+  entry = g_queue_peek_tail (playlist->entries);
+  if (entry == NULL)
+    return FALSE;
+
+  if (entry->program_date_time)
+    g_date_time_unref (entry->program_date_time);
+  entry->program_date_time = date_time ? g_date_time_ref (date_time) : NULL;
+  return TRUE;
+}
+
 //Maximum fragment duration rounding up
 static guint
 gst_m3u8_playlist_target_duration (GstM3U8Playlist * playlist)
@@ -147,6 +233,8 @@ gchar *
 gst_m3u8_playlist_render (GstM3U8Playlist * playlist)
 {
   GString *playlist_str;
+  const gchar *map_uri = NULL;
+  const gchar *key = NULL;
   GList *l;
 
   g_return_val_if_fail (playlist != NULL, NULL);
@@ -162,6 +250,10 @@ gst_m3u8_playlist_render (GstM3U8Playlist * playlist)
   g_string_append_printf (playlist_str, "#EXT-X-MEDIA-SEQUENCE:%d\n",
       playlist->sequence_number - playlist->entries->length);
 
+  if (playlist->discontinuity_sequence > 0)
+    g_string_append_printf (playlist_str,
+        "#EXT-X-DISCONTINUITY-SEQUENCE:%u\n", playlist->discontinuity_sequence);
+
   g_string_append_printf (playlist_str, "#EXT-X-TARGETDURATION:%u\n",
       gst_m3u8_playlist_target_duration (playlist));
   g_string_append (playlist_str, "\n");
@@ -174,6 +266,30 @@ gst_m3u8_playlist_render (GstM3U8Playlist * playlist)
     if (entry->discontinuous)
       g_string_append (playlist_str, "#EXT-X-DISCONTINUITY\n");
 
+    if (entry->program_date_time) {
+      gchar *date = g_date_time_format (entry->program_date_time,
+          "%Y-%m-%dT%H:%M:%S");
+
+      g_string_append_printf (playlist_str,
+          "#EXT-X-PROGRAM-DATE-TIME:%s.%03dZ\n", date,
+          g_date_time_get_microsecond (entry->program_date_time) / 1000);
+      g_free (date);
+    }
+
+    /* A map applies to all following entries until the next one */
+    if (entry->map_uri && g_strcmp0 (entry->map_uri, map_uri) != 0) {
+      g_string_append_printf (playlist_str, "#EXT-X-MAP:URI=\"%s\"\n",
+          entry->map_uri);
+      map_uri = entry->map_uri;
+    }
+
+    /* So does a key, the first entry of the window starts without one */
+    if (g_strcmp0 (entry->key, key) != 0) {
+      g_string_append_printf (playlist_str, "#EXT-X-KEY:%s\n",
+          entry->key ? entry->key : "METHOD=NONE");
+      key = entry->key;
+    }
+
     if (playlist->version < 3) {
       g_string_append_printf (playlist_str, "#EXTINF:%d,%s\n",
           (gint) ((entry->duration + 500 * GST_MSECOND) / GST_SECOND),
@@ -184,6 +300,11 @@ gst_m3u8_playlist_render (GstM3U8Playlist * playlist)
           entry->title ? entry->title : "");
     }
 
+    if (entry->length > 0)
+      g_string_append_printf (playlist_str, "#EXT-X-BYTERANGE:%"
+          G_GUINT64_FORMAT "@%" G_GUINT64_FORMAT "\n", entry->length,
+          entry->offset);
+
     g_string_append_printf (playlist_str, "%s\n", entry->url);
   }
 
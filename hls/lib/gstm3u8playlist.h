@@ -36,9 +36,12 @@ struct _GstM3U8Playlist
   gint type;
   gboolean end_list;    //whether #EXT-X-ENDLIST
   guint sequence_number;//total number of entries has been pushed into queue "entries"
+  guint discontinuity_sequence;//number of discontinuous entries dropped out of the window
 
   /*< Private >*/
   GQueue *entries;
+  gchar *map_uri;       //#EXT-X-MAP of entries added from now on, NULL for none
+  gchar *key;           //#EXT-X-KEY attributes of entries added from now on, NULL for none
 };
 
 
@@ -55,6 +58,21 @@ gboolean          gst_m3u8_playlist_add_entry (GstM3U8Playlist * playlist,
                                                guint             index,
                                                gboolean          discontinuous);
 
+void              gst_m3u8_playlist_set_map (GstM3U8Playlist * playlist,
+                                             const gchar     * uri);
+
+void              gst_m3u8_playlist_set_key (GstM3U8Playlist * playlist,
+                                             const gchar     * method,
+                                             const gchar     * uri,
+                                             const gchar     * iv);
+
+gboolean          gst_m3u8_playlist_set_byterange (GstM3U8Playlist * playlist,
+                                                   guint64           length,
+                                                   guint64           offset);
+
+gboolean          gst_m3u8_playlist_set_program_date_time (GstM3U8Playlist * playlist,
+                                                           GDateTime       * date_time);
+
 gchar *           gst_m3u8_playlist_render (GstM3U8Playlist * playlist);
 
 G_END_DECLS
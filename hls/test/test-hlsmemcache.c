@@ -0,0 +1,137 @@
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "gsthlsmemcache.h"
+
+GST_DEBUG_CATEGORY_EXTERN (hls_debug);
+
+/* Segments are written through memorysink and moved out of it the way
+ * cushlssink2 MODE_MEMORY does, then spilled by lowering the budget. The
+ * resident set of the process has to fall by the spilled bytes */
+#define N_SEGMENTS 8
+#define SEGMENT_SIZE (4 * 1024 * 1024)
+#define SPILL_TIMEOUT (10 * G_USEC_PER_SEC)
+
+static guint64
+get_rss (void)
+{
+  unsigned long size = 0, resident = 0;
+  FILE *file = fopen ("/proc/self/statm", "r");
+
+  if (file == NULL)
+    return 0;
+  if (fscanf (file, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  fclose (file);
+
+  return (guint64) resident * sysconf (_SC_PAGESIZE);
+}
+
+/* Write one segment of SEGMENT_SIZE bytes through a memorysink and move
+ * its data out */
+static GstMemory *
+write_segment (guint idx)
+{
+  GstElement *pipeline, *src, *sink;
+  GstBuffer *buffer;
+  GstMessage *msg;
+  GstMemory *media = NULL;
+  GstFlowReturn flow;
+  gchar *location;
+  GstMapInfo map;
+
+  pipeline = gst_pipeline_new (NULL);
+  src = gst_element_factory_make ("appsrc", NULL);
+  sink = gst_element_factory_make ("memorysink", NULL);
+  if (src == NULL || sink == NULL) {
+    g_print ("appsrc or memorysink not available\n");
+    return NULL;
+  }
+
+  location = g_strdup_printf ("segment%05u.ts", idx);
+  g_object_set (sink, "location", location, NULL);
+  gst_bin_add_many (GST_BIN (pipeline), src, sink, NULL);
+  gst_element_link (src, sink);
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  /* Touch every page, so the data counts in the resident set */
+  buffer = gst_buffer_new_allocate (NULL, SEGMENT_SIZE, NULL);
+  gst_buffer_map (buffer, &map, GST_MAP_WRITE);
+  memset (map.data, idx + 1, map.size);
+  gst_buffer_unmap (buffer, &map);
+
+  g_signal_emit_by_name (src, "push-buffer", buffer, &flow);
+  gst_buffer_unref (buffer);
+  g_signal_emit_by_name (src, "end-of-stream", &flow);
+
+  msg = gst_bus_timed_pop_filtered (GST_ELEMENT_BUS (pipeline),
+      GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS)
+    g_signal_emit_by_name (sink, "move", location, &media);
+  gst_message_unref (msg);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+  g_free (location);
+
+  return media;
+}
+
+int
+main (int argc, char **argv)
+{
+  GstHlsCacheEntry *entries[N_SEGMENTS];
+  guint64 rss_before, rss_after, spilled;
+  gchar *spill_dir;
+  gint64 deadline;
+  guint i;
+
+  gst_init (&argc, &argv);
+  GST_DEBUG_CATEGORY_INIT (hls_debug, "cushls", 0, "HTTP Live Streaming (HLS)");
+
+  spill_dir = g_dir_make_tmp ("hlsmemcache-XXXXXX", NULL);
+  gst_hls_mem_cache_set_spill_dir (spill_dir);
+  gst_hls_mem_cache_set_budget (0);
+
+  for (i = 0; i < N_SEGMENTS; i++) {
+    GstMemory *media = write_segment (i);
+
+    if (media == NULL) {
+      g_print ("Could not write segment %u\n", i);
+      return 1;
+    }
+    entries[i] = gst_hls_cache_entry_new (media);
+  }
+
+  rss_before = get_rss ();
+
+  /* Keep one segment in memory, spill the others */
+  gst_hls_mem_cache_set_budget (SEGMENT_SIZE);
+  spilled = (guint64) (N_SEGMENTS - 1) * SEGMENT_SIZE;
+
+  deadline = g_get_monotonic_time () + SPILL_TIMEOUT;
+  do {
+    g_usleep (100 * 1000);
+    rss_after = get_rss ();
+  } while (rss_before - MIN (rss_before, rss_after) < spilled / 2 &&
+      g_get_monotonic_time () < deadline);
+
+  g_print ("RSS before spill %" G_GUINT64_FORMAT " after %" G_GUINT64_FORMAT
+      ", %" G_GUINT64_FORMAT " bytes spilled\n", rss_before, rss_after,
+      spilled);
+
+  for (i = 0; i < N_SEGMENTS; i++)
+    gst_hls_cache_entry_free (entries[i]);
+  g_rmdir (spill_dir);
+  g_free (spill_dir);
+
+  if (rss_before - MIN (rss_before, rss_after) < spilled / 2) {
+    g_print ("RSS did not fall after the spill\n");
+    return 1;
+  }
+
+  g_print ("RSS fell after the spill\n");
+  return 0;
+}
@@ -491,9 +491,12 @@ gst_memory_sink_move ( GstMemorySink* sink, gchar* cur_location)
     return NULL;
   }
 
+  //not readonly: the receiver owns the media and may patch it in place,
+  //and the buffer is freed with the last reference to it
   GstMemory *media = gst_memory_new_wrapped(
-    GST_MEMORY_FLAG_READONLY|GST_MEMORY_FLAG_PHYSICALLY_CONTIGUOUS,
-    sink->buffer,  DEFAULT_BUFFER_SIZE, 0, sink->current_pos, NULL, NULL);
+    GST_MEMORY_FLAG_PHYSICALLY_CONTIGUOUS,
+    sink->buffer,  sink->buffer_size, 0, sink->current_pos,
+    sink->buffer, g_free);
 
   g_return_val_if_fail(media != NULL, NULL);
 
@@ -1253,7 +1253,15 @@ void
 gst_splitmux_part_reader_set_start_offset (GstSplitMuxPartReader * reader,
     GstClockTime offset)
 {
+  GList *cur;
+
   SPLITMUX_PART_LOCK (reader);
+  /* A part measured at another offset moves its end along */
+  for (cur = g_list_first (reader->pads); cur != NULL; cur = g_list_next (cur)) {
+    GstSplitMuxPartPad *part_pad = SPLITMUX_PART_PAD_CAST (cur->data);
+    if (part_pad->max_ts >= reader->start_offset)
+      part_pad->max_ts = part_pad->max_ts - reader->start_offset + offset;
+  }
   reader->start_offset = offset;
   GST_INFO_OBJECT (reader, "TS offset now %" GST_TIME_FORMAT,
       GST_TIME_ARGS (offset));
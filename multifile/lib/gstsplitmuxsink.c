@@ -53,6 +53,7 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <string.h>
 #include <glib/gstdio.h>
 #include <gst/video/video.h>
@@ -63,11 +64,11 @@ GST_DEBUG_CATEGORY_STATIC (splitmux_debug);
 
 #define GST_SPLITMUX_LOCK(s) g_mutex_lock(&(s)->lock)
 #define GST_SPLITMUX_UNLOCK(s) g_mutex_unlock(&(s)->lock)
-#define GST_SPLITMUX_WAIT_INPUT(s) g_cond_wait (&(s)->input_cond, &(s)->lock)
-#define GST_SPLITMUX_BROADCAST_INPUT(s) g_cond_broadcast (&(s)->input_cond)
+#define GST_SPLITMUX_WAIT_INPUT(s,ctx) wait_input (s, ctx)
+#define GST_SPLITMUX_BROADCAST_INPUT(s) wake_input (s)
 
-#define GST_SPLITMUX_WAIT_OUTPUT(s) g_cond_wait (&(s)->output_cond, &(s)->lock)
-#define GST_SPLITMUX_BROADCAST_OUTPUT(s) g_cond_broadcast (&(s)->output_cond)
+#define GST_SPLITMUX_WAIT_OUTPUT(s,ctx) wait_output (s, ctx)
+#define GST_SPLITMUX_BROADCAST_OUTPUT(s) wake_output (s)
 
 static void split_now (GstSplitMuxSink * splitmux);
 
@@ -84,7 +85,14 @@ enum
   PROP_USE_ROBUST_MUXING,
   PROP_ALIGNMENT_THRESHOLD,
   PROP_MUXER,
-  PROP_SINK
+  PROP_SINK,
+  PROP_SINKS,
+  PROP_STANDBY_PAIR,
+  PROP_MEASURED_MUX_OVERHEAD,
+  PROP_FRAGMENT_DURATION_VARIANCE,
+  PROP_MUX_WORKERS,
+  PROP_INDEX_LOCATION,
+  PROP_STATS
 };
 
 #define DEFAULT_MAX_SIZE_TIME       0
@@ -96,6 +104,33 @@ enum
 #define DEFAULT_MUXER "mp4mux"
 #define DEFAULT_SINK "filesink"
 #define DEFAULT_USE_ROBUST_MUXING FALSE
+#define DEFAULT_STANDBY_PAIR FALSE
+#define DEFAULT_MUX_WORKERS 1
+#define MAX_MUX_WORKERS 16
+
+/* Time a retired pair gets to drain after its EOS before its fragment is
+ * given up on */
+#define RETIRE_EOS_TIMEOUT (5 * G_TIME_SPAN_SECOND)
+
+/* Internal queue limits in buffers. A queue has to hold the GOP being
+ * collected plus the one being muxed, it is sized from the buffers each
+ * stream brought in during the last GOP, doubled on overrun and halved
+ * after QUEUE_SHRINK_GOPS GOPs that used less than a quarter of it */
+#define QUEUE_MIN_BUFFERS 5
+#define QUEUE_SHRINK_GOPS 4
+
+/* Initial capacity of the MqStreamBuf ring of a context */
+#define MQ_STREAM_BUFS_MIN 32
+
+/* Weight of the last fragment in the measured muxing overhead */
+#define MUX_OVERHEAD_WEIGHT 0.25
+
+/* Split points requested upstream ahead of the stream, and the weight of
+ * the last keyframe in the measured keyframe latency */
+#define KEYFRAME_REQUESTS_AHEAD 2
+#define KEYFRAME_LATENCY_WEIGHT 0.25
+/* Rounding errors allowed when comparing with a split point */
+#define SPLIT_TIME_TOLERANCE (5 * GST_USECOND)
 
 enum
 {
@@ -156,23 +191,61 @@ static void set_next_filename (GstSplitMuxSink * splitmux, MqStreamCtx * ctx);
 static void start_next_fragment (GstSplitMuxSink * splitmux, MqStreamCtx * ctx);
 static void mq_stream_ctx_unref (MqStreamCtx * ctx);
 static void grow_blocked_queues (GstSplitMuxSink * splitmux);
+static void resize_queues (GstSplitMuxSink * splitmux);
 
 static void gst_splitmux_sink_ensure_max_files (GstSplitMuxSink * splitmux);
 static GstElement *create_element (GstSplitMuxSink * splitmux,
     const gchar * factory, const gchar * name, gboolean locked);
 
 static void do_async_done (GstSplitMuxSink * splitmux);
+static void drop_standby_pair (GstSplitMuxSink * splitmux, GstElement * muxer,
+    GstElement * active_sink);
+static void release_standby_pad (MqStreamCtx * ctx);
+static gboolean can_close_async (GstSplitMuxSink * splitmux);
 
-static MqStreamBuf *
-mq_stream_buf_new (void)
+/* Called with lock held. Appends to the MqStreamBuf ring of @ctx, which
+ * only allocates when it has to grow */
+static void
+mq_stream_bufs_push (MqStreamCtx * ctx, const MqStreamBuf * buf_info)
+{
+  if (ctx->bufs_len == ctx->bufs_size) {
+    guint size = MAX (ctx->bufs_size * 2, MQ_STREAM_BUFS_MIN);
+    MqStreamBuf *bufs = g_new (MqStreamBuf, size);
+    guint first = MIN (ctx->bufs_len, ctx->bufs_size - ctx->bufs_head);
+
+    /* unwrap into the new array, oldest first */
+    if (ctx->bufs_len > 0) {
+      memcpy (bufs, ctx->bufs + ctx->bufs_head, first * sizeof (MqStreamBuf));
+      memcpy (bufs + first, ctx->bufs,
+          (ctx->bufs_len - first) * sizeof (MqStreamBuf));
+    }
+    g_free (ctx->bufs);
+    ctx->bufs = bufs;
+    ctx->bufs_size = size;
+    ctx->bufs_head = 0;
+  }
+
+  ctx->bufs[(ctx->bufs_head + ctx->bufs_len) % ctx->bufs_size] = *buf_info;
+  ctx->bufs_len++;
+}
+
+/* Called with lock held. Pops the oldest entry into @buf_info */
+static gboolean
+mq_stream_bufs_pop (MqStreamCtx * ctx, MqStreamBuf * buf_info)
 {
-  return g_slice_new0 (MqStreamBuf);
+  if (ctx->bufs_len == 0)
+    return FALSE;
+
+  *buf_info = ctx->bufs[ctx->bufs_head];
+  ctx->bufs_head = (ctx->bufs_head + 1) % ctx->bufs_size;
+  ctx->bufs_len--;
+  return TRUE;
 }
 
 static void
-mq_stream_buf_free (MqStreamBuf * data)
+mq_stream_bufs_clear (MqStreamCtx * ctx)
 {
-  g_slice_free (MqStreamBuf, data);
+  ctx->bufs_head = ctx->bufs_len = 0;
 }
 
 static SplitMuxOutputCommand *
@@ -226,9 +299,24 @@ gst_splitmux_sink_class_init (GstSplitMuxSinkClass * klass)
           NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
   g_object_class_install_property (gobject_class, PROP_MUXER_OVERHEAD,
       g_param_spec_double ("mux-overhead", "Muxing Overhead",
-          "Extra size overhead of muxing (0.02 = 2%)", 0.0, 1.0,
+          "Extra size overhead of muxing (0.02 = 2%), used until the "
+          "overhead of a closed fragment was measured", 0.0, 1.0,
           DEFAULT_MUXER_OVERHEAD,
           G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MEASURED_MUX_OVERHEAD,
+      g_param_spec_double ("measured-mux-overhead", "Measured Muxing Overhead",
+          "Extra size overhead of muxing measured on the closed fragments, "
+          "as a weighted average of the bytes written by the sink over the "
+          "bytes fed to the muxer, minus 1. 0 until the first fragment is "
+          "closed", -1.0, G_MAXDOUBLE, 0.0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class,
+      PROP_FRAGMENT_DURATION_VARIANCE,
+      g_param_spec_double ("fragment-duration-variance",
+          "Fragment duration variance",
+          "Variance of the durations of the fragments closed so far, "
+          "in seconds squared", 0.0, G_MAXDOUBLE, 0.0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 
   g_object_class_install_property (gobject_class, PROP_MAX_SIZE_TIME,
       g_param_spec_uint64 ("max-size-time", "Max. size (ns)",
@@ -254,7 +342,9 @@ gst_splitmux_sink_class_init (GstSplitMuxSinkClass * klass)
   g_object_class_install_property (gobject_class, PROP_MAX_FILES,
       g_param_spec_uint ("max-files", "Max files",
           "Maximum number of files to keep on disk. Once the maximum is reached,"
-          "old files start to be deleted to make room for new ones.", 0,
+          "old files start to be deleted to make room for new ones. A file "
+          "about to be reused is moved aside and removed in the background.",
+          0,
           G_MAXUINT, DEFAULT_MAX_FILES,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
   g_object_class_install_property (gobject_class, PROP_ALIGNMENT_THRESHOLD,
@@ -272,6 +362,16 @@ gst_splitmux_sink_class_init (GstSplitMuxSinkClass * klass)
       g_param_spec_object ("sink", "Sink",
           "The sink element (or element chain) to use (NULL = default filesink)",
           GST_TYPE_ELEMENT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_SINKS,
+      gst_param_spec_array ("sinks", "Sinks",
+          "Sink elements (or element chains) that all get the same muxed "
+          "output. Each of them with a location property gets the location of "
+          "every fragment, e.g. a filesink and a memorysink. A fragment is "
+          "closed once every one of them got EOS. Overrides sink when not "
+          "empty",
+          g_param_spec_object ("sink", "Sink", "A sink element",
+              GST_TYPE_ELEMENT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS),
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
   g_object_class_install_property (gobject_class, PROP_USE_ROBUST_MUXING,
       g_param_spec_boolean ("use-robust-muxing",
@@ -283,6 +383,41 @@ gst_splitmux_sink_class_init (GstSplitMuxSinkClass * klass)
           "Note this does not set reserved-moov-update-period - apps should do that manually",
           DEFAULT_USE_ROBUST_MUXING,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_STANDBY_PAIR,
+      g_param_spec_boolean ("standby-pair",
+          "Switch fragments to a standby muxer and sink",
+          "Keep a second muxer/sink pair prepared in the background and swap "
+          "to it at fragment boundaries, instead of restarting the muxer and "
+          "sink. The finished pair is closed off the streaming thread. "
+          "Needs a muxer and a sink element (not a bin) that can be cloned "
+          "from their factory and properties",
+          DEFAULT_STANDBY_PAIR, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MUX_WORKERS,
+      g_param_spec_uint ("mux-workers", "Muxer/sink workers",
+          "Number of muxer/sink pairs in use. With more than one, a closed "
+          "fragment is finalised by its own pair on a worker thread while the "
+          "next fragment is already muxed into a standby pair, with up to "
+          "mux-workers - 1 fragments being finalised at once. "
+          "Fragment-closed messages are still posted in fragment order. "
+          "Has the same muxer and sink requirements as standby-pair",
+          1, MAX_MUX_WORKERS, DEFAULT_MUX_WORKERS,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_INDEX_LOCATION,
+      g_param_spec_string ("index-location", "Index location",
+          "File to write an index of the recorded fragments to, with their "
+          "location, start and end running time, size and the running time "
+          "and byte offset of their keyframes. Rewritten on every start and "
+          "appended to when a fragment is closed. With max-files it only "
+          "lists the files that are kept, and is rewritten instead "
+          "(NULL = no index)",
+          NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Histograms of the time output threads were blocked, fragment "
+          "switch time, GOP size and time and queue depth per stream, and "
+          "the number of queue growths since the last start. Histogram "
+          "buckets are log2, bucket i counts values below 2^i",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 
   /**
    * GstSplitMuxSink::format-location:
@@ -331,9 +466,13 @@ static void
 gst_splitmux_sink_init (GstSplitMuxSink * splitmux)
 {
   g_mutex_init (&splitmux->lock);
-  g_cond_init (&splitmux->input_cond);
-  g_cond_init (&splitmux->output_cond);
+  g_mutex_init (&splitmux->index_lock);
+  g_cond_init (&splitmux->retire_cond);
+  splitmux->slot_locations = g_ptr_array_new_with_free_func (g_free);
   g_queue_init (&splitmux->out_cmd_q);
+  splitmux->discont_time = GST_CLOCK_STIME_NONE;
+  splitmux->index_entries = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gst_split_util_index_entry_free);
 
   splitmux->mux_overhead = DEFAULT_MUXER_OVERHEAD;
   splitmux->threshold_time = DEFAULT_MAX_SIZE_TIME;
@@ -341,8 +480,15 @@ gst_splitmux_sink_init (GstSplitMuxSink * splitmux)
   splitmux->max_files = DEFAULT_MAX_FILES;
   splitmux->send_keyframe_requests = DEFAULT_SEND_KEYFRAME_REQUESTS;
   splitmux->next_max_tc_time = GST_CLOCK_TIME_NONE;
+  splitmux->next_split_time = GST_CLOCK_TIME_NONE;
+  splitmux->last_keyframe_target = GST_CLOCK_TIME_NONE;
+  splitmux->keyframe_targets = g_array_new (FALSE, FALSE, sizeof (GstClockTime));
   splitmux->alignment_threshold = DEFAULT_ALIGNMENT_THRESHOLD;
   splitmux->use_robust_muxing = DEFAULT_USE_ROBUST_MUXING;
+  splitmux->use_standby = DEFAULT_STANDBY_PAIR;
+  splitmux->mux_workers = DEFAULT_MUX_WORKERS;
+  splitmux->provided_sinks =
+      g_ptr_array_new_with_free_func ((GDestroyNotify) gst_object_unref);
 
   splitmux->threshold_timecode_str = NULL;
 
@@ -353,6 +499,13 @@ gst_splitmux_sink_init (GstSplitMuxSink * splitmux)
 static void
 gst_splitmux_reset (GstSplitMuxSink * splitmux)
 {
+  g_list_foreach (splitmux->contexts, (GFunc) release_standby_pad, NULL);
+  drop_standby_pair (splitmux, splitmux->standby_muxer,
+      splitmux->standby_active_sink);
+  splitmux->standby_muxer = splitmux->standby_active_sink =
+      splitmux->standby_sink = NULL;
+  splitmux->standby_ready = FALSE;
+
   if (splitmux->muxer) {
     gst_element_set_locked_state (splitmux->muxer, TRUE);
     gst_element_set_state (splitmux->muxer, GST_STATE_NULL);
@@ -365,6 +518,8 @@ gst_splitmux_reset (GstSplitMuxSink * splitmux)
   }
 
   splitmux->sink = splitmux->active_sink = splitmux->muxer = NULL;
+  g_list_free (splitmux->fanout_sinks);
+  splitmux->fanout_sinks = NULL;
 }
 
 static void
@@ -372,8 +527,16 @@ gst_splitmux_sink_dispose (GObject * object)
 {
   GstSplitMuxSink *splitmux = GST_SPLITMUX_SINK (object);
 
+  /* The standby pair is not a child, we own it */
+  drop_standby_pair (splitmux, splitmux->standby_muxer,
+      splitmux->standby_active_sink);
+  splitmux->standby_sink = splitmux->standby_active_sink =
+      splitmux->standby_muxer = NULL;
+
   /* Calling parent dispose invalidates all child pointers */
   splitmux->sink = splitmux->active_sink = splitmux->muxer = NULL;
+  g_list_free (splitmux->fanout_sinks);
+  splitmux->fanout_sinks = NULL;
 
   G_OBJECT_CLASS (parent_class)->dispose (object);
 }
@@ -382,14 +545,17 @@ static void
 gst_splitmux_sink_finalize (GObject * object)
 {
   GstSplitMuxSink *splitmux = GST_SPLITMUX_SINK (object);
-  g_cond_clear (&splitmux->input_cond);
-  g_cond_clear (&splitmux->output_cond);
   g_mutex_clear (&splitmux->lock);
+  g_mutex_clear (&splitmux->index_lock);
+  g_cond_clear (&splitmux->retire_cond);
+  g_ptr_array_unref (splitmux->slot_locations);
+  g_array_free (splitmux->keyframe_targets, TRUE);
   g_queue_foreach (&splitmux->out_cmd_q, (GFunc) out_cmd_buf_free, NULL);
   g_queue_clear (&splitmux->out_cmd_q);
 
   if (splitmux->provided_sink)
     gst_object_unref (splitmux->provided_sink);
+  g_ptr_array_unref (splitmux->provided_sinks);
   if (splitmux->provided_muxer)
     gst_object_unref (splitmux->provided_muxer);
 
@@ -397,6 +563,10 @@ gst_splitmux_sink_finalize (GObject * object)
     g_free (splitmux->threshold_timecode_str);
 
   g_free (splitmux->location);
+  g_free (splitmux->index_location);
+  if (splitmux->index_entry)
+    gst_split_util_index_entry_free (splitmux->index_entry);
+  g_ptr_array_unref (splitmux->index_entries);
 
   /* Make sure to free any un-released contexts */
   g_list_foreach (splitmux->contexts, (GFunc) mq_stream_ctx_unref, NULL);
@@ -440,6 +610,92 @@ update_muxer_properties (GstSplitMuxSink * sink)
   }
 }
 
+static void
+histogram_add (SplitMuxHistogram * h, guint64 value)
+{
+  guint bucket = value ? g_bit_storage (value) : 0;
+
+  h->buckets[MIN (bucket, SPLITMUX_HISTOGRAM_BUCKETS - 1)]++;
+  h->count++;
+  h->sum += value;
+  h->max = MAX (h->max, value);
+}
+
+static void
+histogram_set (GstStructure * s, const gchar * name,
+    const SplitMuxHistogram * h)
+{
+  GValue buckets = G_VALUE_INIT, v = G_VALUE_INIT;
+  GstStructure *hs;
+  guint i, last = 0;
+
+  /* trailing empty buckets are left out */
+  for (i = 0; i < SPLITMUX_HISTOGRAM_BUCKETS; i++) {
+    if (h->buckets[i])
+      last = i + 1;
+  }
+
+  g_value_init (&buckets, GST_TYPE_ARRAY);
+  g_value_init (&v, G_TYPE_UINT64);
+  for (i = 0; i < last; i++) {
+    g_value_set_uint64 (&v, h->buckets[i]);
+    gst_value_array_append_value (&buckets, &v);
+  }
+  g_value_unset (&v);
+
+  hs = gst_structure_new ("histogram",
+      "count", G_TYPE_UINT64, h->count,
+      "mean", G_TYPE_DOUBLE, h->count ? (gdouble) h->sum / h->count : 0.0,
+      "max", G_TYPE_UINT64, h->max, NULL);
+  gst_structure_take_value (hs, "buckets", &buckets);
+  gst_structure_set (s, name, GST_TYPE_STRUCTURE, hs, NULL);
+  gst_structure_free (hs);
+}
+
+/* Called with lock held */
+static GstStructure *
+build_stats (GstSplitMuxSink * splitmux)
+{
+  GstStructure *s = gst_structure_new_empty ("splitmuxsink-stats");
+  GValue streams = G_VALUE_INIT;
+  GList *cur;
+
+  histogram_set (s, "switch-time-us", &splitmux->switch_time);
+  histogram_set (s, "gop-bytes", &splitmux->gop_bytes);
+  histogram_set (s, "gop-time-us", &splitmux->gop_time);
+  gst_structure_set (s, "queue-growths", G_TYPE_UINT64,
+      splitmux->queue_growths, NULL);
+
+  g_value_init (&streams, GST_TYPE_ARRAY);
+  for (cur = splitmux->contexts; cur; cur = cur->next) {
+    MqStreamCtx *ctx = cur->data;
+    GstStructure *cs;
+    GValue v = G_VALUE_INIT;
+    gchar *name = gst_pad_get_name (ctx->sinkpad);
+
+    cs = gst_structure_new ("stream", "pad", G_TYPE_STRING, name,
+        "queue-limit", G_TYPE_UINT, ctx->q_limit, NULL);
+    histogram_set (cs, "blocked-us", &ctx->out_blocked);
+    histogram_set (cs, "queue-depth", &ctx->queue_depth);
+    g_free (name);
+
+    g_value_init (&v, GST_TYPE_STRUCTURE);
+    g_value_take_boxed (&v, cs);
+    gst_value_array_append_and_take_value (&streams, &v);
+  }
+  gst_structure_take_value (s, "streams", &streams);
+
+  return s;
+}
+
+static void
+reset_context_stats (MqStreamCtx * ctx)
+{
+  ctx->out_block_start = 0;
+  memset (&ctx->out_blocked, 0, sizeof (SplitMuxHistogram));
+  memset (&ctx->queue_depth, 0, sizeof (SplitMuxHistogram));
+}
+
 static void
 gst_splitmux_sink_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec)
@@ -496,6 +752,22 @@ gst_splitmux_sink_set_property (GObject * object, guint prop_id,
       splitmux->alignment_threshold = g_value_get_uint64 (value);
       GST_OBJECT_UNLOCK (splitmux);
       break;
+    case PROP_STANDBY_PAIR:
+      GST_OBJECT_LOCK (splitmux);
+      splitmux->use_standby = g_value_get_boolean (value);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_MUX_WORKERS:
+      GST_OBJECT_LOCK (splitmux);
+      splitmux->mux_workers = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_INDEX_LOCATION:
+      GST_OBJECT_LOCK (splitmux);
+      g_free (splitmux->index_location);
+      splitmux->index_location = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
     case PROP_SINK:
       GST_OBJECT_LOCK (splitmux);
       if (splitmux->provided_sink)
@@ -504,6 +776,21 @@ gst_splitmux_sink_set_property (GObject * object, guint prop_id,
       gst_object_ref_sink (splitmux->provided_sink);
       GST_OBJECT_UNLOCK (splitmux);
       break;
+    case PROP_SINKS:{
+      guint i, n = gst_value_array_get_size (value);
+
+      GST_OBJECT_LOCK (splitmux);
+      g_ptr_array_set_size (splitmux->provided_sinks, 0);
+      for (i = 0; i < n; i++) {
+        GstElement *e =
+            g_value_get_object (gst_value_array_get_value (value, i));
+
+        if (e)
+          g_ptr_array_add (splitmux->provided_sinks, gst_object_ref_sink (e));
+      }
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    }
     case PROP_MUXER:
       GST_OBJECT_LOCK (splitmux);
       if (splitmux->provided_muxer)
@@ -570,11 +857,57 @@ gst_splitmux_sink_get_property (GObject * object, guint prop_id,
       g_value_set_uint64 (value, splitmux->alignment_threshold);
       GST_OBJECT_UNLOCK (splitmux);
       break;
+    case PROP_STANDBY_PAIR:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_boolean (value, splitmux->use_standby);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_MUX_WORKERS:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_uint (value, splitmux->mux_workers);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_INDEX_LOCATION:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_string (value, splitmux->index_location);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_MEASURED_MUX_OVERHEAD:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_double (value, splitmux->measured_overhead);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_FRAGMENT_DURATION_VARIANCE:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_double (value, splitmux->n_durations > 1 ?
+          splitmux->duration_m2 / (splitmux->n_durations - 1) : 0.0);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_STATS:
+      GST_SPLITMUX_LOCK (splitmux);
+      g_value_take_boxed (value, build_stats (splitmux));
+      GST_SPLITMUX_UNLOCK (splitmux);
+      break;
     case PROP_SINK:
       GST_OBJECT_LOCK (splitmux);
       g_value_set_object (value, splitmux->provided_sink);
       GST_OBJECT_UNLOCK (splitmux);
       break;
+    case PROP_SINKS:{
+      GValue v = G_VALUE_INIT;
+      guint i;
+
+      g_value_init (&v, GST_TYPE_ELEMENT);
+      GST_OBJECT_LOCK (splitmux);
+      for (i = 0; i < splitmux->provided_sinks->len; i++) {
+        g_value_set_object (&v, g_ptr_array_index (splitmux->provided_sinks,
+                i));
+        gst_value_array_append_value (value, &v);
+      }
+      GST_OBJECT_UNLOCK (splitmux);
+      g_value_unset (&v);
+      break;
+    }
     case PROP_MUXER:
       GST_OBJECT_LOCK (splitmux);
       g_value_set_object (value, splitmux->provided_muxer);
@@ -603,6 +936,82 @@ my_segment_to_running_time (GstSegment * segment, GstClockTime val)
   return res;
 }
 
+/* Threads sleep on the condition of their own context, and a state change
+ * only signals the contexts that can make progress because of it. With
+ * many streams next to the reference one, a new reference running time
+ * no longer wakes every input thread that is still ahead of it. */
+
+/* Called with lock held */
+static gboolean
+input_wait_over (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
+{
+  return ctx->flushing || splitmux->input_state != ctx->in_wait_state ||
+      splitmux->max_in_running_time == GST_CLOCK_STIME_NONE ||
+      ctx->in_running_time < splitmux->max_in_running_time;
+}
+
+/* Called with lock held */
+static gboolean
+output_wait_over (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
+{
+  return ctx->flushing || splitmux->output_state != ctx->out_wait_state ||
+      splitmux->max_out_running_time != ctx->out_wait_max ||
+      splitmux->ready_for_output != ctx->out_wait_ready ||
+      !g_queue_is_empty (&splitmux->out_cmd_q);
+}
+
+/* Called with lock held, callers re-check their condition after waking */
+static void
+wait_input (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
+{
+  ctx->in_waiting = TRUE;
+  ctx->in_wait_state = splitmux->input_state;
+  g_cond_wait (&ctx->in_cond, &splitmux->lock);
+  ctx->in_waiting = FALSE;
+}
+
+/* Called with lock held, callers re-check their condition after waking */
+static void
+wait_output (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
+{
+  ctx->out_waiting = TRUE;
+  ctx->out_wait_state = splitmux->output_state;
+  ctx->out_wait_max = splitmux->max_out_running_time;
+  ctx->out_wait_ready = splitmux->ready_for_output;
+  if (ctx->out_block_start == 0)
+    ctx->out_block_start = g_get_monotonic_time ();
+  g_cond_wait (&ctx->out_cond, &splitmux->lock);
+  ctx->out_waiting = FALSE;
+}
+
+/* Called with lock held */
+static void
+wake_input (GstSplitMuxSink * splitmux)
+{
+  GList *cur;
+
+  for (cur = splitmux->contexts; cur; cur = cur->next) {
+    MqStreamCtx *ctx = cur->data;
+
+    if (ctx->in_waiting && input_wait_over (splitmux, ctx))
+      g_cond_signal (&ctx->in_cond);
+  }
+}
+
+/* Called with lock held */
+static void
+wake_output (GstSplitMuxSink * splitmux)
+{
+  GList *cur;
+
+  for (cur = splitmux->contexts; cur; cur = cur->next) {
+    MqStreamCtx *ctx = cur->data;
+
+    if (ctx->out_waiting && output_wait_over (splitmux, ctx))
+      g_cond_signal (&ctx->out_cond);
+  }
+}
+
 static MqStreamCtx *
 mq_stream_ctx_new (GstSplitMuxSink * splitmux)
 {
@@ -614,7 +1023,8 @@ mq_stream_ctx_new (GstSplitMuxSink * splitmux)
   gst_segment_init (&ctx->in_segment, GST_FORMAT_UNDEFINED);
   gst_segment_init (&ctx->out_segment, GST_FORMAT_UNDEFINED);
   ctx->in_running_time = ctx->out_running_time = GST_CLOCK_STIME_NONE;
-  g_queue_init (&ctx->queued_bufs);
+  g_cond_init (&ctx->in_cond);
+  g_cond_init (&ctx->out_cond);
   return ctx;
 }
 
@@ -629,10 +1039,14 @@ mq_stream_ctx_free (MqStreamCtx * ctx)
     gst_object_unref (ctx->q);
   }
   gst_buffer_replace (&ctx->prev_in_keyframe, NULL);
+  gst_caps_replace (&ctx->in_caps, NULL);
+  if (ctx->standby_pad)
+    gst_object_unref (ctx->standby_pad);
   gst_object_unref (ctx->sinkpad);
   gst_object_unref (ctx->srcpad);
-  g_queue_foreach (&ctx->queued_bufs, (GFunc) mq_stream_buf_free, NULL);
-  g_queue_clear (&ctx->queued_bufs);
+  g_free (ctx->bufs);
+  g_cond_clear (&ctx->in_cond);
+  g_cond_clear (&ctx->out_cond);
   g_free (ctx);
 }
 
@@ -663,8 +1077,9 @@ _pad_block_destroy_src_notify (MqStreamCtx * ctx)
   mq_stream_ctx_unref (ctx);
 }
 
-static void
-send_fragment_opened_closed_msg (GstSplitMuxSink * splitmux, gboolean opened)
+static GstMessage *
+build_fragment_opened_closed_msg (GstSplitMuxSink * splitmux,
+    gboolean opened)
 {
   gchar *location = NULL;
   GstMessage *msg;
@@ -673,14 +1088,214 @@ send_fragment_opened_closed_msg (GstSplitMuxSink * splitmux, gboolean opened)
 
   g_object_get (splitmux->sink, "location", &location, NULL);
 
+  /* discont tells whether the closed fragment doesn't continue the
+   * previous one, sink is the element that wrote it (it alternates
+   * with standby-pair) */
   msg = gst_message_new_element (GST_OBJECT (splitmux),
       gst_structure_new (msg_name,
           "location", G_TYPE_STRING, location,
           "running-time", GST_TYPE_CLOCK_TIME,
-          splitmux->reference_ctx->out_running_time, NULL));
-  gst_element_post_message (GST_ELEMENT_CAST (splitmux), msg);
+          splitmux->reference_ctx->out_running_time,
+          "discont", G_TYPE_BOOLEAN, splitmux->fragment_discont,
+          "sink", GST_TYPE_ELEMENT, splitmux->sink, NULL));
+
+  if (!opened)
+    splitmux->fragment_discont = FALSE;
 
   g_free (location);
+
+  return msg;
+}
+
+static void
+send_fragment_opened_closed_msg (GstSplitMuxSink * splitmux, gboolean opened)
+{
+  gst_element_post_message (GST_ELEMENT_CAST (splitmux),
+      build_fragment_opened_closed_msg (splitmux, opened));
+}
+
+static guint64
+query_written_bytes (GstElement * sink)
+{
+  GstPad *pad;
+  gint64 written = -1;
+
+  if (sink == NULL)
+    return 0;
+
+  pad = gst_element_get_static_pad (sink, "sink");
+  if (pad == NULL)
+    return 0;
+  if (!gst_pad_query_position (pad, GST_FORMAT_BYTES, &written))
+    written = -1;
+  gst_object_unref (pad);
+
+  return written > 0 ? written : 0;
+}
+
+/* Called with lock held when a fragment was opened */
+static void
+start_index_entry (GstSplitMuxSink * splitmux)
+{
+  GstClockTimeDiff start = splitmux->reference_ctx->out_running_time;
+  gboolean enabled;
+
+  GST_OBJECT_LOCK (splitmux);
+  enabled = splitmux->index_location != NULL;
+  GST_OBJECT_UNLOCK (splitmux);
+
+  if (splitmux->index_entry)
+    gst_split_util_index_entry_free (splitmux->index_entry);
+  splitmux->index_entry = NULL;
+
+  if (!enabled)
+    return;
+
+  splitmux->index_entry = gst_split_util_index_entry_new ();
+  splitmux->index_entry->start = start > 0 ? start : 0;
+}
+
+/* Called with lock held for a keyframe of the reference stream about to
+ * be muxed. The bytes the sink has written so far are where its data
+ * starts, give or take the muxer's interleaving */
+static void
+add_index_keyframe (GstSplitMuxSink * splitmux, GstClockTimeDiff run_ts)
+{
+  GstSplitMuxIndexKeyframe kf;
+
+  if (splitmux->index_entry == NULL || run_ts < 0)
+    return;
+
+  kf.time = run_ts;
+  kf.offset = query_written_bytes (splitmux->sink);
+  g_array_append_val (splitmux->index_entry->keyframes, kf);
+}
+
+/* Called with lock held when the current fragment ends. Returns its
+ * index entry, to be written by write_index_entry () once the sink
+ * drained */
+static GstSplitMuxIndexEntry *
+finish_index_entry (GstSplitMuxSink * splitmux)
+{
+  GstSplitMuxIndexEntry *entry = splitmux->index_entry;
+  GstClockTimeDiff end = splitmux->reference_ctx->out_running_time;
+
+  if (entry == NULL)
+    return NULL;
+
+  splitmux->index_entry = NULL;
+  g_object_get (splitmux->sink, "location", &entry->location, NULL);
+  entry->end = end > 0 ? end : 0;
+
+  return entry;
+}
+
+typedef struct _SplitMuxIndexWrite
+{
+  gchar *path;
+  gchar *data;
+  gsize length;
+  guint64 seq;
+} SplitMuxIndexWrite;
+
+static void
+split_mux_index_write_free (SplitMuxIndexWrite * w)
+{
+  g_free (w->path);
+  g_free (w->data);
+  g_slice_free (SplitMuxIndexWrite, w);
+}
+
+/* Runs from gst_element_call_async. Replaces the index with @w, unless a
+ * newer one was written already: the calls may run in any order */
+static void
+write_index_async (GstElement * element, SplitMuxIndexWrite * w)
+{
+  GstSplitMuxSink *splitmux = GST_SPLITMUX_SINK (element);
+  GError *err = NULL;
+
+  g_mutex_lock (&splitmux->index_lock);
+  if (w->seq > splitmux->index_written_seq) {
+    if (!g_file_set_contents (w->path, w->data, w->length, &err)) {
+      GST_WARNING_OBJECT (splitmux, "Failed to update index: %s",
+          err->message);
+      g_clear_error (&err);
+    }
+    splitmux->index_written_seq = w->seq;
+  }
+  g_mutex_unlock (&splitmux->index_lock);
+}
+
+/* Called with lock held. With max_files, @entry replaces the entry of the
+ * fragment whose file it overwrote and the whole index is rewritten, so
+ * it never lists more than max_files fragments. The index is only
+ * serialised here, replacing the file costs a write and an fsync that
+ * must not hold up the fragment switch */
+static void
+replace_index_entry (GstSplitMuxSink * splitmux, const gchar * path,
+    GstSplitMuxIndexEntry * entry)
+{
+  SplitMuxIndexWrite *w;
+  guint i;
+
+  for (i = 0; i < splitmux->index_entries->len; i++) {
+    GstSplitMuxIndexEntry *old = g_ptr_array_index (splitmux->index_entries,
+        i);
+
+    if (g_strcmp0 (old->location, entry->location) == 0) {
+      g_ptr_array_remove_index (splitmux->index_entries, i);
+      break;
+    }
+  }
+  g_ptr_array_add (splitmux->index_entries, entry);
+
+  w = g_slice_new0 (SplitMuxIndexWrite);
+  w->path = g_strdup (path);
+  w->data = gst_split_util_index_serialize (splitmux->index_entries,
+      &w->length);
+  w->seq = ++splitmux->index_seq;
+
+  gst_element_call_async (GST_ELEMENT_CAST (splitmux),
+      (GstElementCallAsyncFunc) write_index_async, w,
+      (GDestroyNotify) split_mux_index_write_free);
+}
+
+/* Called with lock held, takes @entry */
+static void
+write_index_entry (GstSplitMuxSink * splitmux, GstSplitMuxIndexEntry * entry,
+    GstElement * sink)
+{
+  GError *err = NULL;
+  gchar *path;
+
+  if (entry == NULL)
+    return;
+
+  GST_OBJECT_LOCK (splitmux);
+  path = g_strdup (splitmux->index_location);
+  GST_OBJECT_UNLOCK (splitmux);
+
+  if (path == NULL) {
+    gst_split_util_index_entry_free (entry);
+    return;
+  }
+
+  entry->size = query_written_bytes (sink);
+
+  if (splitmux->max_files > 0) {
+    replace_index_entry (splitmux, path, entry);
+    splitmux->index_count++;
+  } else if (!gst_split_util_index_append (path, splitmux->index_count, entry,
+          &err)) {
+    GST_WARNING_OBJECT (splitmux, "Failed to update index: %s", err->message);
+    g_clear_error (&err);
+    gst_split_util_index_entry_free (entry);
+  } else {
+    splitmux->index_count++;
+    gst_split_util_index_entry_free (entry);
+  }
+
+  g_free (path);
 }
 
 /* Called with lock held, drops the lock to send EOS to the
@@ -705,6 +1320,19 @@ send_eos (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
   gst_object_unref (pad);
 }
 
+/* Called with lock held */
+static gboolean
+all_contexts_out_eos (GstSplitMuxSink * splitmux)
+{
+  GList *cur;
+
+  for (cur = splitmux->contexts; cur; cur = cur->next) {
+    if (!((MqStreamCtx *) cur->data)->out_eos)
+      return FALSE;
+  }
+  return TRUE;
+}
+
 /* Called with splitmux lock held to check if this output
  * context needs to sleep to wait for the release of the
  * next GOP, or to send EOS to close out the current file
@@ -728,7 +1356,7 @@ send_eos (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
  * RETURN: means complete to output
  */
 static void
-complete_or_wait_on_out (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
+do_complete_or_wait_on_out (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
 {
   if (ctx->caps_change)
     return;
@@ -778,6 +1406,16 @@ complete_or_wait_on_out (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
         case SPLITMUX_OUTPUT_STATE_ENDING_FILE:
           /* We've reached the max out running_time to get here, so end this file now */
           if (ctx->out_eos == FALSE) {
+            if (splitmux->async_close) {
+              /* The muxer gets its EOS from retire_pair () after the switch,
+               * so the next fragment can start once all streams got here */
+              ctx->out_eos = TRUE;
+              if (all_contexts_out_eos (splitmux)) {
+                splitmux->output_state = SPLITMUX_OUTPUT_STATE_START_NEXT_FILE;
+                GST_SPLITMUX_BROADCAST_OUTPUT (splitmux);
+              }
+              continue;
+            }
             send_eos (splitmux, ctx);//for all stream contexts only send_eos once
             continue;
           }
@@ -804,6 +1442,7 @@ complete_or_wait_on_out (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
               if (cmd->start_new_fragment) {
                 GST_DEBUG_OBJECT (splitmux, "Got cmd to start new fragment");
                 splitmux->output_state = SPLITMUX_OUTPUT_STATE_ENDING_FILE;
+                splitmux->async_close = can_close_async (splitmux);
               } else {
                 GST_DEBUG_OBJECT (splitmux,
                     "Got new output cmd for time %" GST_STIME_FORMAT,
@@ -812,13 +1451,15 @@ complete_or_wait_on_out (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
                 /* Extend the output range immediately */
                 splitmux->max_out_running_time = cmd->max_output_ts;
                 splitmux->output_state = SPLITMUX_OUTPUT_STATE_OUTPUT_GOP;
+                if (cmd->discont)
+                  splitmux->fragment_discont = TRUE;
               }
               GST_SPLITMUX_BROADCAST_OUTPUT (splitmux);
 
               out_cmd_buf_free (cmd);
               break;
             } else {
-              GST_SPLITMUX_WAIT_OUTPUT (splitmux);
+              GST_SPLITMUX_WAIT_OUTPUT (splitmux, ctx);
             }
           } while (splitmux->output_state ==
               SPLITMUX_OUTPUT_STATE_AWAITING_COMMAND);
@@ -835,7 +1476,7 @@ complete_or_wait_on_out (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
         GST_STIME_FORMAT " (max %" GST_STIME_FORMAT ") or state change.",
         GST_STIME_ARGS (ctx->out_running_time),
         GST_STIME_ARGS (splitmux->max_out_running_time));
-    GST_SPLITMUX_WAIT_OUTPUT (splitmux);
+    GST_SPLITMUX_WAIT_OUTPUT (splitmux, ctx);
     GST_INFO_OBJECT (ctx->srcpad,
         "Woken for new max running time %" GST_STIME_FORMAT,
         GST_STIME_ARGS (splitmux->max_out_running_time));
@@ -843,6 +1484,18 @@ complete_or_wait_on_out (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
   while (1);
 }
 
+static void
+complete_or_wait_on_out (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
+{
+  do_complete_or_wait_on_out (splitmux, ctx);
+
+  if (ctx->out_block_start != 0) {
+    histogram_add (&ctx->out_blocked,
+        g_get_monotonic_time () - ctx->out_block_start);
+    ctx->out_block_start = 0;
+  }
+}
+
 static GstClockTime
 calculate_next_max_timecode (GstSplitMuxSink * splitmux,
     const GstVideoTimeCode * cur_tc)
@@ -883,6 +1536,94 @@ calculate_next_max_timecode (GstSplitMuxSink * splitmux,
   return next_max_tc_time;
 }
 
+/* Called with lock held at a fragment start. Keeps the next
+ * KEYFRAME_REQUESTS_AHEAD points of the threshold_time grid requested
+ * upstream, so the encoder has each request well before it reaches that
+ * running time. Every request is moved earlier by the measured keyframe
+ * latency */
+static gboolean
+schedule_keyframes (GstSplitMuxSink * splitmux)
+{
+  GstClockTime start = splitmux->fragment_start_time;
+  GstClockTime threshold = splitmux->threshold_time;
+  gboolean ret = TRUE;
+
+  if (!GST_CLOCK_TIME_IS_VALID (splitmux->next_split_time)) {
+    splitmux->next_split_time = start + threshold;
+    splitmux->last_keyframe_target = start;
+  }
+  /* a late cut shortens the next fragment, the grid stays */
+  while (splitmux->next_split_time <= start + SPLIT_TIME_TOLERANCE)
+    splitmux->next_split_time += threshold;
+
+  while (splitmux->last_keyframe_target <
+      splitmux->next_split_time + (KEYFRAME_REQUESTS_AHEAD - 1) * threshold) {
+    GstClockTime target;
+    GstEvent *ev;
+
+    splitmux->last_keyframe_target =
+        MAX (splitmux->last_keyframe_target + threshold,
+        splitmux->next_split_time);
+    target = splitmux->last_keyframe_target;
+    target -= MIN (target - start, splitmux->keyframe_latency);
+    g_array_append_val (splitmux->keyframe_targets, target);
+
+    ev = gst_video_event_new_upstream_force_key_unit (target, TRUE, 0);
+    GST_INFO_OBJECT (splitmux, "Requesting keyframe at %" GST_TIME_FORMAT
+        " for split point %" GST_TIME_FORMAT, GST_TIME_ARGS (target),
+        GST_TIME_ARGS (splitmux->last_keyframe_target));
+    ret &= gst_pad_push_event (splitmux->reference_ctx->sinkpad, ev);
+  }
+
+  return ret;
+}
+
+/* Called with lock held for every keyframe on the reference stream.
+ * Measures how late it came after the request it answers */
+static void
+note_keyframe (GstSplitMuxSink * splitmux, GstClockTimeDiff running_time)
+{
+  GArray *targets = splitmux->keyframe_targets;
+  GstClockTime target = GST_CLOCK_TIME_NONE;
+  GstClockTime latency;
+  guint n = 0;
+
+  if (running_time < 0)
+    return;
+
+  while (n < targets->len &&
+      g_array_index (targets, GstClockTime, n) <= (GstClockTime) running_time)
+    target = g_array_index (targets, GstClockTime, n++);
+  if (n == 0)
+    return;
+  g_array_remove_range (targets, 0, n);
+
+  latency = running_time - target;
+  splitmux->keyframe_latency = MIN (splitmux->threshold_time / 2,
+      (GstClockTime) (splitmux->keyframe_latency +
+          KEYFRAME_LATENCY_WEIGHT * ((gdouble) latency -
+              (gdouble) splitmux->keyframe_latency)));
+
+  GST_LOG_OBJECT (splitmux, "Keyframe %" GST_TIME_FORMAT " after request, "
+      "latency now %" GST_TIME_FORMAT, GST_TIME_ARGS (latency),
+      GST_TIME_ARGS (splitmux->keyframe_latency));
+}
+
+/* Called with lock held when a fragment of @duration was cut */
+static void
+note_fragment_duration (GstSplitMuxSink * splitmux, GstClockTimeDiff duration)
+{
+  gdouble d = (gdouble) duration / GST_SECOND;
+  gdouble delta;
+
+  GST_OBJECT_LOCK (splitmux);
+  splitmux->n_durations++;
+  delta = d - splitmux->duration_mean;
+  splitmux->duration_mean += delta / splitmux->n_durations;
+  splitmux->duration_m2 += delta * (d - splitmux->duration_mean);
+  GST_OBJECT_UNLOCK (splitmux);
+}
+
 // "gst_video_event_new_upstream_force_key_unit" prerequest next keyframe to upstream
 static gboolean
 request_next_keyframe (GstSplitMuxSink * splitmux, GstBuffer * buffer)
@@ -912,15 +1653,17 @@ request_next_keyframe (GstSplitMuxSink * splitmux, GstBuffer * buffer)
 
   if (splitmux->send_keyframe_requests == FALSE
       || (splitmux->threshold_time == 0 && !timecode_based)
-      || splitmux->threshold_bytes != 0)
+      || splitmux->threshold_bytes != 0) {
+    splitmux->next_split_time = GST_CLOCK_TIME_NONE;
     return TRUE;
-
-  if (timecode_based) {
-    /* We might have rounding errors: aim slightly earlier */
-    target_time = splitmux->next_max_tc_time - 5 * GST_USECOND;
-  } else {
-    target_time = splitmux->fragment_start_time + splitmux->threshold_time;
   }
+
+  if (!timecode_based)
+    return schedule_keyframes (splitmux);
+  splitmux->next_split_time = GST_CLOCK_TIME_NONE;
+
+  /* We might have rounding errors: aim slightly earlier */
+  target_time = splitmux->next_max_tc_time - SPLIT_TIME_TOLERANCE;
   ev = gst_video_event_new_upstream_force_key_unit (target_time, TRUE, 0);
   GST_INFO_OBJECT (splitmux, "Requesting next keyframe at %" GST_TIME_FORMAT,
       GST_TIME_ARGS (target_time));
@@ -931,15 +1674,10 @@ static GstPadProbeReturn
 handle_mq_output (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
 {
   GstSplitMuxSink *splitmux = ctx->splitmux;
-  MqStreamBuf *buf_info = NULL;
+  MqStreamBuf buf_info;
 
   GST_LOG_OBJECT (pad, "Fired probe type 0x%x", info->type);
 
-  /* FIXME: Handle buffer lists, until then make it clear they won't work */
-  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
-    g_warning ("Buffer list handling not implemented");
-    return GST_PAD_PROBE_DROP;
-  }
   if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM ||
       info->type & GST_PAD_PROBE_TYPE_EVENT_FLUSH) {
     GstEvent *event = gst_pad_probe_info_get_event (info);
@@ -955,8 +1693,8 @@ handle_mq_output (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
         GST_SPLITMUX_LOCK (splitmux);
         locked = TRUE;
         gst_segment_init (&ctx->out_segment, GST_FORMAT_UNDEFINED);
-        g_queue_foreach (&ctx->queued_bufs, (GFunc) mq_stream_buf_free, NULL);
-        g_queue_clear (&ctx->queued_bufs);
+        mq_stream_bufs_clear (ctx);
+        ctx->queued_buffers = 0;
         ctx->flushing = FALSE;
         break;
       case GST_EVENT_FLUSH_START:
@@ -1034,6 +1772,7 @@ handle_mq_output (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
       }
       case GST_EVENT_CAPS:{
         GstPad *peer;
+        GstCaps *caps;
 
         if (!ctx->is_reference)
           break;
@@ -1095,82 +1834,604 @@ handle_mq_output (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
   /* Allow everything through until the configured next stopping point */
   GST_SPLITMUX_LOCK (splitmux);
 
-  buf_info = g_queue_pop_tail (&ctx->queued_bufs);
-  if (buf_info == NULL)
+  if (!mq_stream_bufs_pop (ctx, &buf_info))
     /* Can only happen due to a poorly timed flush */
     goto beach;
 
+  ctx->queued_buffers -= MIN (ctx->queued_buffers, buf_info.n_buffers);
+
   /* If we have popped a keyframe, decrement the queued_gop count */
-  if (buf_info->keyframe && splitmux->queued_keyframes > 0)
+  if (buf_info.keyframe && splitmux->queued_keyframes > 0)
     splitmux->queued_keyframes--;
 
-  ctx->out_running_time = buf_info->run_ts;
-  ctx->cur_out_buffer = gst_pad_probe_info_get_buffer (info);
+  ctx->out_running_time = buf_info.run_ts;
+  /* A buffer list was queued as one item, its first buffer stands for it */
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+    ctx->cur_out_buffer =
+        gst_buffer_list_get (gst_pad_probe_info_get_buffer_list (info), 0);
+  else
+    ctx->cur_out_buffer = gst_pad_probe_info_get_buffer (info);
 
   GST_LOG_OBJECT (splitmux,
       "Pad %" GST_PTR_FORMAT " buffer with run TS %" GST_STIME_FORMAT
       " size %" G_GUINT64_FORMAT,
-      pad, GST_STIME_ARGS (ctx->out_running_time), buf_info->buf_size);
+      pad, GST_STIME_ARGS (ctx->out_running_time), buf_info.buf_size);
 
   ctx->caps_change = FALSE;
 
   complete_or_wait_on_out (splitmux, ctx);
 
-  splitmux->muxed_out_bytes += buf_info->buf_size;
+  if (ctx->is_reference && buf_info.keyframe)
+    add_index_keyframe (splitmux, buf_info.run_ts);
+
+  splitmux->muxed_out_bytes += buf_info.buf_size;
+
+  GST_LOG_OBJECT (pad, "Returning to pass buffer %" GST_PTR_FORMAT
+      " run ts %" GST_STIME_FORMAT, ctx->cur_out_buffer,
+      GST_STIME_ARGS (ctx->out_running_time));
 
-#ifndef GST_DISABLE_GST_DEBUG
-  {
-    GstBuffer *buf = gst_pad_probe_info_get_buffer (info);
-    GST_LOG_OBJECT (pad, "Returning to pass buffer %" GST_PTR_FORMAT
-        " run ts %" GST_STIME_FORMAT, buf,
-        GST_STIME_ARGS (ctx->out_running_time));
+  ctx->cur_out_buffer = NULL;
+  GST_SPLITMUX_UNLOCK (splitmux);
+
+  /* pending_gap is protected by the STREAM lock */
+  if (ctx->pending_gap) {
+    /* If we previously stored a gap event, send it now */
+    GstPad *peer = gst_pad_get_peer (ctx->srcpad);
+
+    GST_DEBUG_OBJECT (splitmux,
+        "Pad %" GST_PTR_FORMAT " sending pending GAP event", ctx->srcpad);
+
+    gst_pad_send_event (peer, ctx->pending_gap);
+    ctx->pending_gap = NULL;
+
+    gst_object_unref (peer);
   }
-#endif
 
-  ctx->cur_out_buffer = NULL;
+  return GST_PAD_PROBE_PASS;
+
+beach:
+  GST_SPLITMUX_UNLOCK (splitmux);
+  return GST_PAD_PROBE_DROP;
+}
+
+static gboolean
+resend_sticky (GstPad * pad, GstEvent ** event, GstPad * peer)
+{
+  return gst_pad_send_event (peer, gst_event_ref (*event));
+}
+
+static void
+restart_context (MqStreamCtx * ctx, GstSplitMuxSink * splitmux)
+{
+  GstPad *peer = gst_pad_get_peer (ctx->srcpad);
+
+  gst_pad_sticky_events_foreach (ctx->srcpad,
+      (GstPadStickyEventsForeachFunction) (resend_sticky), peer);
+
+  /* Clear EOS flag if not actually EOS */
+  ctx->out_eos = GST_PAD_IS_EOS (ctx->srcpad);
+
+  gst_object_unref (peer);
+}
+
+/* A muxer/sink pair outside the bin, either freshly cloned or retired
+ * after its fragment was closed. With mux-workers a retired pair stays in
+ * the bin until retire_pair () finalised its fragment */
+typedef struct _SplitMuxPair
+{
+  GstElement *muxer;
+  GstElement *active_sink;
+
+  guint seq;                    //order of the fragment among retired pairs
+  gboolean got_eos;             //active_sink posted EOS (or an error)
+  guint64 muxed_bytes;          //muxed_out_bytes of the fragment
+  GstMessage *closed_msg;       //fragment-closed of this pair
+  GstMessage *opened_msg;       //fragment-opened of the following fragment
+  GstSplitMuxIndexEntry *index_entry;   //written with the fragment-closed
+} SplitMuxPair;
+
+static void
+split_mux_pair_free (SplitMuxPair * pair)
+{
+  if (pair->muxer)
+    gst_object_unref (pair->muxer);
+  if (pair->active_sink)
+    gst_object_unref (pair->active_sink);
+  if (pair->closed_msg)
+    gst_message_unref (pair->closed_msg);
+  if (pair->opened_msg)
+    gst_message_unref (pair->opened_msg);
+  if (pair->index_entry)
+    gst_split_util_index_entry_free (pair->index_entry);
+  g_slice_free (SplitMuxPair, pair);
+}
+
+/* Set a pair we own to NULL and drop it */
+static void
+drop_standby_pair (GstSplitMuxSink * splitmux, GstElement * muxer,
+    GstElement * active_sink)
+{
+  if (muxer) {
+    gst_element_set_state (muxer, GST_STATE_NULL);
+    gst_element_set_bus (muxer, NULL);
+    gst_object_unref (muxer);
+  }
+  if (active_sink) {
+    gst_element_set_state (active_sink, GST_STATE_NULL);
+    gst_element_set_bus (active_sink, NULL);
+    gst_object_unref (active_sink);
+  }
+}
+
+static void
+release_standby_pad (MqStreamCtx * ctx)
+{
+  GstElement *muxer;
+
+  if (ctx->standby_pad == NULL)
+    return;
+
+  muxer = gst_pad_get_parent_element (ctx->standby_pad);
+  if (muxer) {
+    gst_element_release_request_pad (muxer, ctx->standby_pad);
+    gst_object_unref (muxer);
+  }
+  gst_object_unref (ctx->standby_pad);
+  ctx->standby_pad = NULL;
+}
+
+/* Create a new element from the factory of @e, with the same property
+ * values. Bins can't be cloned that way, their children aren't copied */
+static GstElement *
+clone_element (GstElement * e)
+{
+  GstElementFactory *factory = gst_element_get_factory (e);
+  GParamSpec **pspecs;
+  GstElement *clone;
+  guint i, n_pspecs;
+
+  if (factory == NULL || GST_IS_BIN (e))
+    return NULL;
+
+  clone = gst_element_factory_create (factory, NULL);
+  if (clone == NULL)
+    return NULL;
+  gst_object_ref_sink (clone);
+
+  pspecs = g_object_class_list_properties (G_OBJECT_GET_CLASS (e), &n_pspecs);
+  for (i = 0; i < n_pspecs; i++) {
+    GParamSpec *pspec = pspecs[i];
+    GValue value = G_VALUE_INIT;
+
+    if ((pspec->flags & G_PARAM_READWRITE) != G_PARAM_READWRITE ||
+        (pspec->flags & (G_PARAM_CONSTRUCT_ONLY | G_PARAM_DEPRECATED)) ||
+        pspec->owner_type == GST_TYPE_OBJECT)
+      continue;
+
+    g_value_init (&value, pspec->value_type);
+    g_object_get_property (G_OBJECT (e), pspec->name, &value);
+    g_object_set_property (G_OBJECT (clone), pspec->name, &value);
+    g_value_unset (&value);
+  }
+  g_free (pspecs);
+
+  return clone;
+}
+
+/* Runs from gst_element_call_async. Brings @pair to READY outside the bin,
+ * with a request pad for every stream, and publishes it as the standby
+ * pair. An empty pair is cloned from the current muxer and sink, a retired
+ * one is set to NULL first, which closes its fragment here instead of on
+ * the streaming thread */
+static void
+prepare_standby (GstElement * element, SplitMuxPair * pair)
+{
+  GstSplitMuxSink *splitmux = GST_SPLITMUX_SINK (element);
+  GstElement *muxer, *active_sink;
+  GstPad *srcpad;
+  gboolean linked;
+  GList *cur;
+
+  /* The pair is outside the bin, so this doesn't need the state lock and
+   * doesn't hold up a legacy restart on the streaming thread */
+  GST_SPLITMUX_LOCK (splitmux);
+  if (splitmux->muxer == NULL) {
+    /* reset in the meantime */
+    goto done;
+  }
+
+  if (pair->muxer == NULL) {
+    muxer = gst_object_ref (splitmux->muxer);
+    active_sink = gst_object_ref (splitmux->active_sink);
+    GST_SPLITMUX_UNLOCK (splitmux);
+
+    pair->muxer = clone_element (muxer);
+    pair->active_sink = clone_element (active_sink);
+    if (pair->muxer == NULL || pair->active_sink == NULL) {
+      GST_WARNING_OBJECT (splitmux, "Can't clone %" GST_PTR_FORMAT " and %"
+          GST_PTR_FORMAT ", restarting them for every fragment instead",
+          muxer, active_sink);
+      GST_OBJECT_LOCK (splitmux);
+      splitmux->use_standby = FALSE;
+      splitmux->mux_workers = 1;
+      GST_OBJECT_UNLOCK (splitmux);
+    } else {
+      GST_DEBUG_OBJECT (splitmux, "Created standby pair %" GST_PTR_FORMAT
+          " ! %" GST_PTR_FORMAT, pair->muxer, pair->active_sink);
+    }
+    gst_object_unref (muxer);
+    gst_object_unref (active_sink);
+
+    GST_SPLITMUX_LOCK (splitmux);
+    if (pair->muxer == NULL || pair->active_sink == NULL)
+      goto done;
+  }
+  GST_SPLITMUX_UNLOCK (splitmux);
+
+  /* Messages of the pair still go through our bus handler */
+  gst_element_set_bus (pair->muxer, GST_BIN_CAST (splitmux)->child_bus);
+  gst_element_set_bus (pair->active_sink, GST_BIN_CAST (splitmux)->child_bus);
+
+  gst_element_set_state (pair->muxer, GST_STATE_NULL);
+  gst_element_set_state (pair->active_sink, GST_STATE_NULL);
+
+  /* removing a pair from the bin unlinks it */
+  srcpad = gst_element_get_static_pad (pair->muxer, "src");
+  linked = srcpad && gst_pad_is_linked (srcpad);
+  if (srcpad)
+    gst_object_unref (srcpad);
+  if (!linked && !gst_element_link (pair->muxer, pair->active_sink)) {
+    GST_WARNING_OBJECT (splitmux, "Failed to link standby pair");
+    GST_SPLITMUX_LOCK (splitmux);
+    goto done;
+  }
+
+  if (gst_element_set_state (pair->muxer,
+          GST_STATE_READY) == GST_STATE_CHANGE_FAILURE
+      || gst_element_set_state (pair->active_sink,
+          GST_STATE_READY) == GST_STATE_CHANGE_FAILURE) {
+    GST_WARNING_OBJECT (splitmux, "Failed to bring standby pair to READY");
+    GST_SPLITMUX_LOCK (splitmux);
+    goto done;
+  }
+
+  GST_SPLITMUX_LOCK (splitmux);
+  if (splitmux->muxer == NULL)
+    goto done;
+
+  for (cur = splitmux->contexts; cur; cur = cur->next) {
+    MqStreamCtx *ctx = cur->data;
+    GstPad *peer;
+
+    if (ctx->standby_pad != NULL)
+      continue;
+
+    peer = gst_pad_get_peer (ctx->srcpad);
+    if (peer == NULL)
+      continue;
+    ctx->standby_pad = gst_element_request_pad (pair->muxer,
+        GST_PAD_PAD_TEMPLATE (peer), NULL, NULL);
+    gst_object_unref (peer);
+    if (ctx->standby_pad == NULL)
+      GST_WARNING_OBJECT (splitmux, "Standby muxer has no pad for %"
+          GST_PTR_FORMAT, ctx->srcpad);
+  }
+
+  splitmux->standby_muxer = pair->muxer;
+  splitmux->standby_active_sink = splitmux->standby_sink = pair->active_sink;
+  splitmux->standby_ready = TRUE;
+  pair->muxer = pair->active_sink = NULL;
+
+done:
+  splitmux->standby_pending = FALSE;
+  GST_SPLITMUX_UNLOCK (splitmux);
+
+  if (pair->muxer || pair->active_sink) {
+    drop_standby_pair (splitmux, pair->muxer, pair->active_sink);
+    pair->muxer = pair->active_sink = NULL;
+  }
+}
+
+/* Called with lock held */
+static void
+schedule_standby (GstSplitMuxSink * splitmux, GstElement * muxer,
+    GstElement * active_sink)
+{
+  SplitMuxPair *pair = g_slice_new0 (SplitMuxPair);
+
+  pair->muxer = muxer;
+  pair->active_sink = active_sink;
+  splitmux->standby_pending = TRUE;
+
+  gst_element_call_async (GST_ELEMENT_CAST (splitmux),
+      (GstElementCallAsyncFunc) prepare_standby, pair,
+      (GDestroyNotify) split_mux_pair_free);
+}
+
+static gboolean
+standby_covers_contexts (GstSplitMuxSink * splitmux)
+{
+  GList *cur;
+
+  if (!splitmux->standby_ready)
+    return FALSE;
+
+  for (cur = splitmux->contexts; cur; cur = cur->next) {
+    if (((MqStreamCtx *) cur->data)->standby_pad == NULL)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* Called with lock held when a fragment is about to end. The fragment can
+ * be left to a worker if a standby pair can take over right away and not
+ * all workers are busy finalising earlier fragments */
+static gboolean
+can_close_async (GstSplitMuxSink * splitmux)
+{
+  guint n_workers;
+
+  GST_OBJECT_LOCK (splitmux);
+  n_workers = splitmux->mux_workers;
+  GST_OBJECT_UNLOCK (splitmux);
+
+  return n_workers > 1 && splitmux->n_retiring < n_workers - 1 &&
+      standby_covers_contexts (splitmux);
+}
+
+static gboolean
+send_eos_to_pad (GstElement * element, GstPad * pad, gpointer user_data)
+{
+  gst_pad_send_event (pad, gst_event_new_eos ());
+  return TRUE;
+}
+
+static gboolean
+collect_request_pad (GstElement * element, GstPad * pad, GList ** pads)
+{
+  GstPadTemplate *templ = GST_PAD_PAD_TEMPLATE (pad);
+
+  if (templ && GST_PAD_TEMPLATE_PRESENCE (templ) == GST_PAD_REQUEST)
+    *pads = g_list_prepend (*pads, gst_object_ref (pad));
+  return TRUE;
+}
+
+static void
+release_request_pads (GstElement * muxer)
+{
+  GList *pads = NULL, *cur;
+
+  gst_element_foreach_sink_pad (muxer,
+      (GstElementForeachPadFunc) collect_request_pad, &pads);
+  for (cur = pads; cur; cur = cur->next)
+    gst_element_release_request_pad (muxer, cur->data);
+  g_list_free_full (pads, gst_object_unref);
+}
+
+/* Called with lock held from the bus handler. Marks the retired pair
+ * @src belongs to as drained, returns FALSE if @src is not part of one */
+static gboolean
+note_retired_eos (GstSplitMuxSink * splitmux, GstObject * src)
+{
+  GList *cur;
+
+  for (cur = splitmux->retiring; cur; cur = cur->next) {
+    SplitMuxPair *pair = cur->data;
+
+    if (src == GST_OBJECT_CAST (pair->muxer)
+        || src == GST_OBJECT_CAST (pair->active_sink)) {
+      pair->got_eos = TRUE;
+      g_cond_broadcast (&splitmux->retire_cond);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static void update_mux_overhead (GstSplitMuxSink * splitmux,
+    GstElement * sink, guint64 muxed_bytes);
+
+/* Runs from gst_element_call_async. Sends EOS into a retired pair that is
+ * still in the bin, posts its fragment-closed message once it is drained
+ * and every earlier fragment was closed, then takes it out of the bin and
+ * recycles it as standby pair or drops it */
+static void
+retire_pair (GstElement * element, SplitMuxPair * pair)
+{
+  GstSplitMuxSink *splitmux = GST_SPLITMUX_SINK (element);
+  gboolean reuse;
+  gint64 deadline;
+
+  GST_DEBUG_OBJECT (splitmux, "Finalising fragment on %" GST_PTR_FORMAT,
+      pair->active_sink);
+
+  /* The streams were relinked to the standby pair, nothing else pushes
+   * into these pads anymore */
+  gst_element_foreach_sink_pad (pair->muxer, send_eos_to_pad, NULL);
+
+  /* Don't hold up shutdown or the final EOS, which wait for all retired
+   * pairs, on a pair that never drains */
+  GST_SPLITMUX_LOCK (splitmux);
+  deadline = g_get_monotonic_time () + RETIRE_EOS_TIMEOUT;
+  while (!pair->got_eos
+      && splitmux->output_state != SPLITMUX_OUTPUT_STATE_STOPPED) {
+    if (!g_cond_wait_until (&splitmux->retire_cond, &splitmux->lock,
+            deadline)) {
+      GST_WARNING_OBJECT (splitmux, "%" GST_PTR_FORMAT " did not drain, "
+          "giving up on its fragment", pair->active_sink);
+      break;
+    }
+  }
+  while (splitmux->closed_seq != pair->seq)
+    g_cond_wait (&splitmux->retire_cond, &splitmux->lock);
+
+  /* An undrained fragment is not indexed, split_mux_pair_free () drops
+   * its entry */
+  if (pair->got_eos) {
+    update_mux_overhead (splitmux, pair->active_sink, pair->muxed_bytes);
+    write_index_entry (splitmux, pair->index_entry, pair->active_sink);
+    pair->index_entry = NULL;
+  }
+
+  /* Posted before the sink stops, like on the streaming thread */
+  gst_element_post_message (element, pair->closed_msg);
+  pair->closed_msg = NULL;
+  if (pair->opened_msg) {
+    gst_element_post_message (element, pair->opened_msg);
+    pair->opened_msg = NULL;
+  }
+  splitmux->closed_seq++;
+  g_cond_broadcast (&splitmux->retire_cond);
+  GST_SPLITMUX_UNLOCK (splitmux);
+
+  gst_element_set_state (pair->muxer, GST_STATE_NULL);
+  gst_element_set_state (pair->active_sink, GST_STATE_NULL);
+  release_request_pads (pair->muxer);
+  gst_bin_remove (GST_BIN_CAST (splitmux), pair->muxer);
+  gst_bin_remove (GST_BIN_CAST (splitmux), pair->active_sink);
+
+  GST_SPLITMUX_LOCK (splitmux);
+  splitmux->retiring = g_list_remove (splitmux->retiring, pair);
+  splitmux->n_retiring--;
+  g_cond_broadcast (&splitmux->retire_cond);
+
+  reuse = splitmux->muxer != NULL && splitmux->standby_muxer == NULL
+      && !splitmux->standby_pending;
+  if (reuse)
+    splitmux->standby_pending = TRUE;
+  GST_SPLITMUX_UNLOCK (splitmux);
+
+  if (reuse) {
+    prepare_standby (element, pair);
+  } else {
+    drop_standby_pair (splitmux, pair->muxer, pair->active_sink);
+    pair->muxer = pair->active_sink = NULL;
+  }
+}
+
+/* Called with lock held and switching_fragment set. Takes the current
+ * pair out of the bin, links the standby pair in its place and hands the
+ * old one to prepare_standby, which closes it and makes it the next
+ * standby pair.
+ * With async_close the old pair didn't get EOS yet. It stays in the bin and
+ * is returned in @retired, to be scheduled on retire_pair () by the caller.
+ * Returns FALSE without touching the current pair if the standby pair
+ * can't take over anymore */
+static gboolean
+swap_to_standby (GstSplitMuxSink * splitmux, MqStreamCtx * ctx,
+    SplitMuxPair ** retired_pair)
+{
+  GstElement *muxer, *active_sink;
+  GList *cur, *pads = NULL, *pad;
+  gchar *location = NULL;
+  SplitMuxPair *retired = NULL;
+
   GST_SPLITMUX_UNLOCK (splitmux);
+  GST_STATE_LOCK (splitmux);
+  GST_SPLITMUX_LOCK (splitmux);
 
-  /* pending_gap is protected by the STREAM lock */
-  if (ctx->pending_gap) {
-    /* If we previously stored a gap event, send it now */
-    GstPad *peer = gst_pad_get_peer (ctx->srcpad);
-
-    GST_DEBUG_OBJECT (splitmux,
-        "Pad %" GST_PTR_FORMAT " sending pending GAP event", ctx->srcpad);
+  /* reset, or a pad was added, while we waited for the state lock */
+  if (splitmux->muxer == NULL || !standby_covers_contexts (splitmux)) {
+    GST_STATE_UNLOCK (splitmux);
+    return FALSE;
+  }
 
-    gst_pad_send_event (peer, ctx->pending_gap);
-    ctx->pending_gap = NULL;
+  muxer = gst_object_ref (splitmux->muxer);
+  active_sink = gst_object_ref (splitmux->active_sink);
+
+  GST_DEBUG_OBJECT (splitmux, "Switching to standby pair %" GST_PTR_FORMAT
+      " ! %" GST_PTR_FORMAT, splitmux->standby_muxer,
+      splitmux->standby_active_sink);
+
+  /* The old muxer pads become the standby pads of the retired pair. A
+   * pair that still has to close its fragment keeps them until
+   * retire_pair () releases them */
+  for (cur = splitmux->contexts; cur; cur = cur->next) {
+    MqStreamCtx *c = cur->data;
+    GstPad *peer = gst_pad_get_peer (c->srcpad);
+
+    gst_pad_unlink (c->srcpad, peer);
+    pads = g_list_append (pads, c->standby_pad);
+    if (splitmux->async_close) {
+      gst_object_unref (peer);
+      c->standby_pad = NULL;
+    } else {
+      c->standby_pad = peer;
+    }
+  }
 
-    gst_object_unref (peer);
+  if (splitmux->async_close) {
+    retired = g_slice_new0 (SplitMuxPair);
+    retired->muxer = muxer;
+    retired->active_sink = active_sink;
+    retired->seq = splitmux->retire_seq++;
+    retired->muxed_bytes = splitmux->muxed_out_bytes;
+    retired->closed_msg = build_fragment_opened_closed_msg (splitmux, FALSE);
+    retired->index_entry = finish_index_entry (splitmux);
+    splitmux->retiring = g_list_append (splitmux->retiring, retired);
+    splitmux->n_retiring++;
+  } else if (splitmux->muxed_out_bytes == 0 && splitmux->fragment_id > 0) {
+    /* the retired pair still writes its file, so only reuse it here */
+    g_object_get (splitmux->sink, "location", &location, NULL);
   }
 
-  mq_stream_buf_free (buf_info);
+  splitmux->muxer = splitmux->standby_muxer;
+  splitmux->active_sink = splitmux->standby_active_sink;
+  splitmux->sink = splitmux->standby_sink;
+  splitmux->standby_muxer = splitmux->standby_active_sink =
+      splitmux->standby_sink = NULL;
+  splitmux->standby_ready = FALSE;
+
+  /* Add the new pair before removing the old one, so the bin keeps its
+   * sink flag. Pads can only be linked within the same bin */
+  gst_element_set_locked_state (splitmux->muxer, TRUE);
+  gst_element_set_locked_state (splitmux->active_sink, TRUE);
+  gst_bin_add (GST_BIN_CAST (splitmux), splitmux->muxer);
+  gst_bin_add (GST_BIN_CAST (splitmux), splitmux->active_sink);
+  /* the bin holds the refs now */
+  gst_object_unref (splitmux->muxer);
+  gst_object_unref (splitmux->active_sink);
 
-  return GST_PAD_PROBE_PASS;
+  gst_element_set_locked_state (muxer, TRUE);
+  gst_element_set_locked_state (active_sink, TRUE);
+  if (retired == NULL) {
+    gst_bin_remove (GST_BIN_CAST (splitmux), muxer);
+    gst_bin_remove (GST_BIN_CAST (splitmux), active_sink);
+  }
 
-beach:
-  GST_SPLITMUX_UNLOCK (splitmux);
-  return GST_PAD_PROBE_DROP;
-}
+  for (cur = splitmux->contexts, pad = pads; cur && pad;
+      cur = cur->next, pad = pad->next) {
+    MqStreamCtx *c = cur->data;
 
-static gboolean
-resend_sticky (GstPad * pad, GstEvent ** event, GstPad * peer)
-{
-  return gst_pad_send_event (peer, gst_event_ref (*event));
-}
+    if (gst_pad_link (c->srcpad, pad->data) != GST_PAD_LINK_OK)
+      GST_WARNING_OBJECT (splitmux, "Failed to link %" GST_PTR_FORMAT
+          " to standby muxer", c->srcpad);
+  }
+  g_list_free_full (pads, gst_object_unref);
 
-static void
-restart_context (MqStreamCtx * ctx, GstSplitMuxSink * splitmux)
-{
-  GstPad *peer = gst_pad_get_peer (ctx->srcpad);
+  if (location) {
+    /* nothing was written, reuse the file */
+    g_object_set (splitmux->sink, "location", location, NULL);
+    g_free (location);
+  } else {
+    set_next_filename (splitmux, ctx);
+  }
+  splitmux->muxed_out_bytes = 0;
 
-  gst_pad_sticky_events_foreach (ctx->srcpad,
-      (GstPadStickyEventsForeachFunction) (resend_sticky), peer);
+  gst_element_set_state (splitmux->active_sink, GST_STATE_TARGET (splitmux));
+  gst_element_set_state (splitmux->muxer, GST_STATE_TARGET (splitmux));
+  gst_element_set_locked_state (splitmux->muxer, FALSE);
+  gst_element_set_locked_state (splitmux->active_sink, FALSE);
 
-  /* Clear EOS flag if not actually EOS */
-  ctx->out_eos = GST_PAD_IS_EOS (ctx->srcpad);
+  if (retired == NULL)
+    schedule_standby (splitmux, muxer, active_sink);
+  else if (!splitmux->standby_pending)
+    schedule_standby (splitmux, NULL, NULL);
 
-  gst_object_unref (peer);
+  GST_STATE_UNLOCK (splitmux);
+
+  *retired_pair = retired;
+  return TRUE;
 }
 
 /* Called with lock held when a fragment
@@ -1181,10 +2442,36 @@ static void
 start_next_fragment (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
 {
   GstElement *muxer, *sink;
+  SplitMuxPair *retired = NULL;
+  gint64 switch_start = g_get_monotonic_time ();
 
   /* 1 change to new file */
   splitmux->switching_fragment = TRUE;
 
+  if (standby_covers_contexts (splitmux) &&
+      swap_to_standby (splitmux, ctx, &retired))
+    goto opened;
+
+  if (splitmux->async_close) {
+    /* The streams stopped at the end of the fragment without sending EOS,
+     * leaving it to retire_pair (), but the standby pair can't take over
+     * anymore. Go back and finalise the fragment on the streaming threads */
+    GList *cur;
+
+    GST_DEBUG_OBJECT (splitmux, "Standby pair gone, ending fragment with EOS");
+    splitmux->switching_fragment = FALSE;
+    splitmux->async_close = FALSE;
+    if (splitmux->muxer == NULL
+        || splitmux->output_state == SPLITMUX_OUTPUT_STATE_STOPPED)
+      return;
+
+    for (cur = splitmux->contexts; cur; cur = cur->next)
+      ((MqStreamCtx *) cur->data)->out_eos = FALSE;
+    splitmux->output_state = SPLITMUX_OUTPUT_STATE_ENDING_FILE;
+    GST_SPLITMUX_BROADCAST_OUTPUT (splitmux);
+    return;
+  }
+
   /* We need to drop the splitmux lock to acquire the state lock
    * here and ensure there's no racy state change going on elsewhere */
   muxer = gst_object_ref (splitmux->muxer);
@@ -1214,20 +2501,74 @@ start_next_fragment (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
 
   GST_SPLITMUX_LOCK (splitmux);
   GST_STATE_UNLOCK (splitmux);
+
+  if ((splitmux->use_standby || splitmux->mux_workers > 1)
+      && splitmux->standby_muxer == NULL && !splitmux->standby_pending)
+    schedule_standby (splitmux, NULL, NULL);
+
+opened:
   splitmux->switching_fragment = FALSE;
+  splitmux->async_close = FALSE;
   do_async_done (splitmux);
 
   splitmux->ready_for_output = TRUE;
 
   g_list_foreach (splitmux->contexts, (GFunc) restart_context, splitmux);
 
-  send_fragment_opened_closed_msg (splitmux, TRUE);
+  start_index_entry (splitmux);
+
+  if (retired) {
+    /* fragment-opened has to follow the fragment-closed of the pair */
+    retired->opened_msg = build_fragment_opened_closed_msg (splitmux, TRUE);
+    gst_element_call_async (GST_ELEMENT_CAST (splitmux),
+        (GstElementCallAsyncFunc) retire_pair, retired,
+        (GDestroyNotify) split_mux_pair_free);
+  } else {
+    send_fragment_opened_closed_msg (splitmux, TRUE);
+  }
+
+  histogram_add (&splitmux->switch_time,
+      g_get_monotonic_time () - switch_start);
 
   /* FIXME: Is this always the correct next state? */
   splitmux->output_state = SPLITMUX_OUTPUT_STATE_AWAITING_COMMAND;
   GST_SPLITMUX_BROADCAST_OUTPUT (splitmux);
 }
 
+/* Called with lock held when @sink got EOS at the end of a fragment.
+ * Folds what the muxer added on top of its input bytes in this fragment
+ * into the estimate handle_gathered_gop () uses */
+static void
+update_mux_overhead (GstSplitMuxSink * splitmux, GstElement * sink,
+    guint64 muxed_bytes)
+{
+  guint64 written;
+  gdouble overhead;
+
+  if (muxed_bytes == 0)
+    return;
+
+  written = query_written_bytes (sink);
+  if (written == 0)
+    return;
+
+  overhead = (gdouble) written / muxed_bytes - 1.0;
+
+  GST_OBJECT_LOCK (splitmux);
+  if (splitmux->have_measured_overhead)
+    splitmux->measured_overhead +=
+        MUX_OVERHEAD_WEIGHT * (overhead - splitmux->measured_overhead);
+  else
+    splitmux->measured_overhead = overhead;
+  splitmux->have_measured_overhead = TRUE;
+  GST_OBJECT_UNLOCK (splitmux);
+
+  GST_DEBUG_OBJECT (splitmux, "Fragment of %" G_GUINT64_FORMAT " bytes muxed "
+      "to %" G_GUINT64_FORMAT ", overhead %f, estimate now %f",
+      muxed_bytes, written, overhead,
+      splitmux->measured_overhead);
+}
+
 static void
 bus_handler (GstBin * bin, GstMessage * message)
 {
@@ -1238,10 +2579,27 @@ bus_handler (GstBin * bin, GstMessage * message)
       /* If the state is draining out the current file, drop this EOS */
       GST_SPLITMUX_LOCK (splitmux);
 
+      if (note_retired_eos (splitmux, GST_MESSAGE_SRC (message))) {
+        GST_DEBUG_OBJECT (splitmux, "Retired pair drained, dropping EOS");
+        gst_message_unref (message);
+        GST_SPLITMUX_UNLOCK (splitmux);
+        return;
+      }
+
+      /* Fragments still finalised by workers come first, and so does
+       * their fragment-closed. retire_pair () gives up on pairs that
+       * don't drain, so this doesn't block for good */
+      while (splitmux->n_retiring > 0)
+        g_cond_wait (&splitmux->retire_cond, &splitmux->lock);
+
+      write_index_entry (splitmux, finish_index_entry (splitmux),
+          splitmux->sink);
       send_fragment_opened_closed_msg (splitmux, FALSE);
 
       if (splitmux->output_state == SPLITMUX_OUTPUT_STATE_ENDING_FILE) {
         GST_DEBUG_OBJECT (splitmux, "Caught EOS at end of fragment, dropping");
+        update_mux_overhead (splitmux, splitmux->sink,
+            splitmux->muxed_out_bytes);
         splitmux->output_state = SPLITMUX_OUTPUT_STATE_START_NEXT_FILE;
         GST_SPLITMUX_BROADCAST_OUTPUT (splitmux);
 
@@ -1256,6 +2614,12 @@ bus_handler (GstBin * bin, GstMessage * message)
       }
       GST_SPLITMUX_UNLOCK (splitmux);
       break;
+    case GST_MESSAGE_ERROR:
+      /* A retired pair that failed won't drain, don't wait for it */
+      GST_SPLITMUX_LOCK (splitmux);
+      note_retired_eos (splitmux, GST_MESSAGE_SRC (message));
+      GST_SPLITMUX_UNLOCK (splitmux);
+      break;
     case GST_MESSAGE_ASYNC_START:
     case GST_MESSAGE_ASYNC_DONE:
       /* Ignore state changes from our children while switching */
@@ -1354,6 +2718,12 @@ need_new_fragment (GstSplitMuxSink * splitmux,
       splitmux->next_max_tc_time + 5 * GST_USECOND)
     return TRUE;                /* Timecode threshold */
 
+  /* Scheduled split point, the keyframe for it may have come late */
+  if (splitmux->next_split_time != GST_CLOCK_TIME_NONE &&
+      splitmux->reference_ctx->in_running_time >
+      splitmux->next_split_time + SPLIT_TIME_TOLERANCE)
+    return TRUE;
+
   if (check_robust_muxing) {
     GstClockTime mux_reserved_remain;
 
@@ -1393,6 +2763,7 @@ handle_gathered_gop (GstSplitMuxSink * splitmux)
   GstClockTimeDiff queued_gop_time = 0;
   GstClockTimeDiff new_out_ts = splitmux->reference_ctx->in_running_time;
   SplitMuxOutputCommand *cmd;
+  gboolean gop_discont;
 
   /* Assess if the multiqueue contents overflowed the current file */
   /* When considering if a newly gathered GOP overflows
@@ -1414,6 +2785,13 @@ handle_gathered_gop (GstSplitMuxSink * splitmux)
 
   GST_LOG_OBJECT (splitmux, " queued_bytes %" G_GUINT64_FORMAT, queued_bytes);
 
+  histogram_add (&splitmux->gop_bytes, splitmux->gop_total_bytes);
+  if (splitmux->gop_start_time != GST_CLOCK_STIME_NONE &&
+      splitmux->reference_ctx->in_running_time > splitmux->gop_start_time)
+    histogram_add (&splitmux->gop_time,
+        (splitmux->reference_ctx->in_running_time -
+            splitmux->gop_start_time) / GST_USECOND);
+
   g_assert (queued_gop_time >= 0);
   g_assert (queued_time >= splitmux->fragment_start_time);
 
@@ -1421,8 +2799,10 @@ handle_gathered_gop (GstSplitMuxSink * splitmux)
   if (queued_time < queued_gop_time)
     queued_gop_time = queued_time;
 
-  /* Expand queued bytes estimate by muxer overhead */
-  queued_bytes += (queued_bytes * splitmux->mux_overhead);
+  /* Expand queued bytes estimate by muxer overhead, as measured on the
+   * closed fragments once there are some */
+  queued_bytes = queued_bytes * (1.0 + (splitmux->have_measured_overhead ?
+          splitmux->measured_overhead : splitmux->mux_overhead));
 
   GST_LOG_OBJECT (splitmux, "mq at TS %" GST_STIME_FORMAT
       " bytes %" G_GUINT64_FORMAT, GST_STIME_ARGS (queued_time), queued_bytes);
@@ -1433,9 +2813,23 @@ handle_gathered_gop (GstSplitMuxSink * splitmux)
         GST_TIME_ARGS (splitmux->next_max_tc_time + 5 * GST_USECOND));
   }
 
+  /* A discontinuity before the keyframe that ends this GOP is in it. The
+   * GOP then starts a new fragment, so the fragment reporting the
+   * discontinuity is the one that starts there */
+  gop_discont = GST_CLOCK_STIME_IS_VALID (splitmux->discont_time) &&
+      (splitmux->reference_ctx->in_eos ||
+      splitmux->discont_time < splitmux->reference_ctx->in_running_time);
+  if (gop_discont) {
+    GST_INFO_OBJECT (splitmux, "GOP holds a discontinuity at %"
+        GST_STIME_FORMAT, GST_STIME_ARGS (splitmux->discont_time));
+    splitmux->discont_time = GST_CLOCK_STIME_NONE;
+  }
+
   /* Check for overrun - have we output at least one byte and overrun
    * either threshold? */
-  if (need_new_fragment (splitmux, queued_time, queued_gop_time, queued_bytes)) {
+  if ((gop_discont && splitmux->fragment_total_bytes > 0) ||
+      need_new_fragment (splitmux, queued_time, queued_gop_time,
+          queued_bytes)) {
     g_atomic_int_set (&(splitmux->split_now), FALSE);
     /* Tell the output side to start a new fragment */
     GST_INFO_OBJECT (splitmux,
@@ -1449,6 +2843,8 @@ handle_gathered_gop (GstSplitMuxSink * splitmux)
     GST_SPLITMUX_BROADCAST_OUTPUT (splitmux);
 
     new_out_ts = splitmux->reference_ctx->in_running_time;
+    note_fragment_duration (splitmux,
+        splitmux->gop_start_time - splitmux->fragment_start_time);
     splitmux->fragment_start_time = splitmux->gop_start_time;
     splitmux->fragment_total_bytes = 0;
 
@@ -1470,6 +2866,8 @@ handle_gathered_gop (GstSplitMuxSink * splitmux)
     new_out_ts = GST_CLOCK_STIME_NONE;  /* EOS runs until forever */
   }
 
+  resize_queues (splitmux);
+
   /* And wake all input contexts to send a wake-up event */
   g_list_foreach (splitmux->contexts, (GFunc) ctx_set_unblock, NULL);
   GST_SPLITMUX_BROADCAST_INPUT (splitmux);
@@ -1487,6 +2885,7 @@ handle_gathered_gop (GstSplitMuxSink * splitmux)
     cmd = out_cmd_buf_new ();
     cmd->start_new_fragment = FALSE;
     cmd->max_output_ts = new_out_ts;
+    cmd->discont = gop_discont;
     GST_LOG_OBJECT (splitmux, "Sending GOP cmd to output for TS %"
         GST_STIME_FORMAT, GST_STIME_ARGS (new_out_ts));
     g_queue_push_head (&splitmux->out_cmd_q, cmd);
@@ -1586,28 +2985,110 @@ check_completed_gop (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
       (splitmux->max_in_running_time != GST_CLOCK_STIME_NONE)) {
 
     GST_LOG_OBJECT (splitmux, "Sleeping for GOP collection (ctx %p)", ctx);
-    GST_SPLITMUX_WAIT_INPUT (splitmux);
+    GST_SPLITMUX_WAIT_INPUT (splitmux, ctx);
     GST_LOG_OBJECT (splitmux, "Done waiting for complete GOP (ctx %p)", ctx);
   }
 }
 
+/* Account the buffers of @list as one queue item in @buf_info, with the
+ * highest running time of the list in @running_time and the one of its
+ * first buffer in @first_running_time. With @split_keyframes, stop and
+ * return FALSE at a keyframe after the first buffer, the list then has to
+ * be split first */
+static gboolean
+scan_buffer_list (MqStreamCtx * ctx, GstBufferList * list,
+    gboolean split_keyframes, MqStreamBuf * buf_info,
+    GstClockTimeDiff * running_time, GstClockTimeDiff * first_running_time)
+{
+  guint i, len = gst_buffer_list_length (list);
+
+  *running_time = *first_running_time = GST_CLOCK_STIME_NONE;
+  buf_info->duration = GST_CLOCK_TIME_NONE;
+
+  for (i = 0; i < len; i++) {
+    GstBuffer *buf = gst_buffer_list_get (list, i);
+    GstClockTime ts;
+
+    if (i > 0 && split_keyframes
+        && !GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT))
+      return FALSE;
+
+    buf_info->buf_size += gst_buffer_get_size (buf);
+    if (GST_BUFFER_DURATION_IS_VALID (buf)) {
+      if (GST_CLOCK_TIME_IS_VALID (buf_info->duration))
+        buf_info->duration += GST_BUFFER_DURATION (buf);
+      else
+        buf_info->duration = GST_BUFFER_DURATION (buf);
+    }
+
+    ts = GST_BUFFER_PTS_IS_VALID (buf) ?
+        GST_BUFFER_PTS (buf) : GST_BUFFER_DTS (buf);
+    if (GST_CLOCK_TIME_IS_VALID (ts)) {
+      GstClockTimeDiff rtime = my_segment_to_running_time (&ctx->in_segment,
+          ts);
+
+      if (i == 0)
+        *first_running_time = rtime;
+      if (GST_CLOCK_STIME_IS_VALID (rtime) && (!GST_CLOCK_STIME_IS_VALID
+              (*running_time) || rtime > *running_time))
+        *running_time = rtime;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Called from the input probe of @pad, takes @list. Chains it again as
+ * sub-lists that break before every keyframe. The stream lock is
+ * recursive, and each piece passes through the probe on its own.
+ * Returns the flow of the first piece that failed, or GST_FLOW_OK */
+static GstFlowReturn
+chain_buffer_list_pieces (GstPad * pad, GstBufferList * list)
+{
+  GstBufferList *piece = NULL;
+  GstFlowReturn ret = GST_FLOW_OK;
+  guint i, len = gst_buffer_list_length (list);
+
+  for (i = 0; i < len && ret == GST_FLOW_OK; i++) {
+    GstBuffer *buf = gst_buffer_list_get (list, i);
+
+    if (piece && !GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT)) {
+      ret = gst_pad_chain_list (pad, piece);
+      piece = NULL;
+    }
+    if (piece == NULL)
+      piece = gst_buffer_list_new_sized (len - i);
+    gst_buffer_list_add (piece, gst_buffer_ref (buf));
+  }
+
+  if (ret == GST_FLOW_OK)
+    ret = gst_pad_chain_list (pad, piece);
+  else
+    gst_buffer_list_unref (piece);
+
+  if (ret != GST_FLOW_OK)
+    GST_DEBUG_OBJECT (pad, "Dropping rest of buffer list, flow %s",
+        gst_flow_get_name (ret));
+
+  gst_buffer_list_unref (list);
+
+  return ret;
+}
+
 static GstPadProbeReturn
 handle_mq_input (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
 {
   GstSplitMuxSink *splitmux = ctx->splitmux;
   GstBuffer *buf;
-  MqStreamBuf *buf_info = NULL;
-  GstClockTime ts;
+  MqStreamBuf buf_info = { 0, };
+  GstClockTime ts = GST_CLOCK_TIME_NONE;
+  GstClockTimeDiff running_time = GST_CLOCK_STIME_NONE;
+  GstClockTimeDiff list_running_time = GST_CLOCK_STIME_NONE;
   gboolean loop_again;
   gboolean keyframe = FALSE;
 
   GST_LOG_OBJECT (pad, "Fired probe type 0x%x", info->type);
 
-  /* FIXME: Handle buffer lists, until then make it clear they won't work */
-  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
-    g_warning ("Buffer list handling not implemented");
-    return GST_PAD_PROBE_DROP;
-  }
   if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM ||
       info->type & GST_PAD_PROBE_TYPE_EVENT_FLUSH) {
     GstEvent *event = gst_pad_probe_info_get_event (info);
@@ -1618,6 +3099,19 @@ handle_mq_input (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
       case GST_EVENT_SEGMENT:
         gst_event_copy_segment (event, &ctx->in_segment);
         break;
+      case GST_EVENT_CAPS:{
+        GstCaps *caps;
+
+        gst_event_parse_caps (event, &caps);
+        GST_SPLITMUX_LOCK (splitmux);
+        if (ctx->in_caps && !gst_caps_is_equal (ctx->in_caps, caps)) {
+          GST_DEBUG_OBJECT (pad, "caps changed, stream is discontinuous");
+          ctx->in_discont = TRUE;
+        }
+        gst_caps_replace (&ctx->in_caps, caps);
+        GST_SPLITMUX_UNLOCK (splitmux);
+        break;
+      }
       case GST_EVENT_FLUSH_STOP:
         GST_SPLITMUX_LOCK (splitmux);
         gst_segment_init (&ctx->in_segment, GST_FORMAT_UNDEFINED);
@@ -1693,15 +3187,51 @@ handle_mq_input (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
     }
   }
 
-  buf = gst_pad_probe_info_get_buffer (info);
-  buf_info = mq_stream_buf_new ();
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    GstBufferList *list = gst_pad_probe_info_get_buffer_list (info);
+
+    if (gst_buffer_list_length (list) == 0) {
+      return GST_PAD_PROBE_DROP;
+    }
 
-  if (GST_BUFFER_PTS_IS_VALID (buf))
-    ts = GST_BUFFER_PTS (buf);
-  else
-    ts = GST_BUFFER_DTS (buf);
+    /* The reference stream has to stop in front of every keyframe to
+     * collect the GOP, so a list with a keyframe inside is fed again in
+     * pieces that each start with one */
+    if (!scan_buffer_list (ctx, list, ctx->is_reference, &buf_info,
+            &list_running_time, &running_time)) {
+      /* HANDLED alone would report OK upstream */
+      GST_PAD_PROBE_INFO_FLOW_RETURN (info) =
+          chain_buffer_list_pieces (pad, list);
+      return GST_PAD_PROBE_HANDLED;
+    }
+
+    /* The reference stream cuts the GOP at its keyframe, which heads the
+     * list. Other streams account the list at its end, so they don't pass
+     * buffers beyond the cut */
+    if (!ctx->is_reference) {
+      running_time = list_running_time;
+      list_running_time = GST_CLOCK_STIME_NONE;
+    }
+
+    /* The first buffer stands for the list in GOP accounting */
+    buf = gst_buffer_list_get (list, 0);
+    buf_info.n_buffers = gst_buffer_list_length (list);
+    GST_LOG_OBJECT (pad, "Buffer list of %u, running TS is %" GST_STIME_FORMAT,
+        gst_buffer_list_length (list), GST_STIME_ARGS (running_time));
+  } else {
+    buf = gst_pad_probe_info_get_buffer (info);
+
+    if (GST_BUFFER_PTS_IS_VALID (buf))
+      ts = GST_BUFFER_PTS (buf);
+    else
+      ts = GST_BUFFER_DTS (buf);
 
-  GST_LOG_OBJECT (pad, "Buffer TS is %" GST_TIME_FORMAT, GST_TIME_ARGS (ts));
+    GST_LOG_OBJECT (pad, "Buffer TS is %" GST_TIME_FORMAT, GST_TIME_ARGS (ts));
+
+    buf_info.buf_size = gst_buffer_get_size (buf);
+    buf_info.duration = GST_BUFFER_DURATION (buf);
+    buf_info.n_buffers = 1;
+  }
 
   GST_SPLITMUX_LOCK (splitmux);
 
@@ -1711,16 +3241,14 @@ handle_mq_input (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
   /* If this buffer has a timestamp, advance the input timestamp of the
    * stream */
   if (GST_CLOCK_TIME_IS_VALID (ts)) {
-    GstClockTimeDiff running_time =
-        my_segment_to_running_time (&ctx->in_segment, ts);
+    running_time = my_segment_to_running_time (&ctx->in_segment, ts);
 
     GST_LOG_OBJECT (pad, "Buffer running TS is %" GST_STIME_FORMAT,
         GST_STIME_ARGS (running_time));
-
-    if (GST_CLOCK_STIME_IS_VALID (running_time)
-        && running_time > ctx->in_running_time)
-      ctx->in_running_time = running_time;
   }
+  if (GST_CLOCK_STIME_IS_VALID (running_time)
+      && running_time > ctx->in_running_time)
+    ctx->in_running_time = running_time;
 
   /* Try to make sure we have a valid running time */
   if (!GST_CLOCK_STIME_IS_VALID (ctx->in_running_time)) {
@@ -1731,14 +3259,26 @@ handle_mq_input (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
   GST_LOG_OBJECT (pad, "in running time now %" GST_STIME_FORMAT,
       GST_STIME_ARGS (ctx->in_running_time));
 
-  buf_info->run_ts = ctx->in_running_time;
-  buf_info->buf_size = gst_buffer_get_size (buf);
-  buf_info->duration = GST_BUFFER_DURATION (buf);
+  buf_info.run_ts = ctx->in_running_time;
+
+  /* the first buffer of a stream is always DISCONT. The earliest
+   * discontinuity of all streams decides where the next fragment starts,
+   * see handle_gathered_gop () */
+  if (ctx->in_discont || (ctx->in_started &&
+          GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DISCONT))) {
+    GST_DEBUG_OBJECT (pad, "discontinuity at %" GST_STIME_FORMAT,
+        GST_STIME_ARGS (buf_info.run_ts));
+    if (!GST_CLOCK_STIME_IS_VALID (splitmux->discont_time) ||
+        buf_info.run_ts < splitmux->discont_time)
+      splitmux->discont_time = buf_info.run_ts;
+  }
+  ctx->in_started = TRUE;
+  ctx->in_discont = FALSE;
 
   /* initialize fragment_start_time */
   if (ctx->is_reference
       && splitmux->fragment_start_time == GST_CLOCK_STIME_NONE) {
-    splitmux->gop_start_time = splitmux->fragment_start_time = buf_info->run_ts;
+    splitmux->gop_start_time = splitmux->fragment_start_time = buf_info.run_ts;
     GST_LOG_OBJECT (splitmux, "Mux start time now %" GST_STIME_FORMAT,
         GST_STIME_ARGS (splitmux->fragment_start_time));
     gst_buffer_replace (&ctx->prev_in_keyframe, buf);
@@ -1756,7 +3296,7 @@ handle_mq_input (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
 
   GST_DEBUG_OBJECT (pad, "Buf TS %" GST_STIME_FORMAT
       " total GOP bytes %" G_GUINT64_FORMAT,
-      GST_STIME_ARGS (buf_info->run_ts), splitmux->gop_total_bytes);
+      GST_STIME_ARGS (buf_info.run_ts), splitmux->gop_total_bytes);
 
   loop_again = TRUE;
   do {
@@ -1781,6 +3321,7 @@ handle_mq_input (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
               "Have keyframe with running time %" GST_STIME_FORMAT,
               GST_STIME_ARGS (ctx->in_running_time));
           keyframe = TRUE;
+          note_keyframe (splitmux, ctx->in_running_time);
           splitmux->input_state = SPLITMUX_INPUT_STATE_WAITING_GOP_COLLECT;
           splitmux->max_in_running_time = ctx->in_running_time;
           /* Wake up other input pads to collect this GOP */
@@ -1798,7 +3339,7 @@ handle_mq_input (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
 
           /* We're still waiting for a keyframe on the reference pad, sleep */
           GST_LOG_OBJECT (pad, "Sleeping for GOP start");
-          GST_SPLITMUX_WAIT_INPUT (splitmux);
+          GST_SPLITMUX_WAIT_INPUT (splitmux, ctx);
           GST_LOG_OBJECT (pad,
               "Done sleeping for GOP start input state now %d",
               splitmux->input_state);
@@ -1843,14 +3384,29 @@ handle_mq_input (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
 
   if (keyframe) {
     splitmux->queued_keyframes++;
-    buf_info->keyframe = TRUE;
+    buf_info.keyframe = TRUE;
+  }
+
+  /* Only now that the GOP decision was taken at its keyframe, move on to
+   * the end of a reference stream list */
+  if (GST_CLOCK_STIME_IS_VALID (list_running_time)
+      && list_running_time > ctx->in_running_time) {
+    ctx->in_running_time = list_running_time;
+    /* Outside of a GOP collection, the others may catch up to here */
+    if (splitmux->input_state == SPLITMUX_INPUT_STATE_COLLECTING_GOP_START) {
+      splitmux->max_in_running_time = ctx->in_running_time;
+      GST_SPLITMUX_BROADCAST_INPUT (splitmux);
+    }
   }
 
   /* Update total input byte counter for overflow detect */
-  splitmux->gop_total_bytes += buf_info->buf_size;
+  splitmux->gop_total_bytes += buf_info.buf_size;
 
   /* Now add this buffer to the queue just before returning */
-  g_queue_push_head (&ctx->queued_bufs, buf_info);
+  mq_stream_bufs_push (ctx, &buf_info);
+  ctx->queued_buffers += buf_info.n_buffers;
+  ctx->gop_buffers += buf_info.n_buffers;
+  ctx->peak_queued = MAX (ctx->peak_queued, ctx->queued_buffers);
 
   GST_LOG_OBJECT (pad, "Returning to queue buffer %" GST_PTR_FORMAT
       " run ts %" GST_STIME_FORMAT, buf, GST_STIME_ARGS (ctx->in_running_time));
@@ -1860,11 +3416,31 @@ handle_mq_input (GstPad * pad, GstPadProbeInfo * info, MqStreamCtx * ctx)
 
 beach:
   GST_SPLITMUX_UNLOCK (splitmux);
-  if (buf_info)
-    mq_stream_buf_free (buf_info);
   return GST_PAD_PROBE_PASS;
 }
 
+/* Called with lock held */
+static void
+set_queue_limit (MqStreamCtx * ctx, guint limit)
+{
+  if (limit == ctx->q_limit)
+    return;
+
+  GST_DEBUG_OBJECT (ctx->q, "Queue limit %u -> %u buffers (%u queued)",
+      ctx->q_limit, limit, ctx->queued_buffers);
+  ctx->q_limit = limit;
+  g_object_set (ctx->q, "max-size-buffers", limit, NULL);
+}
+
+/* Called with lock held. A buffer list can take the queue past its
+ * limit at once */
+static void
+grow_queue (MqStreamCtx * ctx)
+{
+  ctx->splitmux->queue_growths++;
+  set_queue_limit (ctx, MAX (ctx->q_limit * 2, ctx->queued_buffers + 1));
+}
+
 static void
 grow_blocked_queues (GstSplitMuxSink * splitmux)
 {
@@ -1874,19 +3450,42 @@ grow_blocked_queues (GstSplitMuxSink * splitmux)
   for (cur = g_list_first (splitmux->contexts);
       cur != NULL; cur = g_list_next (cur)) {
     MqStreamCtx *tmpctx = (MqStreamCtx *) (cur->data);
-    guint cur_limit;
-    guint cur_len = g_queue_get_length (&tmpctx->queued_bufs);
-
-    g_object_get (tmpctx->q, "max-size-buffers", &cur_limit, NULL);
-    GST_LOG_OBJECT (tmpctx->q, "Queue len %u", cur_len);
-
-    if (cur_len >= cur_limit) {
-      cur_limit = cur_len + 1;
-      GST_DEBUG_OBJECT (tmpctx->q,
-          "Queue overflowed and needs enlarging. Growing to %u buffers",
-          cur_limit);
-      g_object_set (tmpctx->q, "max-size-buffers", cur_limit, NULL);
+
+    GST_LOG_OBJECT (tmpctx->q, "Queue len %u", tmpctx->queued_buffers);
+
+    if (tmpctx->queued_buffers >= tmpctx->q_limit) {
+      GST_DEBUG_OBJECT (tmpctx->q, "Queue overflowed and needs enlarging");
+      grow_queue (tmpctx);
+    }
+  }
+}
+
+/* Called with lock held when a GOP was gathered. Fit every queue to the
+ * buffers its stream brought in during that GOP */
+static void
+resize_queues (GstSplitMuxSink * splitmux)
+{
+  GList *cur;
+
+  for (cur = splitmux->contexts; cur != NULL; cur = cur->next) {
+    MqStreamCtx *ctx = cur->data;
+    guint target = MAX (2 * ctx->gop_buffers + 1, QUEUE_MIN_BUFFERS);
+
+    if (target > ctx->q_limit) {
+      set_queue_limit (ctx, target);
+      ctx->underused_gops = 0;
+    } else if (ctx->peak_queued < ctx->q_limit / 4) {
+      if (++ctx->underused_gops >= QUEUE_SHRINK_GOPS) {
+        set_queue_limit (ctx, MAX (target, ctx->q_limit / 2));
+        ctx->underused_gops = 0;
+      }
+    } else {
+      ctx->underused_gops = 0;
     }
+
+    histogram_add (&ctx->queue_depth, ctx->peak_queued);
+    ctx->gop_buffers = 0;
+    ctx->peak_queued = ctx->queued_buffers;
   }
 }
 
@@ -1927,25 +3526,17 @@ handle_q_overrun (GstElement * q, gpointer user_data)
     for (cur = g_list_first (splitmux->contexts);
         cur != NULL; cur = g_list_next (cur)) {
       MqStreamCtx *tmpctx = (MqStreamCtx *) (cur->data);
-      if (tmpctx != ctx && g_queue_get_length (&tmpctx->queued_bufs) < 1) {
+      if (tmpctx != ctx && tmpctx->bufs_len < 1) {
         allow_grow = TRUE;
       }
     }
   }
-  GST_SPLITMUX_UNLOCK (splitmux);
 
   if (allow_grow) {
-    guint cur_limit;
-
-    g_object_get (q, "max-size-buffers", &cur_limit, NULL);
-    cur_limit++;
-
-    GST_DEBUG_OBJECT (q,
-        "Queue overflowed and needs enlarging. Growing to %u buffers",
-        cur_limit);
-
-    g_object_set (q, "max-size-buffers", cur_limit, NULL);
+    GST_DEBUG_OBJECT (q, "Queue overflowed and needs enlarging");
+    grow_queue (ctx);
   }
+  GST_SPLITMUX_UNLOCK (splitmux);
 }
 
 static GstPad *
@@ -1960,6 +3551,7 @@ gst_splitmux_sink_request_new_pad (GstElement * element,
   gchar *gname;
   gboolean is_video = FALSE;
   MqStreamCtx *ctx;
+  GstElement *stale_muxer = NULL, *stale_sink = NULL;
 
   GST_DEBUG_OBJECT (element, "templ:%s, name:%s", templ->name_template, name);
 
@@ -2024,7 +3616,7 @@ gst_splitmux_sink_request_new_pad (GstElement * element,
   gst_element_set_state (q, GST_STATE_TARGET (splitmux));
 
   g_object_set (q, "max-size-bytes", 0, "max-size-time", (guint64) (0),
-      "max-size-buffers", 5, NULL);
+      "max-size-buffers", QUEUE_MIN_BUFFERS, NULL);
 
   q_sink = gst_element_get_static_pad (q, "sink");
   q_src = gst_element_get_static_pad (q, "src");
@@ -2040,6 +3632,7 @@ gst_splitmux_sink_request_new_pad (GstElement * element,
   ctx = mq_stream_ctx_new (splitmux);
   /* Context holds a ref: */
   ctx->q = gst_object_ref (q);
+  ctx->q_limit = QUEUE_MIN_BUFFERS;
   ctx->srcpad = q_src;
   ctx->sinkpad = q_sink;
   ctx->q_overrun_id =
@@ -2077,6 +3670,25 @@ gst_splitmux_sink_request_new_pad (GstElement * element,
 
   splitmux->contexts = g_list_prepend (splitmux->contexts, ctx);
 
+  /* A standby pair prepared before this stream has no pad for it and could
+   * never take over. Prepare it again, a pending one still sees the new
+   * context */
+  if (splitmux->standby_muxer != NULL) {
+    GST_DEBUG_OBJECT (splitmux, "Standby pair lacks the new stream, "
+        "preparing it again");
+    g_list_foreach (splitmux->contexts, (GFunc) release_standby_pad, NULL);
+    stale_muxer = splitmux->standby_muxer;
+    stale_sink = splitmux->standby_active_sink;
+    splitmux->standby_muxer = splitmux->standby_active_sink =
+        splitmux->standby_sink = NULL;
+    splitmux->standby_ready = FALSE;
+
+    if (splitmux->use_standby || splitmux->mux_workers > 1) {
+      schedule_standby (splitmux, stale_muxer, stale_sink);
+      stale_muxer = stale_sink = NULL;
+    }
+  }
+
   g_free (gname);
 
   if (is_video)
@@ -2087,6 +3699,8 @@ gst_splitmux_sink_request_new_pad (GstElement * element,
 
   GST_SPLITMUX_UNLOCK (splitmux);
 
+  drop_standby_pair (splitmux, stale_muxer, stale_sink);
+
   return res;
 fail:
   GST_SPLITMUX_UNLOCK (splitmux);
@@ -2118,9 +3732,13 @@ gst_splitmux_sink_release_pad (GstElement * element, GstPad * pad)
   GST_INFO_OBJECT (pad, "releasing request pad");
 
   muxpad = gst_pad_get_peer (ctx->srcpad);
+  release_standby_pad (ctx);
 
   /* Remove the context from our consideration */
   splitmux->contexts = g_list_remove (splitmux->contexts, ctx);
+  /* wake_input/output () don't see it anymore */
+  g_cond_signal (&ctx->in_cond);
+  g_cond_signal (&ctx->out_cond);
 
   if (ctx->sink_pad_block_id)
     gst_pad_remove_probe (ctx->sinkpad, ctx->sink_pad_block_id);
@@ -2128,8 +3746,6 @@ gst_splitmux_sink_release_pad (GstElement * element, GstPad * pad)
   if (ctx->src_pad_block_id)
     gst_pad_remove_probe (ctx->srcpad, ctx->src_pad_block_id);
 
-  /* Can release the context now */
-  mq_stream_ctx_unref (ctx);
   if (ctx == splitmux->reference_ctx)
     splitmux->reference_ctx = NULL;
 
@@ -2139,6 +3755,9 @@ gst_splitmux_sink_release_pad (GstElement * element, GstPad * pad)
     gst_object_unref (muxpad);
   }
 
+  /* Can release the context now, this may free it */
+  mq_stream_ctx_unref (ctx);
+
   if (GST_PAD_PAD_TEMPLATE (pad) &&
       g_str_equal (GST_PAD_TEMPLATE_NAME_TEMPLATE (GST_PAD_PAD_TEMPLATE
               (pad)), "video"))
@@ -2264,18 +3883,78 @@ find_sink (GstElement * e)
   return res;
 }
 
+static void
+disable_async (GstElement * sink)
+{
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (sink), "async"))
+    g_object_set (sink, "async", FALSE, NULL);
+}
+
+static gboolean
+has_location (GstElement * sink)
+{
+  return g_object_class_find_property (G_OBJECT_GET_CLASS (sink),
+      "location") != NULL;
+}
+
+/* Build a bin that feeds all of @sinks from one tee. The bin only posts
+ * EOS once each of them did, which is what closes the fragment. Returns
+ * the bin, or NULL if a sink is still in use elsewhere */
+static GstElement *
+create_fanout (GstSplitMuxSink * splitmux, GPtrArray * sinks)
+{
+  GstElement *bin, *tee;
+  GstPad *pad;
+  guint i;
+
+  bin = gst_object_ref_sink (gst_bin_new ("fanout"));
+  tee = gst_element_factory_make ("tee", NULL);
+  if (tee == NULL || !gst_bin_add (GST_BIN (bin), tee))
+    goto fail;
+
+  for (i = 0; i < sinks->len; i++) {
+    GstElement *sink = g_ptr_array_index (sinks, i);
+
+    if (!gst_bin_add (GST_BIN (bin), sink) || !gst_element_link (tee, sink)) {
+      g_warning ("Could not add sink %s to the fan-out", GST_OBJECT_NAME (sink));
+      goto fail;
+    }
+  }
+
+  pad = gst_element_get_static_pad (tee, "sink");
+  gst_element_add_pad (bin, gst_ghost_pad_new ("sink", pad));
+  gst_object_unref (pad);
+
+  return bin;
+
+fail:
+  gst_object_unref (bin);
+  return NULL;
+}
+
 static gboolean
 create_sink (GstSplitMuxSink * splitmux)
 {
   GstElement *provided_sink = NULL;
+  GPtrArray *sinks = NULL;
 
   if (splitmux->active_sink == NULL) {
 
     GST_OBJECT_LOCK (splitmux);
-    if (splitmux->provided_sink != NULL)
+    if (splitmux->provided_sinks->len > 0)
+      sinks = g_ptr_array_ref (splitmux->provided_sinks);
+    else if (splitmux->provided_sink != NULL)
       provided_sink = gst_object_ref (splitmux->provided_sink);
     GST_OBJECT_UNLOCK (splitmux);
 
+    if (sinks) {
+      provided_sink = create_fanout (splitmux, sinks);
+      if (provided_sink == NULL) {
+        g_ptr_array_unref (sinks);
+        goto fail;
+      }
+    }
+
     if (provided_sink == NULL) {
       if ((splitmux->sink =
               create_element (splitmux, DEFAULT_SINK, "sink", TRUE)) == NULL)
@@ -2297,8 +3976,31 @@ create_sink (GstSplitMuxSink * splitmux)
       /* The bin holds a ref now, we can drop our tmp ref */
       gst_object_unref (provided_sink);
 
-      /* Find the sink element */
-      splitmux->sink = find_sink (splitmux->active_sink);
+      /* Find the sink element. A sink with a location comes first, it
+       * names the fragment in the fragment-opened/closed messages */
+      if (sinks) {
+        guint i;
+
+        for (i = 0; i < sinks->len; i++) {
+          GstElement *sink = find_sink (g_ptr_array_index (sinks, i));
+
+          if (sink == NULL)
+            continue;
+          if (splitmux->sink == NULL || (has_location (sink)
+                  && !has_location (splitmux->sink))) {
+            if (splitmux->sink)
+              splitmux->fanout_sinks = g_list_append (splitmux->fanout_sinks,
+                  splitmux->sink);
+            splitmux->sink = sink;
+          } else {
+            splitmux->fanout_sinks = g_list_append (splitmux->fanout_sinks,
+                sink);
+          }
+        }
+        g_ptr_array_unref (sinks);
+      } else {
+        splitmux->sink = find_sink (splitmux->active_sink);
+      }
       if (splitmux->sink == NULL) {
         g_warning
             ("Could not locate sink element in provided sink - splitmuxsink will not work");
@@ -2313,6 +4015,7 @@ create_sink (GstSplitMuxSink * splitmux)
        * failures, so let's try and turn that off */
       g_object_set (splitmux->sink, "async", FALSE, NULL);
     }
+    g_list_foreach (splitmux->fanout_sinks, (GFunc) disable_async, NULL);
 #endif
 
     if (!gst_element_link (splitmux->muxer, splitmux->active_sink)) {
@@ -2326,12 +4029,78 @@ fail:
   return FALSE;
 }
 
+/* Runs from gst_element_call_async. Removes a recycled fragment that
+ * recycle_file () moved out of the way, so the file system frees its
+ * blocks off the streaming thread */
+static void
+unlink_recycled_file (GstElement * element, gchar * path)
+{
+  GstSplitMuxSink *splitmux = GST_SPLITMUX_SINK (element);
+
+  if (g_unlink (path) < 0 && errno != ENOENT)
+    GST_WARNING_OBJECT (splitmux, "Could not remove %s: %s", path,
+        g_strerror (errno));
+  else
+    GST_DEBUG_OBJECT (splitmux, "Removed recycled %s", path);
+}
+
+/* Called with lock held when @fname was set for the current fragment_id.
+ * If the max_files ring wrapped onto the file of an earlier fragment, that
+ * file is renamed out of the way and removed in the background instead of
+ * being truncated by the sink on the switch. Files a pair still
+ * finalises are left to the sink like before */
+static void
+recycle_file (GstSplitMuxSink * splitmux, const gchar * fname)
+{
+  GPtrArray *slots = splitmux->slot_locations;
+  const gchar *prev;
+  gchar *old_path;
+  GList *cur;
+
+  if (splitmux->max_files < 2)
+    return;
+
+  if (slots->len <= splitmux->fragment_id)
+    g_ptr_array_set_size (slots, splitmux->fragment_id + 1);
+  prev = g_ptr_array_index (slots, splitmux->fragment_id);
+
+  if (prev != NULL && strcmp (prev, fname) == 0) {
+    for (cur = splitmux->retiring; cur; cur = cur->next) {
+      SplitMuxPair *pair = cur->data;
+      gchar *location = NULL;
+      gboolean busy;
+
+      g_object_get (pair->active_sink, "location", &location, NULL);
+      busy = g_strcmp0 (location, fname) == 0;
+      g_free (location);
+      if (busy)
+        goto done;
+    }
+
+    old_path = g_strdup_printf ("%s.recycled", fname);
+    if (g_rename (fname, old_path) == 0) {
+      gst_element_call_async (GST_ELEMENT_CAST (splitmux),
+          (GstElementCallAsyncFunc) unlink_recycled_file, old_path, g_free);
+    } else {
+      if (errno != ENOENT)
+        GST_WARNING_OBJECT (splitmux, "Could not move %s out of the way: %s",
+            fname, g_strerror (errno));
+      g_free (old_path);
+    }
+  }
+
+done:
+  g_free (g_ptr_array_index (slots, splitmux->fragment_id));
+  g_ptr_array_index (slots, splitmux->fragment_id) = g_strdup (fname);
+}
+
 #ifdef __GNUC__
 #pragma GCC diagnostic ignored "-Wformat-nonliteral"
 #endif
 static void
 set_next_filename (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
 {
+  GList *cur;
   gchar *fname = NULL;
   GstSample *sample;
   GstCaps *caps;
@@ -2361,8 +4130,15 @@ set_next_filename (GstSplitMuxSink * splitmux, MqStreamCtx * ctx)
         g_strdup_printf (splitmux->location, splitmux->fragment_id) : NULL;
 
   if (fname) {
+    recycle_file (splitmux, fname);
+
     GST_INFO_OBJECT (splitmux, "Setting file to %s", fname);
     g_object_set (splitmux->sink, "location", fname, NULL);
+    for (cur = splitmux->fanout_sinks; cur; cur = cur->next) {
+      if (has_location (cur->data))
+        g_object_set (cur->data, "location", fname, NULL);
+    }
+
     g_free (fname);
 
     splitmux->fragment_id++;
@@ -2406,6 +4182,14 @@ do_async_done (GstSplitMuxSink * splitmux)
   splitmux->need_async_start = FALSE;
 }
 
+static void
+reset_context_discont (MqStreamCtx * ctx)
+{
+  gst_caps_replace (&ctx->in_caps, NULL);
+  ctx->in_started = FALSE;
+  ctx->in_discont = FALSE;
+}
+
 static GstStateChangeReturn
 gst_splitmux_sink_change_state (GstElement * element, GstStateChange transition)
 {
@@ -2434,6 +4218,26 @@ gst_splitmux_sink_change_state (GstElement * element, GstStateChange transition)
           GST_CLOCK_STIME_NONE;
       splitmux->muxed_out_bytes = 0;
       splitmux->ready_for_output = FALSE;
+      splitmux->fragment_discont = FALSE;
+      splitmux->discont_time = GST_CLOCK_STIME_NONE;
+      splitmux->next_split_time = GST_CLOCK_TIME_NONE;
+      splitmux->last_keyframe_target = GST_CLOCK_TIME_NONE;
+      splitmux->keyframe_latency = 0;
+      g_array_set_size (splitmux->keyframe_targets, 0);
+      splitmux->index_count = 0;
+      g_ptr_array_set_size (splitmux->index_entries, 0);
+      memset (&splitmux->switch_time, 0, sizeof (SplitMuxHistogram));
+      memset (&splitmux->gop_bytes, 0, sizeof (SplitMuxHistogram));
+      memset (&splitmux->gop_time, 0, sizeof (SplitMuxHistogram));
+      splitmux->queue_growths = 0;
+      g_list_foreach (splitmux->contexts, (GFunc) reset_context_stats, NULL);
+      GST_OBJECT_LOCK (splitmux);
+      splitmux->measured_overhead = 0.0;
+      splitmux->have_measured_overhead = FALSE;
+      splitmux->n_durations = 0;
+      splitmux->duration_mean = splitmux->duration_m2 = 0.0;
+      GST_OBJECT_UNLOCK (splitmux);
+      g_list_foreach (splitmux->contexts, (GFunc) reset_context_discont, NULL);
       GST_SPLITMUX_UNLOCK (splitmux);
       break;
     }
@@ -2443,11 +4247,13 @@ gst_splitmux_sink_change_state (GstElement * element, GstStateChange transition)
       GST_SPLITMUX_LOCK (splitmux);
       splitmux->output_state = SPLITMUX_OUTPUT_STATE_STOPPED;
       splitmux->input_state = SPLITMUX_INPUT_STATE_STOPPED;
-      /* Wake up any blocked threads */
+      /* Wake up any blocked threads, including retired pairs still
+       * waiting to drain */
       GST_LOG_OBJECT (splitmux,
           "State change -> NULL or READY. Waking threads");
       GST_SPLITMUX_BROADCAST_INPUT (splitmux);
       GST_SPLITMUX_BROADCAST_OUTPUT (splitmux);
+      g_cond_broadcast (&splitmux->retire_cond);
       GST_SPLITMUX_UNLOCK (splitmux);
       break;
     default:
@@ -2475,9 +4281,19 @@ gst_splitmux_sink_change_state (GstElement * element, GstStateChange transition)
       ret = GST_STATE_CHANGE_ASYNC;
       break;
     }
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      /* Retired pairs are locked and keep going, let them finish their
+       * fragments before the elements can be reset */
+      GST_SPLITMUX_LOCK (splitmux);
+      while (splitmux->n_retiring > 0)
+        g_cond_wait (&splitmux->retire_cond, &splitmux->lock);
+      GST_SPLITMUX_UNLOCK (splitmux);
+      break;
     case GST_STATE_CHANGE_READY_TO_NULL:
       GST_SPLITMUX_LOCK (splitmux);
       splitmux->fragment_id = 0;
+      /* the next run may write elsewhere, don't remove its files */
+      g_ptr_array_set_size (splitmux->slot_locations, 0);
       /* Reset internal elements only if no pad contexts are using them */
       if (splitmux->contexts == NULL)
         gst_splitmux_reset (splitmux);
@@ -23,6 +23,8 @@
 #include <gst/gst.h>
 #include <gst/pbutils/pbutils.h>
 
+#include "gstsplitutils.h"
+
 G_BEGIN_DECLS
 #define GST_TYPE_SPLITMUX_SINK               (gst_splitmux_sink_get_type())
 #define GST_SPLITMUX_SINK(obj)               (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_SPLITMUX_SINK,GstSplitMuxSink))
@@ -56,14 +58,26 @@ typedef struct _SplitMuxOutputCommand
 {
   gboolean start_new_fragment;  /* Whether to start a new fragment before advancing output ts */
   GstClockTimeDiff max_output_ts;       /* Set the limit to stop GOP output */
+  gboolean discont;             /* GOP holds a discontinuity, the fragment it starts reports it */
 } SplitMuxOutputCommand;
 
+#define SPLITMUX_HISTOGRAM_BUCKETS 40
+
+typedef struct _SplitMuxHistogram//log2 histogram for the stats property
+{
+  guint64 count;
+  guint64 sum;
+  guint64 max;
+  guint64 buckets[SPLITMUX_HISTOGRAM_BUCKETS];  //[i] counts values in [2^(i-1), 2^i), [0] counts 0
+} SplitMuxHistogram;
+
 typedef struct _MqStreamBuf//info of GstBuffer streaming into _GstSplitMuxSink.queue
 {
   gboolean keyframe;         //if keyframe
   GstClockTimeDiff run_ts;   //_MqStreamCtx.in_running_time
   guint64 buf_size;          // buffer size
   GstClockTime duration;     // buffer duration
+  guint n_buffers;           // buffers, more than 1 for a buffer list
 } MqStreamBuf;
 
 typedef struct _MqStreamCtx
@@ -93,13 +107,44 @@ typedef struct _MqStreamCtx
   GstBuffer *prev_in_keyframe; /* store keyframe for each GOP */
 
   GstElement *q;    //_GstSplitMuxSink.queue
-  GQueue queued_bufs;  //_MqStreamBuf, record GstBuffer info _GstSplitMuxSink.queue.sinkpad probes and lets through
+  MqStreamBuf *bufs;   //ring of _MqStreamBuf, record GstBuffer info _GstSplitMuxSink.queue.sinkpad probes and lets through
+  guint bufs_size;     //capacity of bufs, doubled when full
+  guint bufs_head;     //index of the oldest entry in bufs
+  guint bufs_len;      //entries in bufs
 
   GstPad *sinkpad;  //_GstSplitMuxSink.queue.sinkpad
   GstPad *srcpad;   //_GstSplitMuxSink.queue.srcpad
 
   GstBuffer *cur_out_buffer;  //pointer to current buffer streaming outof _GstSplitMuxSink.queue and into _GstSplitMuxSink.muxer
   GstEvent *pending_gap;  
+
+  GstCaps *in_caps;       //last caps streaming into _GstSplitMuxSink.queue, to detect caps changes
+  gboolean in_started;    //a buffer streamed into _GstSplitMuxSink.queue since start, its DISCONT flag is expected
+  gboolean in_discont;    //caps changed, the next buffer is a discontinuity
+
+  GstPad *standby_pad;    //request pad of _GstSplitMuxSink.standby_muxer, linked to srcpad on fragment switch
+
+  //per-context wakeups, with _GstSplitMuxSink.lock
+  GCond in_cond;                        //signalled when the sleeping input thread may continue
+  GCond out_cond;                       //signalled when the sleeping output thread may continue
+  gboolean in_waiting;                  //input thread sleeps on in_cond
+  gboolean out_waiting;                 //output thread sleeps on out_cond
+  SplitMuxInputState in_wait_state;     //_GstSplitMuxSink.input_state when the input thread went to sleep
+  SplitMuxOutputState out_wait_state;   //_GstSplitMuxSink.output_state when the output thread went to sleep
+  GstClockTimeDiff out_wait_max;        //_GstSplitMuxSink.max_out_running_time when the output thread went to sleep
+  gboolean out_wait_ready;              //_GstSplitMuxSink.ready_for_output when the output thread went to sleep
+
+  //queue sizing, with _GstSplitMuxSink.lock
+  guint q_limit;          //max-size-buffers of _GstSplitMuxSink.queue
+  guint queued_buffers;   //buffers between the queue.sinkpad and queue.srcpad probes
+  guint peak_queued;      //highest queued_buffers during the current GOP
+  guint gop_buffers;      //buffers streamed into the queue during the current GOP
+  guint underused_gops;   //successive GOPs with peak_queued under a quarter of q_limit
+
+  //stats, with _GstSplitMuxSink.lock
+  gint64 out_block_start;         //monotonic time (us) the output thread first slept for the current item, 0 if it didn't
+  SplitMuxHistogram out_blocked;  //us an item waited in complete_or_wait_on_out
+  SplitMuxHistogram queue_depth;  //peak_queued per GOP
 } MqStreamCtx;
 
 //[1] properties
@@ -108,12 +153,12 @@ struct _GstSplitMuxSink
 {
   GstBin parent;
   //[begin] for multiple streams synchronization
-  GMutex lock;            //singleton lock for all pads input
-  GCond input_cond;       //conditional variable for all pads input
-  GCond output_cond;
+  GMutex lock;            //singleton lock for GOP and output state, threads sleep on _MqStreamCtx.in_cond/out_cond
   //[end] for multiple streams synchronization
 
-  gdouble mux_overhead;    //[1] to calculate queue_bytes
+  gdouble mux_overhead;    //[1] to calculate queue_bytes until measured_overhead is known
+  gdouble measured_overhead;        //[1] weighted average of written/muxed_out_bytes - 1 over closed fragments
+  gboolean have_measured_overhead;  //a fragment was closed and measured
 
   GstClockTime threshold_time;    //[1]
   guint64 threshold_bytes;    //[1]
@@ -121,6 +166,17 @@ struct _GstSplitMuxSink
   gboolean send_keyframe_requests;    //[1]
   gchar *threshold_timecode_str;    //[1]
   GstClockTime next_max_tc_time;    //fragment_start_time + time_diff_calculated_according_to_[threshold_timecode_str]
+
+  //keyframe scheduling on the threshold_time grid, with send_keyframe_requests
+  GstClockTime next_split_time;       //grid point ending the current fragment, NONE if not scheduling
+  GstClockTime last_keyframe_target;  //last grid point requested upstream
+  GArray *keyframe_targets;           //GstClockTime running times sent upstream, keyframe not seen yet, ascending
+  GstClockTime keyframe_latency;      //weighted average of how late keyframes came after the requested running time
+
+  //fragment duration statistics, Welford's method
+  guint64 n_durations;
+  gdouble duration_mean;              //seconds
+  gdouble duration_m2;                //sum of squared differences from the mean
   GstClockTime alignment_threshold;    //[1]
 
   GstElement *muxer;    //[2] pointer to muxer added to splitmuxsink, not increasing reference-count
@@ -129,13 +185,18 @@ struct _GstSplitMuxSink
   GstElement *provided_muxer;   //[1]
 
   GstElement *provided_sink;    //[1]
+  GPtrArray *provided_sinks;    //[1] sinks fanned out from one tee, overriding provided_sink
   GstElement *active_sink;      //[2] pointer to sink bin
+  GList *fanout_sinks;          //[2] sink elements of provided_sinks other than sink, the ones with a location get it too
 
   gboolean ready_for_output;
 
   gchar *location;    //[1]
   guint fragment_id;  //fragment sequence number
 
+  //max_files ring recycling, files about to be reused are removed off the streaming thread
+  GPtrArray *slot_locations;  //location last written for each fragment_id, with max_files
+
   GList *contexts;    //q.MqStreamCtx
 
   SplitMuxInputState input_state;        //q.sinkpad state variable
@@ -165,6 +226,8 @@ struct _GstSplitMuxSink
   guint queued_keyframes;
 
   gboolean switching_fragment;  //indicates switching fragment now
+  gboolean fragment_discont;    //current fragment starts at a DISCONT buffer or caps change, reported by fragment-closed
+  GstClockTimeDiff discont_time; //earliest input discontinuity not placed in a GOP yet, GST_CLOCK_STIME_NONE if none
 
   gboolean have_video;    //video pad requested only once
 
@@ -175,6 +238,38 @@ struct _GstSplitMuxSink
   gboolean muxer_has_reserved_props; //muxer has properties "reserved-max-duration" and "reserved-duration-remaining"
 
   gboolean split_now;
+
+  //pre-warmed muxer/sink pair swapped in at fragment boundaries
+  gboolean use_standby;             //[1]
+  GstElement *standby_muxer;        //clone of muxer in READY, outside the bin and owned by us, NULL if none
+  GstElement *standby_active_sink;  //clone of active_sink in READY, linked to standby_muxer
+  GstElement *standby_sink;         //standby_active_sink or its internal-sink element
+  gboolean standby_ready;           //standby pair can be swapped in
+  gboolean standby_pending;         //standby pair being prepared by gst_element_call_async
+
+  //retired pairs finalising their fragment while the next one is muxed
+  guint mux_workers;        //[1]
+  gboolean async_close;     //the ending fragment gets its EOS from retire_pair () after the switch
+  GList *retiring;          //SplitMuxPair still in the bin, closing their fragment
+  guint n_retiring;         //length of retiring
+  guint retire_seq;         //sequence number for the next retired pair
+  guint closed_seq;         //sequence number of the retired pair that posts fragment-closed next
+  GCond retire_cond;        //a retired pair drained, posted fragment-closed or left the bin
+
+  //stats property, with lock
+  SplitMuxHistogram switch_time;  //us spent in start_next_fragment
+  SplitMuxHistogram gop_bytes;    //bytes of each gathered GOP
+  SplitMuxHistogram gop_time;     //us of reference running time of each gathered GOP
+  guint64 queue_growths;          //queues grown on overrun or starvation
+
+  //fragment index sidecar, see gst_split_util_index_append ()
+  gchar *index_location;                //[1]
+  GstSplitMuxIndexEntry *index_entry;   //fragment being muxed, NULL without index_location
+  guint index_count;                    //fragments written to the index since READY_TO_PAUSED
+  GPtrArray *index_entries;             //GstSplitMuxIndexEntry of the files kept with max_files, in index order
+  guint64 index_seq;                    //index rewrites handed to write_index_async ()
+  GMutex index_lock;                    //serialises write_index_async (), protects index_written_seq
+  guint64 index_written_seq;            //newest index rewrite on disk
 };
 
 struct _GstSplitMuxSinkClass
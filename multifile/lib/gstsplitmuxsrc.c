@@ -47,6 +47,7 @@
 #endif
 
 #include <string.h>
+#include <glib/gstdio.h>
 #include "gstsplitmuxsrc.h"
 #include "gstsplitutils.h"
 
@@ -58,9 +59,24 @@ GST_DEBUG_CATEGORY (splitmux_debug);
 enum
 {
   PROP_0,
-  PROP_LOCATION
+  PROP_LOCATION,
+  PROP_INDEX_LOCATION,
+  PROP_WRITE_INDEX,
+  PROP_LAZY_PREPARE,
+  PROP_LOOKAHEAD,
+  PROP_PREPARE_WORKERS,
+  PROP_MAX_OPEN_PARTS,
+  PROP_PREROLL_NEXT_PART
 };
 
+#define DEFAULT_WRITE_INDEX FALSE
+#define DEFAULT_LAZY_PREPARE FALSE
+#define DEFAULT_LOOKAHEAD 1
+#define DEFAULT_PREPARE_WORKERS 1
+#define MAX_PREPARE_WORKERS 64
+#define DEFAULT_MAX_OPEN_PARTS 0
+#define DEFAULT_PREROLL_NEXT_PART FALSE
+
 enum
 {
   SIGNAL_FORMAT_LOCATION,
@@ -221,6 +237,54 @@ gst_splitmux_src_class_init (GstSplitMuxSrcClass * klass)
           "Glob pattern for the location of the files to read", NULL,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_INDEX_LOCATION,
+      g_param_spec_string ("index-location", "Index location",
+          "Fragment index written by splitmuxsink to take the duration of "
+          "parts that haven't been measured yet and the keyframes to snap "
+          "key unit seeks to from (NULL = estimate from the file size)",
+          NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_WRITE_INDEX,
+      g_param_spec_boolean ("write-index", "Write index",
+          "Write the offsets of the measured parts to index-location on "
+          "stop if it could not be loaded on start or misses parts, for the "
+          "next start to use", DEFAULT_WRITE_INDEX,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_LAZY_PREPARE,
+      g_param_spec_boolean ("lazy-prepare", "Lazy prepare",
+          "Only prepare the first part on start and the following ones "
+          "while playing, instead of measuring every part up front. The "
+          "total duration is an estimate until all parts have been played",
+          DEFAULT_LAZY_PREPARE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_LOOKAHEAD,
+      g_param_spec_uint ("lookahead", "Lookahead",
+          "Number of parts after the current one to prepare in the "
+          "background while playing", 0, G_MAXUINT, DEFAULT_LOOKAHEAD,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PREPARE_WORKERS,
+      g_param_spec_uint ("prepare-workers", "Prepare workers",
+          "Number of parts to measure concurrently on start when not "
+          "lazy-prepare (0 = one per CPU)", 0, MAX_PREPARE_WORKERS,
+          DEFAULT_PREPARE_WORKERS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_OPEN_PARTS,
+      g_param_spec_uint ("max-open-parts", "Max open parts",
+          "Maximum number of prepared parts to keep open. The least recently "
+          "used ones are closed down to their measured offsets and reopened "
+          "when needed again. Parts being played and the lookahead parts are "
+          "always kept open (0 = keep all open)", 0, G_MAXUINT,
+          DEFAULT_MAX_OPEN_PARTS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PREROLL_NEXT_PART,
+      g_param_spec_boolean ("preroll-next-part", "Pre-roll next part",
+          "Start the part after the current one as soon as it is prepared, "
+          "so its first buffers are queued by the time playback reaches it "
+          "(forward playback only)", DEFAULT_PREROLL_NEXT_PART,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   /**
    * GstSplitMuxSrc::format-location:
    * @splitmux: the #GstSplitMuxSrc
@@ -241,6 +305,14 @@ gst_splitmux_src_init (GstSplitMuxSrc * splitmux)
 {
   g_mutex_init (&splitmux->lock);
   g_mutex_init (&splitmux->pads_lock);
+  g_cond_init (&splitmux->prepare_cond);
+  splitmux->write_index = DEFAULT_WRITE_INDEX;
+  splitmux->lazy_prepare = DEFAULT_LAZY_PREPARE;
+  splitmux->lookahead = DEFAULT_LOOKAHEAD;
+  splitmux->prepare_workers = DEFAULT_PREPARE_WORKERS;
+  splitmux->max_open_parts = DEFAULT_MAX_OPEN_PARTS;
+  splitmux->preroll_next_part = DEFAULT_PREROLL_NEXT_PART;
+  g_queue_init (&splitmux->open_parts);
   splitmux->total_duration = GST_CLOCK_TIME_NONE;
   gst_segment_init (&splitmux->play_segment, GST_FORMAT_TIME);
 }
@@ -272,7 +344,10 @@ gst_splitmux_src_finalize (GObject * object)
   GstSplitMuxSrc *splitmux = GST_SPLITMUX_SRC (object);
   g_mutex_clear (&splitmux->lock);
   g_mutex_clear (&splitmux->pads_lock);
+  g_cond_clear (&splitmux->prepare_cond);
   g_free (splitmux->location);
+  g_free (splitmux->index_location);
+  g_free (splitmux->index_to_write);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -291,6 +366,42 @@ gst_splitmux_src_set_property (GObject * object, guint prop_id,
       GST_OBJECT_UNLOCK (splitmux);
       break;
     }
+    case PROP_INDEX_LOCATION:
+      GST_OBJECT_LOCK (splitmux);
+      g_free (splitmux->index_location);
+      splitmux->index_location = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_WRITE_INDEX:
+      GST_OBJECT_LOCK (splitmux);
+      splitmux->write_index = g_value_get_boolean (value);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_LAZY_PREPARE:
+      GST_OBJECT_LOCK (splitmux);
+      splitmux->lazy_prepare = g_value_get_boolean (value);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_LOOKAHEAD:
+      GST_OBJECT_LOCK (splitmux);
+      splitmux->lookahead = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_PREPARE_WORKERS:
+      GST_OBJECT_LOCK (splitmux);
+      splitmux->prepare_workers = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_MAX_OPEN_PARTS:
+      GST_OBJECT_LOCK (splitmux);
+      splitmux->max_open_parts = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_PREROLL_NEXT_PART:
+      GST_OBJECT_LOCK (splitmux);
+      splitmux->preroll_next_part = g_value_get_boolean (value);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -309,6 +420,41 @@ gst_splitmux_src_get_property (GObject * object, guint prop_id,
       g_value_set_string (value, splitmux->location);
       GST_OBJECT_UNLOCK (splitmux);
       break;
+    case PROP_INDEX_LOCATION:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_string (value, splitmux->index_location);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_WRITE_INDEX:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_boolean (value, splitmux->write_index);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_LAZY_PREPARE:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_boolean (value, splitmux->lazy_prepare);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_LOOKAHEAD:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_uint (value, splitmux->lookahead);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_PREPARE_WORKERS:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_uint (value, splitmux->prepare_workers);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_MAX_OPEN_PARTS:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_uint (value, splitmux->max_open_parts);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
+    case PROP_PREROLL_NEXT_PART:
+      GST_OBJECT_LOCK (splitmux);
+      g_value_set_boolean (value, splitmux->preroll_next_part);
+      GST_OBJECT_UNLOCK (splitmux);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -450,6 +596,8 @@ gst_splitmux_handle_event (GstSplitMuxSrc * splitmux,
       if (splitmux->play_segment.rate > 0.0) {
         if (splitmux->play_segment.stop != -1)
           seg.stop = splitmux->play_segment.stop;
+        else if (splitmux->n_measured < splitmux->num_parts)
+          seg.stop = -1;        /* The end of the last part isn't known yet */
         else
           seg.stop = splitpad->segment.stop;
       } else {
@@ -516,6 +664,12 @@ gst_splitmux_handle_buffer (GstSplitMuxSrc * splitmux,
     GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DISCONT);
     splitpad->set_next_discont = FALSE;
   }
+  if (GST_CLOCK_TIME_IS_VALID (splitpad->switch_start)) {
+    GST_INFO_OBJECT (splitpad, "First buffer of part %u %" GST_TIME_FORMAT
+        " after the end of the previous part", splitpad->cur_part,
+        GST_TIME_ARGS (gst_util_get_timestamp () - splitpad->switch_start));
+    splitpad->switch_start = GST_CLOCK_TIME_NONE;
+  }
 
   ret = gst_pad_push (GST_PAD_CAST (splitpad), buf);
 
@@ -614,16 +768,714 @@ flushing:
   return;
 }
 
+/* Called with the lock held. Places the parts that haven't been measured
+ * yet after their predecessor, estimating the duration of those the
+ * fragment index doesn't know from the bitrate of the measured parts.
+ * Returns TRUE if the total duration changed */
+static gboolean
+gst_splitmux_src_update_offsets_locked (GstSplitMuxSrc * splitmux)
+{
+  GstClockTime offset = 0, total_duration = 0;
+  gboolean changed;
+  guint i;
+
+  for (i = 0; i < splitmux->num_parts; i++) {
+    SplitMuxPartInfo *info = &splitmux->part_info[i];
+
+    if (!info->measured && !info->preparing) {
+      if (!info->indexed && splitmux->measured_bytes > 0)
+        info->duration = gst_util_uint64_scale (info->size,
+            splitmux->measured_time, splitmux->measured_bytes);
+      info->start_offset = offset;
+      info->end_offset = offset + info->duration;
+    }
+    total_duration = info->start_offset + info->duration;
+    offset = info->end_offset;
+  }
+
+  splitmux->play_segment.duration = total_duration;
+
+  GST_OBJECT_LOCK (splitmux);
+  changed = splitmux->total_duration != total_duration;
+  splitmux->total_duration = total_duration;
+  GST_OBJECT_UNLOCK (splitmux);
+
+  return changed;
+}
+
+/* Take the duration and keyframes of the parts from the fragment index
+ * written by splitmuxsink, matching the fragments by file name. Returns
+ * FALSE if the index can't be loaded or misses some of the parts */
+static gboolean
+gst_splitmux_src_load_index (GstSplitMuxSrc * splitmux, const gchar * path)
+{
+  GHashTable *fragments;
+  GPtrArray *entries;
+  GError *err = NULL;
+  guint i, j, n_indexed = 0;
+
+  entries = gst_split_util_index_load (path, &err);
+  if (entries == NULL) {
+    GST_WARNING_OBJECT (splitmux, "Could not load index: %s", err->message);
+    g_error_free (err);
+    return FALSE;
+  }
+
+  /* A recycled file name appears more than once, the last entry wins */
+  fragments = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (i = 0; i < entries->len; i++) {
+    GstSplitMuxIndexEntry *entry = g_ptr_array_index (entries, i);
+
+    if (entry->location == NULL || !GST_CLOCK_TIME_IS_VALID (entry->start)
+        || !GST_CLOCK_TIME_IS_VALID (entry->end) || entry->end < entry->start)
+      continue;
+    g_hash_table_insert (fragments, g_path_get_basename (entry->location),
+        entry);
+  }
+
+  for (i = 0; i < splitmux->num_parts; i++) {
+    SplitMuxPartInfo *info = &splitmux->part_info[i];
+    gchar *name = g_path_get_basename (info->path);
+    GstSplitMuxIndexEntry *entry = g_hash_table_lookup (fragments, name);
+
+    if (entry != NULL) {
+      info->duration = entry->end - entry->start;
+      info->indexed = TRUE;
+      n_indexed++;
+
+      /* Keyframes are indexed by running time, make them relative to the
+       * part like the timestamps its demuxer produces */
+      if (entry->keyframes != NULL && entry->keyframes->len > 0) {
+        info->keyframes = g_array_sized_new (FALSE, FALSE,
+            sizeof (GstSplitMuxIndexKeyframe), entry->keyframes->len);
+        for (j = 0; j < entry->keyframes->len; j++) {
+          GstSplitMuxIndexKeyframe kf = g_array_index (entry->keyframes,
+              GstSplitMuxIndexKeyframe, j);
+
+          if (!GST_CLOCK_TIME_IS_VALID (kf.time) || kf.time < entry->start)
+            continue;
+          kf.time -= entry->start;
+          g_array_append_val (info->keyframes, kf);
+        }
+      }
+    }
+    g_free (name);
+  }
+
+  GST_INFO_OBJECT (splitmux, "Index %s has the duration of %u of %u parts",
+      path, n_indexed, splitmux->num_parts);
+
+  g_hash_table_unref (fragments);
+  g_ptr_array_unref (entries);
+
+  return n_indexed == splitmux->num_parts;
+}
+
+/* Called with the lock held. Writes the parts that are indexed or have
+ * been measured to the index at @path, in the format splitmuxsink writes
+ * it. Keyframes are only known for the parts that were indexed already */
+static void
+gst_splitmux_src_write_index_locked (GstSplitMuxSrc * splitmux,
+    const gchar * path)
+{
+  GPtrArray *entries;
+  GError *err = NULL;
+  guint i, j;
+
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gst_split_util_index_entry_free);
+
+  for (i = 0; i < splitmux->num_parts; i++) {
+    SplitMuxPartInfo *info = &splitmux->part_info[i];
+    GstSplitMuxIndexEntry *entry;
+
+    if (!info->measured && !info->indexed)
+      continue;
+
+    entry = gst_split_util_index_entry_new ();
+    entry->location = g_strdup (info->path);
+    entry->start = info->start_offset;
+    entry->end = info->start_offset + info->duration;
+    entry->size = info->size;
+
+    /* back to running time, as splitmuxsink writes them */
+    if (info->keyframes != NULL) {
+      for (j = 0; j < info->keyframes->len; j++) {
+        GstSplitMuxIndexKeyframe kf = g_array_index (info->keyframes,
+            GstSplitMuxIndexKeyframe, j);
+
+        kf.time += entry->start;
+        g_array_append_val (entry->keyframes, kf);
+      }
+    }
+    g_ptr_array_add (entries, entry);
+  }
+
+  if (entries->len == 0) {
+    g_ptr_array_unref (entries);
+    return;
+  }
+
+  if (gst_split_util_index_write (path, entries, &err)) {
+    GST_INFO_OBJECT (splitmux, "Wrote %u of %u parts to index %s",
+        entries->len, splitmux->num_parts, path);
+  } else {
+    GST_WARNING_OBJECT (splitmux, "Could not write index %s: %s", path,
+        err->message);
+    g_error_free (err);
+  }
+  g_ptr_array_unref (entries);
+}
+
+/* Called with the lock held. Moves @position to a keyframe of part @idx
+ * from the index, honouring the snap @flags of a key unit seek. Returns
+ * FALSE if the index has no suitable keyframe */
+static gboolean
+gst_splitmux_src_snap_to_keyframe_locked (GstSplitMuxSrc * splitmux,
+    guint idx, GstSeekFlags flags, GstClockTime * position)
+{
+  SplitMuxPartInfo *info = &splitmux->part_info[idx];
+  GstSplitMuxIndexKeyframe *kf;
+  GstClockTime pos, before = GST_CLOCK_TIME_NONE, after = GST_CLOCK_TIME_NONE;
+  GstClockTime snapped;
+  guint lo, hi;
+
+  if (info->keyframes == NULL || info->keyframes->len == 0 ||
+      *position < info->start_offset)
+    return FALSE;
+
+  /* Find the first keyframe after the position */
+  kf = (GstSplitMuxIndexKeyframe *) info->keyframes->data;
+  pos = *position - info->start_offset;
+  lo = 0;
+  hi = info->keyframes->len;
+  while (lo < hi) {
+    guint mid = lo + (hi - lo) / 2;
+
+    if (kf[mid].time <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo > 0)
+    before = kf[lo - 1].time;
+  if (before == pos)
+    after = pos;
+  else if (lo < info->keyframes->len)
+    after = kf[lo].time;
+
+  if ((flags & GST_SEEK_FLAG_SNAP_NEAREST) == GST_SEEK_FLAG_SNAP_NEAREST) {
+    if (!GST_CLOCK_TIME_IS_VALID (before))
+      snapped = after;
+    else if (!GST_CLOCK_TIME_IS_VALID (after))
+      snapped = before;
+    else
+      snapped = (pos - before <= after - pos) ? before : after;
+  } else if (flags & GST_SEEK_FLAG_SNAP_AFTER) {
+    snapped = after;
+  } else {
+    snapped = before;
+  }
+
+  if (!GST_CLOCK_TIME_IS_VALID (snapped))
+    return FALSE;
+
+  GST_DEBUG_OBJECT (splitmux, "Snapped seek to %" GST_TIME_FORMAT
+      " to indexed keyframe at %" GST_TIME_FORMAT " in part %u",
+      GST_TIME_ARGS (*position),
+      GST_TIME_ARGS (info->start_offset + snapped), idx);
+
+  *position = info->start_offset + snapped;
+  return TRUE;
+}
+
+static void
+gst_splitmux_src_warn_part_failed (GstSplitMuxSrc * splitmux,
+    const gchar * path)
+{
+  GST_WARNING_OBJECT (splitmux,
+      "Failed to prepare file part %s. Cannot play past there.", path);
+  GST_ELEMENT_WARNING (splitmux, RESOURCE, READ, (NULL),
+      ("Failed to prepare file part %s. Cannot play past there.", path));
+}
+
+/* Creates and prepares the reader for the part at @path, placed at
+ * @start_offset. Returns NULL if the part can't be prepared */
+static GstSplitMuxPartReader *
+gst_splitmux_src_create_prepared_part (GstSplitMuxSrc * splitmux,
+    const gchar * path, GstClockTime start_offset)
+{
+  GstSplitMuxPartReader *reader;
+
+  GST_DEBUG_OBJECT (splitmux, "Preparing part %s at offset %"
+      GST_TIME_FORMAT, path, GST_TIME_ARGS (start_offset));
+
+  reader = gst_splitmux_part_create (splitmux, (gchar *) path);
+  gst_splitmux_part_reader_set_start_offset (reader, start_offset);
+  if (!gst_splitmux_part_reader_prepare (reader)) {
+    gst_splitmux_part_reader_unprepare (reader);
+    g_object_unref (reader);
+    return NULL;
+  }
+
+  return reader;
+}
+
+static guint
+gst_splitmux_src_get_lookahead (GstSplitMuxSrc * splitmux)
+{
+  guint lookahead;
+
+  GST_OBJECT_LOCK (splitmux);
+  lookahead = splitmux->lookahead;
+  GST_OBJECT_UNLOCK (splitmux);
+
+  return lookahead;
+}
+
+/* Called with the lock held. Takes the offsets and duration of part @idx
+ * as measured */
+static void
+gst_splitmux_src_set_measured_locked (GstSplitMuxSrc * splitmux, guint idx,
+    GstClockTime start_offset, GstClockTime end_offset, GstClockTime duration)
+{
+  SplitMuxPartInfo *info = &splitmux->part_info[idx];
+
+  if (!GST_CLOCK_TIME_IS_VALID (duration))
+    duration = 0;
+  if (!GST_CLOCK_TIME_IS_VALID (end_offset) || end_offset < start_offset)
+    end_offset = start_offset + duration;
+
+  info->start_offset = start_offset;
+  info->end_offset = end_offset;
+  info->duration = duration;
+  if (!info->measured) {
+    info->measured = TRUE;
+    splitmux->n_measured++;
+    splitmux->measured_bytes += info->size;
+    splitmux->measured_time += end_offset - start_offset;
+  }
+}
+
+/* Called with the lock held. Installs the prepared @reader as part @idx,
+ * as the most recently used open part */
+static void
+gst_splitmux_src_set_part_locked (GstSplitMuxSrc * splitmux, guint idx,
+    GstSplitMuxPartReader * reader)
+{
+  gst_splitmux_src_set_measured_locked (splitmux, idx,
+      gst_splitmux_part_reader_get_start_offset (reader),
+      gst_splitmux_part_reader_get_end_offset (reader),
+      gst_splitmux_part_reader_get_duration (reader));
+
+  splitmux->parts[idx] = reader;
+  g_queue_push_tail (&splitmux->open_parts, GUINT_TO_POINTER (idx));
+}
+
+/* Called with the lock held. The current part, the ones prepared ahead of
+ * it and any part a pad is still reading from must stay open */
+static gboolean
+gst_splitmux_src_part_in_use_locked (GstSplitMuxSrc * splitmux, guint idx)
+{
+  gint step = splitmux->play_segment.rate < 0.0 ? -1 : 1;
+  gint ahead = ((gint) idx - (gint) splitmux->cur_part) * step;
+  gboolean in_use = FALSE;
+  GList *cur;
+
+  if (ahead >= 0 && (guint) ahead <= gst_splitmux_src_get_lookahead (splitmux))
+    return TRUE;
+  if (gst_splitmux_part_reader_is_active (splitmux->parts[idx]))
+    return TRUE;
+
+  SPLITMUX_SRC_PADS_LOCK (splitmux);
+  for (cur = g_list_first (splitmux->pads);
+      cur != NULL; cur = g_list_next (cur)) {
+    SplitMuxSrcPad *splitpad = (SplitMuxSrcPad *) (cur->data);
+    if (splitpad->cur_part == idx) {
+      in_use = TRUE;
+      break;
+    }
+  }
+  SPLITMUX_SRC_PADS_UNLOCK (splitmux);
+
+  return in_use;
+}
+
+/* Called with the lock held, which is released while closing readers.
+ * Closes the least recently used parts that aren't in use until no more
+ * than max-open-parts are open. Closed parts keep their measured offsets
+ * and are prepared again when needed. Only runs from
+ * gst_splitmux_src_prepare_ahead (), closing readers on a streaming
+ * thread would stall it */
+static void
+gst_splitmux_src_trim_parts_locked (GstSplitMuxSrc * splitmux)
+{
+  GList *closed = NULL, *cur, *next;
+  guint max_open;
+
+  GST_OBJECT_LOCK (splitmux);
+  max_open = splitmux->max_open_parts;
+  GST_OBJECT_UNLOCK (splitmux);
+
+  if (max_open == 0)
+    return;
+
+  for (cur = splitmux->open_parts.head;
+      cur != NULL && splitmux->open_parts.length > max_open; cur = next) {
+    guint idx = GPOINTER_TO_UINT (cur->data);
+
+    next = cur->next;
+    if (gst_splitmux_src_part_in_use_locked (splitmux, idx))
+      continue;
+
+    GST_DEBUG_OBJECT (splitmux, "Closing least recently used part %u", idx);
+    closed = g_list_prepend (closed, splitmux->parts[idx]);
+    splitmux->parts[idx] = NULL;
+    g_queue_delete_link (&splitmux->open_parts, cur);
+  }
+
+  if (closed == NULL)
+    return;
+
+  SPLITMUX_SRC_UNLOCK (splitmux);
+  for (cur = closed; cur != NULL; cur = g_list_next (cur)) {
+    gst_splitmux_part_reader_unprepare (cur->data);
+    g_object_unref (cur->data);
+  }
+  g_list_free (closed);
+  SPLITMUX_SRC_LOCK (splitmux);
+}
+
+/* Called with the lock held, which is released while the part is being
+ * prepared. Creates and prepares the reader of part @idx, right after the
+ * previous part if that one has been measured. A part that fails to
+ * prepare ends the playable range */
+static gboolean
+gst_splitmux_src_prepare_part_locked (GstSplitMuxSrc * splitmux, guint idx)
+{
+  SplitMuxPartInfo *info = &splitmux->part_info[idx];
+  GstSplitMuxPartReader *reader;
+  gboolean duration_changed;
+
+  /* A part that was closed again goes back where it was measured */
+  if (!info->measured && idx > 0 && splitmux->part_info[idx - 1].measured)
+    info->start_offset = splitmux->part_info[idx - 1].end_offset;
+  info->preparing = TRUE;
+  splitmux->n_preparing++;
+  SPLITMUX_SRC_UNLOCK (splitmux);
+
+  reader = gst_splitmux_src_create_prepared_part (splitmux, info->path,
+      info->start_offset);
+
+  SPLITMUX_SRC_LOCK (splitmux);
+  info->preparing = FALSE;
+  g_cond_broadcast (&splitmux->prepare_cond);
+
+  if (reader != NULL && (!splitmux->running || idx >= splitmux->num_parts)) {
+    /* Stopped or cut short by a failing part while we were busy */
+    SPLITMUX_SRC_UNLOCK (splitmux);
+    gst_splitmux_part_reader_unprepare (reader);
+    g_object_unref (reader);
+    reader = NULL;
+    goto done;
+  }
+
+  if (reader != NULL) {
+    gst_splitmux_src_set_part_locked (splitmux, idx, reader);
+  } else if (idx < splitmux->num_parts) {
+    splitmux->num_parts = idx;
+  }
+
+  duration_changed = gst_splitmux_src_update_offsets_locked (splitmux);
+  SPLITMUX_SRC_UNLOCK (splitmux);
+
+  if (reader == NULL && splitmux->running)
+    gst_splitmux_src_warn_part_failed (splitmux, info->path);
+  if (duration_changed)
+    gst_element_post_message (GST_ELEMENT_CAST (splitmux),
+        gst_message_new_duration_changed (GST_OBJECT_CAST (splitmux)));
+
+done:
+  /* stop() waits for this before freeing the part info */
+  SPLITMUX_SRC_LOCK (splitmux);
+  splitmux->n_preparing--;
+  g_cond_broadcast (&splitmux->prepare_cond);
+  return reader != NULL;
+}
+
+typedef struct
+{
+  gboolean prepared;
+  GstSplitMuxPartReader *reader; /* NULL if closed right after measuring */
+  GstClockTime end_offset;
+  GstClockTime duration;
+} SplitMuxPrepareResult;
+
+typedef struct
+{
+  GstSplitMuxSrc *splitmux;
+  SplitMuxPrepareResult *results;
+  gboolean keep_open;
+} SplitMuxPrepareJobs;
+
+static void
+gst_splitmux_src_prepare_worker (gpointer data, SplitMuxPrepareJobs * jobs)
+{
+  guint idx = GPOINTER_TO_UINT (data) - 1;
+  SplitMuxPrepareResult *result = &jobs->results[idx];
+  GstSplitMuxPartReader *reader;
+
+  reader = gst_splitmux_src_create_prepared_part (jobs->splitmux,
+      jobs->splitmux->part_info[idx].path, 0);
+  if (reader == NULL)
+    return;
+
+  result->prepared = TRUE;
+  result->end_offset = gst_splitmux_part_reader_get_end_offset (reader);
+  result->duration = gst_splitmux_part_reader_get_duration (reader);
+
+  if (jobs->keep_open) {
+    result->reader = reader;
+  } else {
+    gst_splitmux_part_reader_unprepare (reader);
+    g_object_unref (reader);
+  }
+}
+
+/* Called with the lock held, which is released while preparing. Prepares
+ * all parts after the first one on up to @n_workers threads, each at
+ * offset 0, and then places them one after another in order. With a limit
+ * on open parts, only their measurements are kept */
+static void
+gst_splitmux_src_prepare_parallel_locked (GstSplitMuxSrc * splitmux,
+    guint n_workers)
+{
+  SplitMuxPrepareJobs jobs;
+  GThreadPool *pool;
+  GError *err = NULL;
+  GstClockTime total_duration;
+  gboolean duration_changed;
+  guint i, n_parts, failed;
+  GList *cur;
+
+  n_parts = failed = splitmux->num_parts;
+  jobs.splitmux = splitmux;
+  jobs.results = g_new0 (SplitMuxPrepareResult, n_parts);
+  GST_OBJECT_LOCK (splitmux);
+  jobs.keep_open = splitmux->max_open_parts == 0;
+  GST_OBJECT_UNLOCK (splitmux);
+  SPLITMUX_SRC_UNLOCK (splitmux);
+
+  GST_DEBUG_OBJECT (splitmux, "Preparing %u parts on %u threads",
+      n_parts - 1, n_workers);
+
+  pool = g_thread_pool_new ((GFunc) gst_splitmux_src_prepare_worker, &jobs,
+      n_workers, FALSE, &err);
+  for (i = 1; i < n_parts; i++) {
+    if (pool != NULL)
+      g_thread_pool_push (pool, GUINT_TO_POINTER (i + 1), NULL);
+    else
+      gst_splitmux_src_prepare_worker (GUINT_TO_POINTER (i + 1), &jobs);
+  }
+  if (pool != NULL) {
+    g_thread_pool_free (pool, FALSE, TRUE);
+  } else {
+    GST_WARNING_OBJECT (splitmux, "Prepared parts serially, could not "
+        "create thread pool: %s", err->message);
+    g_error_free (err);
+  }
+
+  SPLITMUX_SRC_LOCK (splitmux);
+  for (i = 1; i < n_parts; i++) {
+    SplitMuxPrepareResult *result = &jobs.results[i];
+    GstClockTime start_offset = splitmux->part_info[i - 1].end_offset;
+
+    if (!result->prepared) {
+      failed = i;
+      break;
+    }
+    if (result->reader != NULL) {
+      gst_splitmux_part_reader_set_start_offset (result->reader,
+          start_offset);
+      gst_splitmux_src_set_part_locked (splitmux, i, result->reader);
+    } else {
+      gst_splitmux_src_set_measured_locked (splitmux, i, start_offset,
+          GST_CLOCK_TIME_IS_VALID (result->end_offset) ?
+          start_offset + result->end_offset : GST_CLOCK_TIME_NONE,
+          result->duration);
+    }
+  }
+  splitmux->num_parts = failed;
+  duration_changed = gst_splitmux_src_update_offsets_locked (splitmux);
+  total_duration = splitmux->play_segment.duration;
+  SPLITMUX_SRC_UNLOCK (splitmux);
+
+  /* Nothing past a failed part is played */
+  for (i = failed + 1; i < n_parts; i++) {
+    if (jobs.results[i].reader == NULL)
+      continue;
+    gst_splitmux_part_reader_unprepare (jobs.results[i].reader);
+    g_object_unref (jobs.results[i].reader);
+  }
+  g_free (jobs.results);
+  if (failed < n_parts)
+    gst_splitmux_src_warn_part_failed (splitmux,
+        splitmux->part_info[failed].path);
+
+  /* Measured at offset 0, the other parts couldn't extend the segment
+   * stop the output pads took from the first part */
+  SPLITMUX_SRC_PADS_LOCK (splitmux);
+  for (cur = g_list_first (splitmux->pads);
+      cur != NULL; cur = g_list_next (cur)) {
+    SplitMuxSrcPad *splitpad = (SplitMuxSrcPad *) (cur->data);
+
+    if (splitpad->segment.stop != -1 && splitpad->segment.stop < total_duration)
+      splitpad->segment.stop = total_duration;
+  }
+  SPLITMUX_SRC_PADS_UNLOCK (splitmux);
+
+  if (duration_changed)
+    gst_element_post_message (GST_ELEMENT_CAST (splitmux),
+        gst_message_new_duration_changed (GST_OBJECT_CAST (splitmux)));
+
+  SPLITMUX_SRC_LOCK (splitmux);
+}
+
+/* Called with the lock held, which may be released while the part is
+ * being prepared. Returns the reader of part @idx, or NULL if it can't
+ * be prepared */
+static GstSplitMuxPartReader *
+gst_splitmux_src_get_part_locked (GstSplitMuxSrc * splitmux, guint idx)
+{
+  while (idx < splitmux->num_parts && splitmux->part_info[idx].preparing)
+    g_cond_wait (&splitmux->prepare_cond, &splitmux->lock);
+
+  if (!splitmux->running || idx >= splitmux->num_parts)
+    return NULL;
+
+  if (splitmux->parts[idx] == NULL)
+    gst_splitmux_src_prepare_part_locked (splitmux, idx);
+  else if (g_queue_remove (&splitmux->open_parts, GUINT_TO_POINTER (idx)))
+    g_queue_push_tail (&splitmux->open_parts, GUINT_TO_POINTER (idx));
+
+  return idx < splitmux->num_parts ? splitmux->parts[idx] : NULL;
+}
+
+/* Called with the lock held. Returns the next part within the lookahead
+ * window in playback direction that needs a reader, or -1 */
+static gint
+gst_splitmux_src_next_to_prepare_locked (GstSplitMuxSrc * splitmux)
+{
+  gint step = splitmux->play_segment.rate < 0.0 ? -1 : 1;
+  guint lookahead = gst_splitmux_src_get_lookahead (splitmux);
+  guint i;
+
+  for (i = 1; i <= lookahead; i++) {
+    gint idx = (gint) splitmux->cur_part + step * (gint) i;
+
+    if (idx < 0 || idx >= (gint) splitmux->num_parts)
+      break;
+    if (splitmux->parts[idx] == NULL && !splitmux->part_info[idx].preparing)
+      return idx;
+  }
+
+  return -1;
+}
+
+/* Called with the lock held. Starts the part after the current one, so
+ * its first buffers are already queued when playback reaches it and the
+ * pads can switch over to it without waiting */
+static void
+gst_splitmux_src_preroll_next_locked (GstSplitMuxSrc * splitmux)
+{
+  GstSplitMuxPartReader *reader;
+  guint next = splitmux->cur_part + 1;
+  gboolean preroll;
+
+  GST_OBJECT_LOCK (splitmux);
+  preroll = splitmux->preroll_next_part;
+  GST_OBJECT_UNLOCK (splitmux);
+
+  /* Reverse playback switches parts with a discont anyway */
+  if (!preroll || !splitmux->running || splitmux->play_segment.rate < 0.0
+      || next >= splitmux->num_parts)
+    return;
+
+  reader = splitmux->parts[next];
+  if (reader == NULL || gst_splitmux_part_reader_is_active (reader))
+    return;
+  if (splitmux->play_segment.stop != -1 &&
+      splitmux->part_info[next].start_offset >= splitmux->play_segment.stop)
+    return;
+
+  GST_DEBUG_OBJECT (splitmux, "Pre-rolling part %u", next);
+  if (!gst_splitmux_part_reader_activate (reader, &splitmux->play_segment,
+          GST_SEEK_FLAG_NONE))
+    GST_WARNING_OBJECT (splitmux, "Failed to pre-roll part %u", next);
+}
+
+/* Runs from gst_element_call_async. Prepares the parts ahead of the
+ * current one one after another, so each starts where the previous ends,
+ * and closes parts that were left behind */
+static void
+gst_splitmux_src_prepare_ahead (GstSplitMuxSrc * splitmux, gpointer user_data)
+{
+  gint idx;
+
+  SPLITMUX_SRC_LOCK (splitmux);
+  while (splitmux->running &&
+      (idx = gst_splitmux_src_next_to_prepare_locked (splitmux)) >= 0) {
+    gst_splitmux_src_prepare_part_locked (splitmux, idx);
+    gst_splitmux_src_preroll_next_locked (splitmux);
+    if (splitmux->running)
+      gst_splitmux_src_trim_parts_locked (splitmux);
+  }
+  if (splitmux->running)
+    gst_splitmux_src_trim_parts_locked (splitmux);
+
+  splitmux->preparing_ahead = FALSE;
+  g_cond_broadcast (&splitmux->prepare_cond);
+  SPLITMUX_SRC_UNLOCK (splitmux);
+}
+
+/* Called with the lock held */
+static void
+gst_splitmux_src_schedule_prepare_ahead_locked (GstSplitMuxSrc * splitmux)
+{
+  guint max_open;
+
+  if (splitmux->preparing_ahead || !splitmux->running)
+    return;
+
+  GST_OBJECT_LOCK (splitmux);
+  max_open = splitmux->max_open_parts;
+  GST_OBJECT_UNLOCK (splitmux);
+
+  if (gst_splitmux_src_next_to_prepare_locked (splitmux) < 0 &&
+      (max_open == 0 || splitmux->open_parts.length <= max_open))
+    return;
+
+  splitmux->preparing_ahead = TRUE;
+  gst_element_call_async (GST_ELEMENT_CAST (splitmux),
+      (GstElementCallAsyncFunc) gst_splitmux_src_prepare_ahead, NULL, NULL);
+}
+
+/* Called with the lock held */
 static gboolean
 gst_splitmux_src_activate_part (GstSplitMuxSrc * splitmux, guint part,
     GstSeekFlags extra_flags)
 {
+  GstSplitMuxPartReader *reader;
   GList *cur;
 
   GST_DEBUG_OBJECT (splitmux, "Activating part %d", part);
 
+  reader = gst_splitmux_src_get_part_locked (splitmux, part);
+  if (reader == NULL)
+    return FALSE;
+
   splitmux->cur_part = part;
-  if (!gst_splitmux_part_reader_activate (splitmux->parts[part],
+  if (!gst_splitmux_part_reader_activate (reader,
           &splitmux->play_segment, extra_flags))
     return FALSE;
 
@@ -648,6 +1500,9 @@ gst_splitmux_src_activate_part (GstSplitMuxSrc * splitmux, guint part,
   }
   SPLITMUX_SRC_PADS_UNLOCK (splitmux);
 
+  gst_splitmux_src_preroll_next_locked (splitmux);
+  gst_splitmux_src_schedule_prepare_ahead_locked (splitmux);
+
   return TRUE;
 }
 
@@ -658,10 +1513,10 @@ gst_splitmux_src_start (GstSplitMuxSrc * splitmux)
   GError *err = NULL;
   gchar *basename = NULL;
   gchar *dirname = NULL;
+  gchar *index_location;
   gchar **files;
-  GstClockTime next_offset = 0;
-  guint i;
-  GstClockTime total_duration = 0;
+  gboolean lazy_prepare, write_index;
+  guint i, n_workers;
 
   GST_DEBUG_OBJECT (splitmux, "Starting");
 
@@ -682,59 +1537,69 @@ gst_splitmux_src_start (GstSplitMuxSrc * splitmux)
       goto no_files;
   }
 
+  GST_OBJECT_LOCK (splitmux);
+  index_location = g_strdup (splitmux->index_location);
+  write_index = splitmux->write_index;
+  lazy_prepare = splitmux->lazy_prepare;
+  n_workers = splitmux->prepare_workers;
+  GST_OBJECT_UNLOCK (splitmux);
+
+  if (n_workers == 0)
+    n_workers = MIN (g_get_num_processors (), MAX_PREPARE_WORKERS);
+
   SPLITMUX_SRC_LOCK (splitmux);
   splitmux->pads_complete = FALSE;
   splitmux->running = TRUE;
-  SPLITMUX_SRC_UNLOCK (splitmux);
 
-  splitmux->num_parts = g_strv_length (files);
+  splitmux->num_files = splitmux->num_parts = g_strv_length (files);
+  splitmux->cur_part = 0;
 
   splitmux->parts = g_new0 (GstSplitMuxPartReader *, splitmux->num_parts);
+  splitmux->part_info = g_new0 (SplitMuxPartInfo, splitmux->num_parts);
 
   for (i = 0; i < splitmux->num_parts; i++) {
-    splitmux->parts[i] = gst_splitmux_part_create (splitmux, files[i]);
-    if (splitmux->parts[i] == NULL)
-      break;
+    SplitMuxPartInfo *info = &splitmux->part_info[i];
+    GStatBuf st;
 
-    /* Figure out the next offset - the smallest one */
-    gst_splitmux_part_reader_set_start_offset (splitmux->parts[i], next_offset);
-    if (!gst_splitmux_part_reader_prepare (splitmux->parts[i])) {
-      GST_WARNING_OBJECT (splitmux,
-          "Failed to prepare file part %s. Cannot play past there.", files[i]);
-      GST_ELEMENT_WARNING (splitmux, RESOURCE, READ, (NULL),
-          ("Failed to prepare file part %s. Cannot play past there.",
-              files[i]));
-      gst_splitmux_part_reader_unprepare (splitmux->parts[i]);
-      g_object_unref (splitmux->parts[i]);
-      splitmux->parts[i] = NULL;
-      break;
-    }
-
-    /* Extend our total duration to cover this part */
-    total_duration =
-        next_offset +
-        gst_splitmux_part_reader_get_duration (splitmux->parts[i]);
-    splitmux->play_segment.duration = total_duration;
-
-    next_offset = gst_splitmux_part_reader_get_end_offset (splitmux->parts[i]);
+    info->path = g_strdup (files[i]);
+    if (g_stat (files[i], &st) == 0)
+      info->size = st.st_size;
   }
 
-  /* Update total_duration state variable */
-  GST_OBJECT_LOCK (splitmux);
-  splitmux->total_duration = total_duration;
-  GST_OBJECT_UNLOCK (splitmux);
-
-  /* Store how many parts we actually created */
-  splitmux->num_parts = i;
+  /* An index that doesn't exist yet or misses parts is written on stop if
+   * asked to */
+  if (index_location != NULL &&
+      !gst_splitmux_src_load_index (splitmux, index_location) && write_index)
+    splitmux->index_to_write = index_location;
+  else
+    g_free (index_location);
+
+  /* Measure the first part, which creates the output pads, and unless
+   * lazy all the others. The offsets of parts that aren't measured are
+   * estimated from what we know so far */
+  if (gst_splitmux_src_prepare_part_locked (splitmux, 0) && !lazy_prepare) {
+    if (n_workers > 1 && splitmux->num_parts > 2) {
+      gst_splitmux_src_prepare_parallel_locked (splitmux, n_workers);
+    } else {
+      for (i = 1; i < splitmux->num_parts; i++) {
+        if (!gst_splitmux_src_prepare_part_locked (splitmux, i))
+          break;
+      }
+    }
+  }
 
-  if (splitmux->num_parts < 1)
+  if (splitmux->num_parts < 1) {
+    SPLITMUX_SRC_UNLOCK (splitmux);
     goto failed_part;
+  }
 
   /* All done preparing, activate the first part */
   GST_INFO_OBJECT (splitmux,
-      "All parts prepared. Total duration %" GST_TIME_FORMAT
-      " Activating first part", GST_TIME_ARGS (total_duration));
+      "%u of %u parts prepared. Total duration %" GST_TIME_FORMAT
+      " Activating first part", splitmux->n_measured, splitmux->num_parts,
+      GST_TIME_ARGS (splitmux->play_segment.duration));
   ret = gst_splitmux_src_activate_part (splitmux, 0, GST_SEEK_FLAG_NONE);
+  SPLITMUX_SRC_UNLOCK (splitmux);
   if (ret == FALSE)
     goto failed_first_part;
 done:
@@ -781,8 +1646,13 @@ gst_splitmux_src_stop (GstSplitMuxSrc * splitmux)
 
   GST_DEBUG_OBJECT (splitmux, "Stopping");
 
+  /* Let parts that are being prepared in the background finish */
+  splitmux->running = FALSE;
+  while (splitmux->n_preparing > 0 || splitmux->preparing_ahead)
+    g_cond_wait (&splitmux->prepare_cond, &splitmux->lock);
+
   /* Stop and destroy all parts  */
-  for (i = 0; i < splitmux->num_parts; i++) {
+  for (i = 0; i < splitmux->num_files; i++) {
     if (splitmux->parts[i] == NULL)
       continue;
     gst_splitmux_part_reader_unprepare (splitmux->parts[i]);
@@ -804,9 +1674,26 @@ gst_splitmux_src_stop (GstSplitMuxSrc * splitmux)
   g_list_free (pads_list);
   SPLITMUX_SRC_LOCK (splitmux);
 
+  if (splitmux->index_to_write != NULL)
+    gst_splitmux_src_write_index_locked (splitmux, splitmux->index_to_write);
+  g_free (splitmux->index_to_write);
+  splitmux->index_to_write = NULL;
+
+  for (i = 0; i < splitmux->num_files; i++) {
+    g_free (splitmux->part_info[i].path);
+    if (splitmux->part_info[i].keyframes != NULL)
+      g_array_unref (splitmux->part_info[i].keyframes);
+  }
+  g_free (splitmux->part_info);
+  splitmux->part_info = NULL;
+  g_queue_clear (&splitmux->open_parts);
   g_free (splitmux->parts);
   splitmux->parts = NULL;
+  splitmux->num_files = 0;
   splitmux->num_parts = 0;
+  splitmux->n_measured = 0;
+  splitmux->measured_bytes = 0;
+  splitmux->measured_time = 0;
   splitmux->running = FALSE;
   splitmux->total_duration = GST_CLOCK_TIME_NONE;
   /* Reset playback segment */
@@ -955,6 +1842,7 @@ gst_splitmux_push_flush_stop (GstSplitMuxSrc * splitmux, guint32 seqnum)
     target->sent_caps = FALSE;
     target->sent_stream_start = FALSE;
     target->sent_segment = FALSE;
+    target->switch_start = GST_CLOCK_TIME_NONE;
   }
   SPLITMUX_SRC_PADS_UNLOCK (splitmux);
 
@@ -1016,10 +1904,21 @@ gst_splitmux_end_of_part (GstSplitMuxSrc * splitmux, SplitMuxSrcPad * splitpad)
   }
 
   if (next_part != -1) {
+    GstSplitMuxPartReader *reader;
+
     GST_DEBUG_OBJECT (splitmux, "At EOS on pad %" GST_PTR_FORMAT
         " moving to part %d", splitpad, next_part);
+    /* Normally prepared ahead already, otherwise this stalls the pad */
+    reader = gst_splitmux_src_get_part_locked (splitmux, next_part);
+    if (reader == NULL) {
+      GST_DEBUG_OBJECT (splitmux, "Part %d can't be played. Finishing",
+          next_part);
+      SPLITMUX_SRC_UNLOCK (splitmux);
+      return FALSE;
+    }
     splitpad->cur_part = next_part;
-    splitpad->reader = splitmux->parts[splitpad->cur_part];
+    splitpad->reader = reader;
+    splitpad->switch_start = gst_util_get_timestamp ();
     if (splitpad->part_pad)
       gst_object_unref (splitpad->part_pad);
     splitpad->part_pad =
@@ -1045,6 +1944,8 @@ gst_splitmux_end_of_part (GstSplitMuxSrc * splitmux, SplitMuxSrcPad * splitpad)
           goto error;
       }
       splitmux->cur_part = next_part;
+      gst_splitmux_src_preroll_next_locked (splitmux);
+      gst_splitmux_src_schedule_prepare_ahead_locked (splitmux);
     }
     res = TRUE;
   }
@@ -1098,6 +1999,7 @@ splitmux_src_pad_class_init (SplitMuxSrcPadClass * klass)
 static void
 splitmux_src_pad_init (SplitMuxSrcPad * pad)
 {
+  pad->switch_start = GST_CLOCK_TIME_NONE;
 }
 
 /* Event handler for source pads. Proxy events into the child
@@ -1122,6 +2024,7 @@ splitmux_src_pad_event (GstPad * pad, GstObject * parent, GstEvent * event)
       guint32 seqnum;
       gint i;
       GstClockTime part_start, position;
+      GstSplitMuxPartReader *prerolled;
       GList *cur;
       GstSegment tmp;
 
@@ -1165,7 +2068,15 @@ splitmux_src_pad_event (GstPad * pad, GstObject * parent, GstEvent * event)
       /* Send flush_start */
       gst_splitmux_push_event (splitmux, gst_event_new_flush_start (), seqnum);
 
-      /* Stop all parts, which will work because of the flush */
+      /* Stop all parts, which will work because of the flush. That
+       * includes a part pre-rolled after the current one */
+      prerolled = NULL;
+      if (splitmux->cur_part + 1 < splitmux->num_parts &&
+          splitmux->parts[splitmux->cur_part + 1] != NULL &&
+          gst_splitmux_part_reader_is_active (splitmux->parts[splitmux->
+                  cur_part + 1]))
+        prerolled = gst_object_ref (splitmux->parts[splitmux->cur_part + 1]);
+
       SPLITMUX_SRC_PADS_LOCK (splitmux);
       SPLITMUX_SRC_UNLOCK (splitmux);
       for (cur = g_list_first (splitmux->pads);
@@ -1174,6 +2085,10 @@ splitmux_src_pad_event (GstPad * pad, GstObject * parent, GstEvent * event)
         GstSplitMuxPartReader *reader = splitmux->parts[target->cur_part];
         gst_splitmux_part_reader_deactivate (reader);
       }
+      if (prerolled != NULL) {
+        gst_splitmux_part_reader_deactivate (prerolled);
+        gst_object_unref (prerolled);
+      }
 
       /* Shut down pad tasks */
       GST_DEBUG_OBJECT (splitmux, "Pausing pad tasks");
@@ -1193,20 +2108,33 @@ splitmux_src_pad_event (GstPad * pad, GstObject * parent, GstEvent * event)
       gst_segment_copy_into (&tmp, &splitmux->play_segment);
       splitmux->segment_seqnum = seqnum;
 
-      /* Work out where to start from now */
+      /* Work out where to start from now. Parts that haven't been
+       * measured yet are picked by their estimated offsets */
       for (i = 0; i < splitmux->num_parts; i++) {
-        GstSplitMuxPartReader *reader = splitmux->parts[i];
-        GstClockTime part_end =
-            gst_splitmux_part_reader_get_end_offset (reader);
-
-        if (part_end > position)
+        if (splitmux->part_info[i].end_offset > position)
           break;
       }
       if (i == splitmux->num_parts)
         i = splitmux->num_parts - 1;
 
-      part_start =
-          gst_splitmux_part_reader_get_start_offset (splitmux->parts[i]);
+      part_start = splitmux->part_info[i].start_offset;
+
+      /* With keyframes in the index, a key unit seek is resolved here and
+       * the part's demuxer gets a plain seek straight to the keyframe */
+      if ((flags & GST_SEEK_FLAG_KEY_UNIT) &&
+          ((rate > 0 && start_type == GST_SEEK_TYPE_SET) ||
+              (rate < 0 && stop_type == GST_SEEK_TYPE_SET)) &&
+          gst_splitmux_src_snap_to_keyframe_locked (splitmux, i, flags,
+              &position)) {
+        if (rate > 0) {
+          splitmux->play_segment.start = position;
+          splitmux->play_segment.time = position;
+        } else {
+          splitmux->play_segment.stop = position;
+        }
+        splitmux->play_segment.position = position;
+        flags &= ~(GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_SNAP_NEAREST);
+      }
 
       GST_DEBUG_OBJECT (splitmux,
           "Seek to time %" GST_TIME_FORMAT " landed in part %d offset %"
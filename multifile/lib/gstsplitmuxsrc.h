@@ -38,6 +38,25 @@ G_BEGIN_DECLS
 
 typedef struct _GstSplitMuxSrc GstSplitMuxSrc;
 typedef struct _GstSplitMuxSrcClass GstSplitMuxSrcClass;
+typedef struct _SplitMuxPartInfo SplitMuxPartInfo;
+
+/* What is known about a part, whether or not it has a prepared reader.
+ * Offsets and duration are estimates until the part has been measured */
+struct _SplitMuxPartInfo
+{
+  gchar *path;
+  guint64 size;
+
+  GstClockTime start_offset;
+  GstClockTime end_offset;
+  GstClockTime duration;
+  GArray *keyframes;    /* GstSplitMuxIndexKeyframe from the index, with
+                         * times relative to the start of the part */
+
+  gboolean indexed;     /* duration comes from the fragment index */
+  gboolean measured;    /* offsets and duration come from a prepared reader */
+  gboolean preparing;
+};
 
 struct _GstSplitMuxSrc
 {
@@ -47,11 +66,29 @@ struct _GstSplitMuxSrc
   gboolean     running;
 
   gchar       *location;  /* OBJECT_LOCK */
-
-  GstSplitMuxPartReader **parts;
+  gchar       *index_location;  /* OBJECT_LOCK */
+  gboolean     write_index;     /* OBJECT_LOCK */
+  gboolean     lazy_prepare;    /* OBJECT_LOCK */
+  guint        lookahead;       /* OBJECT_LOCK */
+  guint        prepare_workers; /* OBJECT_LOCK */
+  guint        max_open_parts;  /* OBJECT_LOCK */
+  gboolean     preroll_next_part; /* OBJECT_LOCK */
+
+  GstSplitMuxPartReader **parts; /* NULL for parts that aren't prepared */
+  SplitMuxPartInfo *part_info;
+  GQueue       open_parts;  /* indices of prepared parts, least recently used first */
+  gchar       *index_to_write;  /* index to write the measured parts to on stop */
+  guint        num_files;
   guint        num_parts;
   guint        cur_part;
 
+  GCond        prepare_cond;
+  guint        n_preparing;
+  gboolean     preparing_ahead;
+  guint        n_measured;
+  guint64      measured_bytes;
+  GstClockTime measured_time;
+
   gboolean pads_complete;
   GMutex pads_lock;
   GList  *pads; /* pads_lock */
@@ -90,6 +127,8 @@ struct _SplitMuxSrcPad
   gboolean sent_stream_start;
   gboolean sent_caps;
   gboolean sent_segment;
+
+  GstClockTime switch_start;    /* when the pad moved on to the next part */
 };
 
 struct _SplitMuxSrcPadClass
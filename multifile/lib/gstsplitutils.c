@@ -22,7 +22,9 @@
 #  include "config.h"
 #endif
 
+#include <errno.h>
 #include <string.h>
+#include <glib/gstdio.h>
 
 #include "gstsplitutils.h"
 #include "patternspec.h"
@@ -103,3 +105,218 @@ no_matches:
     return NULL;
   }
 }
+
+#define INDEX_GROUP "splitmux-index"
+#define INDEX_VERSION 1
+#define INDEX_FRAGMENT_GROUP "fragment-"
+
+GstSplitMuxIndexEntry *
+gst_split_util_index_entry_new (void)
+{
+  GstSplitMuxIndexEntry *entry = g_slice_new0 (GstSplitMuxIndexEntry);
+
+  entry->start = entry->end = GST_CLOCK_TIME_NONE;
+  entry->keyframes = g_array_new (FALSE, FALSE,
+      sizeof (GstSplitMuxIndexKeyframe));
+
+  return entry;
+}
+
+void
+gst_split_util_index_entry_free (GstSplitMuxIndexEntry * entry)
+{
+  g_free (entry->location);
+  g_array_free (entry->keyframes, TRUE);
+  g_slice_free (GstSplitMuxIndexEntry, entry);
+}
+
+static void
+format_index_entry (GString * s, guint n, const GstSplitMuxIndexEntry * entry)
+{
+  gchar *location;
+  guint i;
+
+  location = g_strescape (entry->location ? entry->location : "", NULL);
+  g_string_append_printf (s, "\n[" INDEX_FRAGMENT_GROUP "%u]\n"
+      "location=%s\nstart=%" G_GUINT64_FORMAT "\nend=%" G_GUINT64_FORMAT
+      "\nsize=%" G_GUINT64_FORMAT "\nkeyframes=", n, location,
+      entry->start, entry->end, entry->size);
+  g_free (location);
+
+  for (i = 0; i < entry->keyframes->len; i++) {
+    GstSplitMuxIndexKeyframe *kf =
+        &g_array_index (entry->keyframes, GstSplitMuxIndexKeyframe, i);
+
+    g_string_append_printf (s, "%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ";",
+        kf->time, kf->offset);
+  }
+  g_string_append_c (s, '\n');
+}
+
+/* Append @entry as fragment @n to the index at @path. The file is
+ * recreated with its header for n == 0, so the groups are only ever
+ * appended and a crashed recording leaves a readable index behind */
+gboolean
+gst_split_util_index_append (const gchar * path, guint n,
+    const GstSplitMuxIndexEntry * entry, GError ** err)
+{
+  GString *s = g_string_new (NULL);
+  gboolean ret = TRUE;
+  FILE *file;
+
+  if (n == 0)
+    g_string_append_printf (s, "[" INDEX_GROUP "]\nversion=%d\n",
+        INDEX_VERSION);
+  format_index_entry (s, n, entry);
+
+  file = g_fopen (path, n == 0 ? "wb" : "ab");
+  if (file == NULL) {
+    g_set_error (err, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "Could not open index %s: %s", path, g_strerror (errno));
+    ret = FALSE;
+  } else {
+    if (fwrite (s->str, 1, s->len, file) != s->len) {
+      g_set_error (err, G_FILE_ERROR, g_file_error_from_errno (errno),
+          "Could not write index %s: %s", path, g_strerror (errno));
+      ret = FALSE;
+    }
+    fclose (file);
+  }
+  g_string_free (s, TRUE);
+
+  return ret;
+}
+
+/* Returns the contents of an index holding @entries, a
+ * GstSplitMuxIndexEntry array in fragment order, and its @length */
+gchar *
+gst_split_util_index_serialize (const GPtrArray * entries, gsize * length)
+{
+  GString *s = g_string_new (NULL);
+  guint i;
+
+  g_string_append_printf (s, "[" INDEX_GROUP "]\nversion=%d\n",
+      INDEX_VERSION);
+  for (i = 0; i < entries->len; i++)
+    format_index_entry (s, i, g_ptr_array_index (entries, i));
+
+  *length = s->len;
+  return g_string_free (s, FALSE);
+}
+
+/* Replace the index at @path with @entries. The file is written in one go
+ * and renamed over the old one, so readers see either index whole */
+gboolean
+gst_split_util_index_write (const gchar * path, const GPtrArray * entries,
+    GError ** err)
+{
+  gboolean ret;
+  gchar *data;
+  gsize length;
+
+  data = gst_split_util_index_serialize (entries, &length);
+  ret = g_file_set_contents (path, data, length, err);
+  g_free (data);
+
+  return ret;
+}
+
+static gboolean
+parse_index_keyframes (const gchar * str, GArray * keyframes)
+{
+  gchar **items = g_strsplit (str, ";", -1);
+  gboolean ret = TRUE;
+  guint i;
+
+  for (i = 0; items[i] != NULL; i++) {
+    GstSplitMuxIndexKeyframe kf;
+    gchar *end;
+
+    if (items[i][0] == '\0')
+      continue;
+
+    kf.time = g_ascii_strtoull (items[i], &end, 10);
+    if (*end != ':') {
+      ret = FALSE;
+      break;
+    }
+    kf.offset = g_ascii_strtoull (end + 1, &end, 10);
+    if (*end != '\0') {
+      ret = FALSE;
+      break;
+    }
+    g_array_append_val (keyframes, kf);
+  }
+  g_strfreev (items);
+
+  return ret;
+}
+
+/* Returns the GstSplitMuxIndexEntry of the index at @path in fragment
+ * order, or NULL on error */
+GPtrArray *
+gst_split_util_index_load (const gchar * path, GError ** err)
+{
+  GKeyFile *kf = g_key_file_new ();
+  GPtrArray *entries = NULL;
+  gchar **groups = NULL;
+  guint i;
+
+  if (!g_key_file_load_from_file (kf, path, G_KEY_FILE_NONE, err))
+    goto done;
+
+  if (g_key_file_get_integer (kf, INDEX_GROUP, "version", NULL) !=
+      INDEX_VERSION) {
+    g_set_error (err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+        "%s is not a splitmux index of version %d", path, INDEX_VERSION);
+    goto done;
+  }
+
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gst_split_util_index_entry_free);
+  groups = g_key_file_get_groups (kf, NULL);
+
+  for (i = 0; groups[i] != NULL; i++) {
+    GstSplitMuxIndexEntry *entry;
+    GError *e = NULL;
+    gchar *str;
+
+    if (!g_str_has_prefix (groups[i], INDEX_FRAGMENT_GROUP))
+      continue;
+
+    entry = gst_split_util_index_entry_new ();
+    g_ptr_array_add (entries, entry);
+
+    str = g_key_file_get_value (kf, groups[i], "location", &e);
+    if (str) {
+      entry->location = g_strcompress (str);
+      g_free (str);
+    }
+    if (e == NULL)
+      entry->start = g_key_file_get_uint64 (kf, groups[i], "start", &e);
+    if (e == NULL)
+      entry->end = g_key_file_get_uint64 (kf, groups[i], "end", &e);
+    if (e == NULL)
+      entry->size = g_key_file_get_uint64 (kf, groups[i], "size", &e);
+    if (e == NULL) {
+      str = g_key_file_get_value (kf, groups[i], "keyframes", &e);
+      if (str && !parse_index_keyframes (str, entry->keyframes))
+        g_set_error (&e, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+            "Invalid keyframes");
+      g_free (str);
+    }
+
+    if (e != NULL) {
+      g_propagate_prefixed_error (err, e, "%s [%s]: ", path, groups[i]);
+      g_ptr_array_unref (entries);
+      entries = NULL;
+      goto done;
+    }
+  }
+
+done:
+  g_strfreev (groups);
+  g_key_file_unref (kf);
+
+  return entries;
+}
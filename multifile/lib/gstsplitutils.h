@@ -35,6 +35,43 @@ gchar **
 gst_split_util_find_files (const gchar * dirname,
     const gchar * basename, GError ** err);
 
+/* Fragment index written by splitmuxsink next to a recording, one key file
+ * group per closed fragment, appended as fragments are closed */
+typedef struct _GstSplitMuxIndexKeyframe
+{
+  GstClockTime time;            /* running time of the keyframe */
+  guint64 offset;               /* bytes the sink had written before it */
+} GstSplitMuxIndexKeyframe;
+
+typedef struct _GstSplitMuxIndexEntry
+{
+  gchar *location;
+  GstClockTime start;           /* running time the fragment was opened at */
+  GstClockTime end;             /* running time the fragment was closed at */
+  guint64 size;
+  GArray *keyframes;            /* GstSplitMuxIndexKeyframe */
+} GstSplitMuxIndexEntry;
+
+GstSplitMuxIndexEntry *
+gst_split_util_index_entry_new (void);
+
+void
+gst_split_util_index_entry_free (GstSplitMuxIndexEntry * entry);
+
+gboolean
+gst_split_util_index_append (const gchar * path, guint n,
+    const GstSplitMuxIndexEntry * entry, GError ** err);
+
+gchar *
+gst_split_util_index_serialize (const GPtrArray * entries, gsize * length);
+
+gboolean
+gst_split_util_index_write (const gchar * path, const GPtrArray * entries,
+    GError ** err);
+
+GPtrArray *
+gst_split_util_index_load (const gchar * path, GError ** err);
+
 G_END_DECLS
 
 #endif
@@ -0,0 +1,154 @@
+#include <gst/gst.h>
+#include <sys/resource.h>
+
+/* Muxes one raw video stream and a growing number of audio streams
+ * through cussplitmuxsink into a fakesink, and reports how long it took
+ * and how often the process was switched out. Raw video makes every
+ * buffer a keyframe, so each one closes a GOP and wakes the stream
+ * threads waiting on it. With wakeups per context the context switches
+ * should grow with the number of streams, not with its square */
+
+#define N_BUFFERS 3000
+#define MAX_SIZE_TIME (1 * GST_SECOND)
+
+/* 1 video + 8 audio is the reference case */
+static const guint n_audio_streams[] = { 1, 4, 8, 16 };
+
+static gboolean
+link_source (GstElement * pipeline, GstElement * splitmux,
+    const gchar * description, const gchar * pad_name)
+{
+  GstElement *src;
+  GstPad *srcpad, *sinkpad;
+  GError *err = NULL;
+  gboolean ret;
+
+  src = gst_parse_bin_from_description (description, TRUE, &err);
+  if (src == NULL) {
+    g_print ("Could not create %s: %s\n", description, err->message);
+    g_error_free (err);
+    return FALSE;
+  }
+  gst_bin_add (GST_BIN (pipeline), src);
+
+  srcpad = gst_element_get_static_pad (src, "src");
+  sinkpad = gst_element_get_request_pad (splitmux, pad_name);
+  ret = sinkpad != NULL && gst_pad_link (srcpad, sinkpad) == GST_PAD_LINK_OK;
+  gst_object_unref (srcpad);
+  if (sinkpad)
+    gst_object_unref (sinkpad);
+
+  return ret;
+}
+
+static gboolean
+run (guint n_audio)
+{
+  GstElement *pipeline, *splitmux, *muxer, *sink;
+  GstStructure *stats = NULL;
+  struct rusage before, after;
+  GstMessage *msg;
+  gchar *description, *str;
+  gint64 start, elapsed;
+  glong voluntary, involuntary;
+  gdouble seconds;
+  gboolean ret = TRUE;
+  guint i;
+
+  pipeline = gst_pipeline_new (NULL);
+  splitmux = gst_element_factory_make ("cussplitmuxsink", NULL);
+  muxer = gst_element_factory_make ("matroskamux", NULL);
+  sink = gst_element_factory_make ("fakesink", NULL);
+  if (splitmux == NULL || muxer == NULL || sink == NULL) {
+    g_print ("cussplitmuxsink, matroskamux or fakesink not available\n");
+    return FALSE;
+  }
+
+  g_object_set (sink, "sync", FALSE, NULL);
+  g_object_set (splitmux, "muxer", muxer, "sink", sink,
+      "max-size-time", (guint64) MAX_SIZE_TIME, NULL);
+  gst_bin_add (GST_BIN (pipeline), splitmux);
+
+  description = g_strdup_printf ("videotestsrc num-buffers=%u ! "
+      "video/x-raw,format=I420,width=64,height=48,framerate=30/1", N_BUFFERS);
+  ret = link_source (pipeline, splitmux, description, "video");
+  g_free (description);
+
+  /* 1470 samples at 44100 Hz match the video frame duration */
+  description = g_strdup_printf ("audiotestsrc num-buffers=%u "
+      "samplesperbuffer=1470 ! audio/x-raw,rate=44100,channels=1",
+      N_BUFFERS);
+  for (i = 0; ret && i < n_audio; i++)
+    ret = link_source (pipeline, splitmux, description, "audio_%u");
+  g_free (description);
+
+  if (!ret) {
+    g_print ("Could not link the sources\n");
+    gst_object_unref (pipeline);
+    return FALSE;
+  }
+
+  getrusage (RUSAGE_SELF, &before);
+  start = g_get_monotonic_time ();
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  msg = gst_bus_timed_pop_filtered (GST_ELEMENT_BUS (pipeline),
+      GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  elapsed = g_get_monotonic_time () - start;
+  getrusage (RUSAGE_SELF, &after);
+
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    GError *err;
+
+    gst_message_parse_error (msg, &err, NULL);
+    g_print ("Error from %s: %s\n", GST_OBJECT_NAME (msg->src), err->message);
+    g_error_free (err);
+    ret = FALSE;
+  } else {
+    g_object_get (splitmux, "stats", &stats, NULL);
+  }
+  gst_message_unref (msg);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+
+  if (!ret)
+    return FALSE;
+
+  voluntary = after.ru_nvcsw - before.ru_nvcsw;
+  involuntary = after.ru_nivcsw - before.ru_nivcsw;
+  seconds = MAX (elapsed, 1) / (gdouble) G_USEC_PER_SEC;
+
+  g_print ("%2u audio streams: %6" G_GINT64_FORMAT " ms wall, %6ld ms cpu, "
+      "%9.0f context switches/s (%ld voluntary, %ld involuntary)\n", n_audio,
+      elapsed / 1000,
+      (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1000 +
+      (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1000 +
+      (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000 +
+      (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1000,
+      (voluntary + involuntary) / seconds, voluntary, involuntary);
+
+  if (stats) {
+    str = gst_structure_to_string (stats);
+    g_print ("  %s\n", str);
+    g_free (str);
+    gst_structure_free (stats);
+  }
+
+  return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+  guint i;
+
+  gst_init (&argc, &argv);
+
+  for (i = 0; i < G_N_ELEMENTS (n_audio_streams); i++) {
+    if (!run (n_audio_streams[i]))
+      return 1;
+  }
+
+  return 0;
+}
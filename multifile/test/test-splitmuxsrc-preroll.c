@@ -0,0 +1,211 @@
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+/* Records a few parts with cussplitmuxsink, then plays them back with
+ * cussplitmuxsrc with and without preroll-next-part. The gap at a part
+ * switch is the wall clock time between the last buffer of one part and
+ * the first of the next arriving at the sink. The parts start at the
+ * running times of the splitmuxsink-fragment-opened messages */
+
+#define N_BUFFERS 300
+#define MAX_SIZE_TIME (1 * GST_SECOND)
+#define N_RUNS 5
+
+typedef struct _GapData
+{
+  GArray *part_starts;          /* GstClockTime, start of each part after the first */
+  guint next_part;
+  gint64 last_arrival;
+  gint64 max_gap;               /* largest gap at a part switch, us */
+  gint64 total_gap;             /* sum of the gaps at part switches, us */
+  guint n_gaps;
+} GapData;
+
+static gboolean
+record (const gchar * dir, GArray * part_starts)
+{
+  GstElement *pipeline, *splitmux;
+  GError *err = NULL;
+  gchar *description;
+  gboolean ret = FALSE;
+  GstBus *bus;
+
+  description = g_strdup_printf ("videotestsrc num-buffers=%u ! "
+      "video/x-raw,format=I420,width=320,height=240,framerate=30/1 ! "
+      "cussplitmuxsink name=splitmux muxer=matroskamux "
+      "location=%s/part%%05d.mkv max-size-time=%" G_GUINT64_FORMAT,
+      N_BUFFERS, dir, (guint64) MAX_SIZE_TIME);
+  pipeline = gst_parse_launch (description, &err);
+  g_free (description);
+  if (pipeline == NULL) {
+    g_print ("Could not create the recording pipeline: %s\n", err->message);
+    g_error_free (err);
+    return FALSE;
+  }
+  splitmux = gst_bin_get_by_name (GST_BIN (pipeline), "splitmux");
+
+  bus = gst_element_get_bus (pipeline);
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  while (TRUE) {
+    GstMessage *msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+        GST_MESSAGE_EOS | GST_MESSAGE_ERROR | GST_MESSAGE_ELEMENT);
+
+    if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ELEMENT) {
+      const GstStructure *s = gst_message_get_structure (msg);
+      GstClockTime running_time;
+
+      if (GST_MESSAGE_SRC (msg) == GST_OBJECT_CAST (splitmux) &&
+          gst_structure_has_name (s, "splitmuxsink-fragment-opened") &&
+          gst_structure_get_clock_time (s, "running-time", &running_time) &&
+          running_time > 0)
+        g_array_append_val (part_starts, running_time);
+      gst_message_unref (msg);
+      continue;
+    }
+
+    ret = GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS;
+    if (!ret)
+      g_print ("Recording failed\n");
+    gst_message_unref (msg);
+    break;
+  }
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (bus);
+  gst_object_unref (splitmux);
+  gst_object_unref (pipeline);
+
+  return ret;
+}
+
+static GstPadProbeReturn
+buffer_arrived (GstPad * pad, GstPadProbeInfo * info, GapData * data)
+{
+  GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+  gint64 now = g_get_monotonic_time ();
+
+  if (data->next_part < data->part_starts->len && data->last_arrival > 0 &&
+      GST_BUFFER_PTS_IS_VALID (buf) && GST_BUFFER_PTS (buf) >=
+      g_array_index (data->part_starts, GstClockTime, data->next_part)) {
+    gint64 gap = now - data->last_arrival;
+
+    data->max_gap = MAX (data->max_gap, gap);
+    data->total_gap += gap;
+    data->n_gaps++;
+    data->next_part++;
+  }
+  data->last_arrival = now;
+
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+play (const gchar * dir, GArray * part_starts, gboolean preroll,
+    GapData * data)
+{
+  GstElement *pipeline, *src, *sink;
+  GstMessage *msg;
+  GError *err = NULL;
+  gchar *description;
+  gboolean ret;
+  GstPad *pad;
+
+  description = g_strdup_printf ("cussplitmuxsrc name=src "
+      "location=%s/part*.mkv ! fakesink name=sink sync=false", dir);
+  pipeline = gst_parse_launch (description, &err);
+  g_free (description);
+  if (pipeline == NULL) {
+    g_print ("Could not create the playback pipeline: %s\n", err->message);
+    g_error_free (err);
+    return FALSE;
+  }
+
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  g_object_set (src, "preroll-next-part", preroll, NULL);
+
+  memset (data, 0, sizeof (GapData));
+  data->part_starts = part_starts;
+  pad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) buffer_arrived, data, NULL);
+  gst_object_unref (pad);
+
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  msg = gst_bus_timed_pop_filtered (GST_ELEMENT_BUS (pipeline),
+      GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  ret = GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS;
+  if (!ret)
+    g_print ("Playback failed\n");
+  gst_message_unref (msg);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (src);
+  gst_object_unref (sink);
+  gst_object_unref (pipeline);
+
+  if (ret && data->n_gaps != part_starts->len) {
+    g_print ("Saw %u of %u part switches\n", data->n_gaps, part_starts->len);
+    ret = FALSE;
+  }
+
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  GArray *part_starts;
+  gboolean ret = TRUE;
+  const gchar *name;
+  gchar *dir;
+  GDir *d;
+  guint i, preroll;
+
+  gst_init (&argc, &argv);
+
+  dir = g_dir_make_tmp ("splitmuxsrc-preroll-XXXXXX", NULL);
+  part_starts = g_array_new (FALSE, FALSE, sizeof (GstClockTime));
+
+  if (!record (dir, part_starts) || part_starts->len == 0) {
+    g_print ("No parts recorded\n");
+    ret = FALSE;
+  }
+
+  for (preroll = 0; ret && preroll < 2; preroll++) {
+    gint64 max_gap = 0, total_gap = 0;
+    guint n_gaps = 0;
+
+    for (i = 0; ret && i < N_RUNS; i++) {
+      GapData data;
+
+      ret = play (dir, part_starts, preroll, &data);
+      max_gap = MAX (max_gap, data.max_gap);
+      total_gap += data.total_gap;
+      n_gaps += data.n_gaps;
+    }
+
+    if (ret)
+      g_print ("preroll-next-part=%s: %u part switches, mean gap %"
+          G_GINT64_FORMAT " us, max gap %" G_GINT64_FORMAT " us\n",
+          preroll ? "true" : "false", n_gaps, total_gap / MAX (n_gaps, 1),
+          max_gap);
+  }
+
+  d = g_dir_open (dir, 0, NULL);
+  while (d && (name = g_dir_read_name (d)) != NULL) {
+    gchar *path = g_build_filename (dir, name, NULL);
+
+    g_unlink (path);
+    g_free (path);
+  }
+  if (d)
+    g_dir_close (d);
+  g_rmdir (dir);
+  g_free (dir);
+  g_array_free (part_starts, TRUE);
+
+  return ret ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+#include "gstsplitutils.h"
+
+#define N_FRAGMENTS 4
+#define N_KEYFRAMES 3
+
+static GstSplitMuxIndexEntry *
+make_entry (guint n, const gchar * location)
+{
+  GstSplitMuxIndexEntry *entry = gst_split_util_index_entry_new ();
+  guint i;
+
+  entry->location = g_strdup (location);
+  entry->start = n * 10 * GST_SECOND;
+  entry->end = (n + 1) * 10 * GST_SECOND;
+  entry->size = 1000000 + n;
+
+  for (i = 0; i < N_KEYFRAMES; i++) {
+    GstSplitMuxIndexKeyframe kf;
+
+    kf.time = entry->start + i * 2 * GST_SECOND;
+    kf.offset = i * 4096;
+    g_array_append_val (entry->keyframes, kf);
+  }
+
+  return entry;
+}
+
+static gboolean
+entries_equal (const GstSplitMuxIndexEntry * a,
+    const GstSplitMuxIndexEntry * b)
+{
+  guint i;
+
+  if (g_strcmp0 (a->location, b->location) != 0 || a->start != b->start
+      || a->end != b->end || a->size != b->size
+      || a->keyframes->len != b->keyframes->len)
+    return FALSE;
+
+  for (i = 0; i < a->keyframes->len; i++) {
+    GstSplitMuxIndexKeyframe *ka =
+        &g_array_index (a->keyframes, GstSplitMuxIndexKeyframe, i);
+    GstSplitMuxIndexKeyframe *kb =
+        &g_array_index (b->keyframes, GstSplitMuxIndexKeyframe, i);
+
+    if (ka->time != kb->time || ka->offset != kb->offset)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Load @path and compare it with @expected. Returns FALSE on mismatch */
+static gboolean
+check_index (const gchar * path, GPtrArray * expected)
+{
+  GPtrArray *loaded;
+  GError *err = NULL;
+  gboolean ret = TRUE;
+  guint i;
+
+  loaded = gst_split_util_index_load (path, &err);
+  if (loaded == NULL) {
+    g_print ("Could not load index: %s\n", err->message);
+    g_error_free (err);
+    return FALSE;
+  }
+
+  if (loaded->len != expected->len) {
+    g_print ("Loaded %u entries, expected %u\n", loaded->len, expected->len);
+    ret = FALSE;
+  }
+
+  for (i = 0; ret && i < loaded->len; i++) {
+    if (!entries_equal (g_ptr_array_index (loaded, i),
+            g_ptr_array_index (expected, i))) {
+      g_print ("Entry %u differs\n", i);
+      ret = FALSE;
+    }
+  }
+  g_ptr_array_unref (loaded);
+
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  GPtrArray *entries;
+  GError *err = NULL;
+  gchar *dir, *path, *location;
+  gboolean ok = TRUE;
+  guint i;
+
+  gst_init (&argc, &argv);
+
+  dir = g_dir_make_tmp ("splitutils-index-XXXXXX", NULL);
+  path = g_build_filename (dir, "index.txt", NULL);
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gst_split_util_index_entry_free);
+
+  /* Appended one fragment at a time, the way splitmuxsink does. The
+   * locations need escaping */
+  for (i = 0; ok && i < N_FRAGMENTS; i++) {
+    location = g_strdup_printf ("/tmp/out \"%u\"\t.mp4", i);
+    g_ptr_array_add (entries, make_entry (i, location));
+    g_free (location);
+
+    if (!gst_split_util_index_append (path, i,
+            g_ptr_array_index (entries, i), &err)) {
+      g_print ("Could not append to index: %s\n", err->message);
+      g_clear_error (&err);
+      ok = FALSE;
+    }
+  }
+  if (ok && !check_index (path, entries))
+    ok = FALSE;
+  g_print ("append/load round trip: %s\n", ok ? "ok" : "FAILED");
+
+  /* Rewritten whole, as with max-files, after dropping the first entry */
+  if (ok) {
+    g_ptr_array_remove_index (entries, 0);
+    if (!gst_split_util_index_write (path, entries, &err)) {
+      g_print ("Could not write index: %s\n", err->message);
+      g_clear_error (&err);
+      ok = FALSE;
+    } else if (!check_index (path, entries)) {
+      ok = FALSE;
+    }
+    g_print ("write/load round trip: %s\n", ok ? "ok" : "FAILED");
+  }
+
+  g_ptr_array_unref (entries);
+  g_unlink (path);
+  g_rmdir (dir);
+  g_free (path);
+  g_free (dir);
+
+  return ok ? 0 : 1;
+}